@@ -3,8 +3,13 @@
 
 #include <QObject>
 #include <QTimer>
+#include <QVariant>
+
+#include <vector>
 
 #include "ProcessControl.hpp"
+#include "frametiming.hpp"
+#include "stagetelemetry.hpp"
 
 class ControlInterface : public QObject {
     Q_OBJECT
@@ -17,9 +22,11 @@ public:
         timer = new QTimer(this);
         connect(timer, &QTimer::timeout, this, QOverload<>::of(&ControlInterface::updateOnce));
         //timer->start(3000);
+        process_control::setWakeCallback(wake, this);
     }
 
     ~ControlInterface() {
+        process_control::setWakeCallback(nullptr, nullptr);
         delete[] permanentImageData;
         timer->stop();
         delete timer;
@@ -95,12 +102,68 @@ public:
         fflush(stdout);
     }
 
+    //per-stage still capture latency (p50/p99)
+    Q_INVOKABLE
+    QString frameTimingReport() {
+        char buffer[1024];
+        frame_timing::report(buffer, sizeof(buffer));
+        return QString(buffer);
+    }
+
+    //Stage samples taken after since, in milliseconds on CLOCK_MONOTONIC, for
+    //plotting motion: t in milliseconds, x and y in millimeters, and settled.
+    //Read from the telemetry ring, so the stage is never polled for them.
+    Q_INVOKABLE
+    QVariantList stageSamples(double since) {
+        std::vector<stage_telemetry::Sample> samples(stage_telemetry::RING_SIZE);
+        int count = stage_telemetry::read(since > 0 ? (unsigned long long) (since * 1e6) : 0,
+                                          samples.data(), samples.size());
+        QVariantList list;
+
+        for(int i = 0; i < count; i++) {
+            QVariantMap sample;
+            sample["t"] = samples[i].time / 1e6;
+            sample["x"] = stage_controller::microstepsToMillimeters(samples[i].x);
+            sample["y"] = stage_controller::microstepsToMillimeters(samples[i].y);
+            sample["settled"] = samples[i].stageStatus == stage_controller::STAGE_IN_POSITION;
+            list.append(sample);
+        }
+
+        return list;
+    }
+
+    //latest position and velocity in millimeters (per second), and the
+    //milliseconds left to the target, -1 if unknown; empty before any sample
+    Q_INVOKABLE
+    QVariantMap stageMotion() {
+        stage_telemetry::Estimate estimate;
+        QVariantMap motion;
+
+        if(stage_telemetry::estimate(estimate)) {
+            motion["t"] = estimate.time / 1e6;
+            motion["x"] = estimate.x;
+            motion["y"] = estimate.y;
+            motion["velocityX"] = estimate.velocityX;
+            motion["velocityY"] = estimate.velocityY;
+            motion["timeToArrival"] = estimate.timeToArrival < 0 ? -1.0 : estimate.timeToArrival * 1000.0;
+            motion["settled"] = estimate.settledSince != 0;
+        }
+
+        return motion;
+    }
+
     DynamicImage *getImageProcessorResult() {
         return &imgProcResult;
     }
 
 private:
     DynamicImage imgProcResult;
+
+    //runs on worker threads; the update itself is queued to the GUI thread
+    static void wake(void *ctx) {
+        QMetaObject::invokeMethod((ControlInterface *) ctx, "updateOnce", Qt::QueuedConnection);
+    }
+
     QImage qimg;
     unsigned char *permanentImageData;
 
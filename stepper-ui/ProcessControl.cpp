@@ -9,12 +9,18 @@
 #include "cameramodule.hpp"
 #include "projectormodule.hpp"
 #include "stagecontroller.h"
+#include "stagetelemetry.hpp"
 #include "imageprocessor.hpp"
 
 #include <QImage>
+#include <chrono>
 #include <cmath>
 
 #include <cstdio>
+#include <atomic>
+#include <future>
+#include <vector>
+#include <algorithm>
 
 namespace process_control {
 
@@ -34,9 +40,36 @@ unsigned kernelHeight = 0;
 //last read motor position in wafer coordinates (millimeters)
 float currentX = 0;
 float currentY = 0;
+unsigned long long currentTime = 0;
 
 bool shouldStart = false;
 bool shouldAbort = false;
+static bool stillRequested = false;
+static bool exposureStarted = false;
+static bool devicesRequested = false;
+
+//stage move in flight; the stage I/O thread completes it between ticks
+static std::future<int> moveReply;
+
+//end of the move, reported by the stage motion watcher
+static std::atomic<bool> motionArrived(false);
+static int motionStatus = 0;
+static unsigned arrivedX = 0;
+static unsigned arrivedY = 0;
+
+//last commanded target, for predicting how long the next move takes
+static unsigned targetX = 0;
+static unsigned targetY = 0;
+
+//CLOCK_MONOTONIC time just after the current move was queued or sent; telemetry
+//polls queued later are answered after the move command
+static std::atomic<unsigned long long> moveQueued(0);
+
+//With a stage that runs sequences, the dies are downloaded as steps the stage
+//holds at until released, so moving on to a die is one frame and no halts.
+static bool sequenceMode = false;
+static int sequenceStart = 0;  //die of the first downloaded step
+static int sequenceLength = 0; //dies downloaded
 
 //each state should be designed for individual testing
 enum ControlState {
@@ -73,6 +106,12 @@ enum ControlResult update();  //executes current state or transitions to another
 enum ControlResult start();
 enum ControlResult abort();
 
+typedef void (*WakeCallback)(void *ctx);
+void setWakeCallback(WakeCallback callback, void *ctx);
+
+static WakeCallback wakeCallback = nullptr;
+static void *wakeCtx = nullptr;
+
 //state entry transition functions
 enum ControlResult enterReset();
 enum ControlResult enterAwaitUpload();
@@ -82,6 +121,14 @@ enum ControlResult enterFineAlignImage();
 enum ControlResult enterFineAlignMotor();
 enum ControlResult enterExpose();
 
+//stage helpers
+static void startMove(unsigned x, unsigned y);
+static enum ControlResult pollStage(bool &ready, unsigned &x, unsigned &y, unsigned char &stat);
+static void motionDone(int status, unsigned x, unsigned y, void *ctx);
+static bool moveBySequence(int die);
+static void sequenceArrived(int status, int step, unsigned x, unsigned y, void *ctx);
+static void stageSettled(const stage_telemetry::Sample &sample, void *ctx);
+
 //state functions
 enum ControlResult executeReset();
 enum ControlResult executeAwaitUpload();
@@ -108,6 +155,17 @@ enum ControlResult update() {
     fflush(stdout);
 #endif
 
+    //finishes a background camera open and recovers from disconnects
+    camera_module::updateConnection();
+
+    stage_telemetry::Sample sample;
+
+    if(stage_telemetry::latest(sample)) {
+        currentX = stage_controller::microstepsToMillimeters(sample.x);
+        currentY = stage_controller::microstepsToMillimeters(sample.y);
+        currentTime = sample.time;
+    }
+
     if(shouldAbort) {
         nextState = STATE_RESET; //exit from current state and reset
     }
@@ -241,15 +299,27 @@ enum ControlResult enterReset() {
         projector_module::closeProjector();
     }
 
-    if(camera_module::isOpen()) {
+    if(camera_module::getOpenState() != camera_module::CAMERA_CLOSED) {
         camera_module::closeCamera();
     }
 
+    stage_telemetry::stop();
+    stage_controller::cancelMotionWatch();
+
+    if(sequenceMode && stage_controller::isOpen()) {
+        stage_controller::cancelSequence();
+    }
+
+    sequenceMode = false;
+
     if(stage_controller::isOpen()) {
         stage_controller::closeI2c();
         stage_controller::clearBuffer();
     }
 
+    moveReply = std::future<int>();
+    motionArrived = false;
+
     if(patternPoints != nullptr){
         delete[] patternPoints;
         patternPoints = nullptr;
@@ -260,6 +330,7 @@ enum ControlResult enterReset() {
         kernel = nullptr;
     }
 
+    devicesRequested = false;
     return RESULT_GOOD;
 }
 
@@ -270,21 +341,46 @@ enum ControlResult executeReset() {
 #endif
 
     enum ControlResult result = RESULT_GOOD;
-    nextState = STATE_AWAIT_UPLOAD;
 
-    if(!projector_module::openProjector()) {
-        nextState = STATE_ERROR;
-        result = RESULT_PROJECTOR_ERROR;
-    }
+    //the camera opens in the background; the other devices are quick
+    if(!devicesRequested) {
+        devicesRequested = true;
 
-    if(!camera_module::openCamera()) {
-        nextState = STATE_ERROR;
-        result = RESULT_CAMERA_ERROR;
+        if(!projector_module::openProjector()) {
+            nextState = STATE_ERROR;
+            result = RESULT_PROJECTOR_ERROR;
+        }
+
+        if(!camera_module::openCameraAsync()) {
+            nextState = STATE_ERROR;
+            result = RESULT_CAMERA_ERROR;
+        }
+
+        if(!stage_controller::openI2c()) {
+            nextState = STATE_ERROR;
+            result = RESULT_I2C_COMM_ERROR;
+        }
+        else {
+            stage_telemetry::setSettleCallback(stageSettled, nullptr);
+            stage_telemetry::start(STAGE_TELEMETRY_INTERVAL);
+        }
+
+        return result;
     }
 
-    if(!stage_controller::openI2c()) {
+    switch(camera_module::getOpenState()) {
+    case camera_module::CAMERA_OPEN:
+        nextState = STATE_AWAIT_UPLOAD;
+        break;
+    case camera_module::CAMERA_OPENING:
+#ifdef DEBUG_MODE_PROCESS_CONTROL
+        printf("[ProcessControl]   Waiting for camera\n");
+        fflush(stdout);
+#endif
+        break;
+    default:
         nextState = STATE_ERROR;
-        result = RESULT_I2C_COMM_ERROR;
+        result = RESULT_CAMERA_ERROR;
     }
 
     return result;
@@ -324,6 +420,22 @@ enum ControlResult executeAwaitUpload() {
     return RESULT_GOOD;
 }
 
+#ifdef EMULATION_MODE_CAMERA
+//stage position seen by the simulated camera, in wafer coordinates
+static bool simulatedStagePosition(float &x, float &y) {
+#ifdef EMULATION_MODE_I2C
+    unsigned motorX, motorY;
+    stage_controller::getEmulatedPosition(motorX, motorY);
+    x = stage_controller::microstepsToMillimeters(motorX);
+    y = stage_controller::microstepsToMillimeters(motorY);
+#else
+    x = currentX;
+    y = currentY;
+#endif
+    return true;
+}
+#endif
+
 enum ControlResult exitAwaitUpload() {
 #ifdef DEBUG_MODE_PROCESS_CONTROL
     printf("[ProcessControl] Exiting STATE_AWAIT_UPLOAD\n");
@@ -363,6 +475,33 @@ enum ControlResult exitAwaitUpload() {
         return RESULT_RECIPE_ERROR;
     }
 
+    projector_module::PatternMode patternMode = recipe.isGrayscale() ?
+                projector_module::PATTERN_GRAYSCALE : projector_module::PATTERN_BINARY;
+
+    //all patterns of the run are prepared now, so moving between dies never loads one
+    projector_module::clearPatterns();
+
+    if(!projector_module::loadPattern(recipe.getPatternPath(), patternMode)) {
+        return RESULT_PROJECTOR_ERROR;
+    }
+
+    std::vector<Recipe::Pattern> diePatterns = recipe.getPatterns();
+
+    for(unsigned i = 0; i < diePatterns.size(); i++) {
+        if(!projector_module::preloadPattern(diePatterns[i].id, diePatterns[i].path, patternMode)) {
+            return RESULT_PROJECTOR_ERROR;
+        }
+    }
+
+    //found now rather than at the first die, after alignment
+    if(!projector_module::canExpose((unsigned) (recipe.getExposureTime() * 1000000 + 0.5f))) {
+#ifdef DEBUG_MODE_PROCESS_CONTROL
+        printf("[ProcessControl]   Exposure time is too short for the projector's frame rate\n");
+        fflush(stdout);
+#endif
+        return RESULT_RECIPE_ERROR;
+    }
+
     tmp = tmp.convertToFormat(QImage::Format_Grayscale8);
     unsigned imageWidth = tmp.width();
     unsigned imageHeight = tmp.height();
@@ -375,6 +514,13 @@ enum ControlResult exitAwaitUpload() {
     }
 
     imageProcessor.setImage(pattern, imageWidth, imageHeight);
+
+#ifdef EMULATION_MODE_CAMERA
+    //previous layer on the simulated wafer is this layer's pattern at every die
+    camera_module::simulatedCamera.setScene(pattern, imageWidth, imageHeight, recipe.getDiePositions());
+    camera_module::simulatedCamera.setPositionSource(simulatedStagePosition);
+#endif
+
     delete[] pattern;
 
 #ifdef DEBUG_MODE_PROCESS_CONTROL
@@ -492,6 +638,8 @@ enum ControlResult exitReady() {
 #endif
 
     dieNumber = 0;
+    sequenceMode = stage_controller::getSequenceCapacity() > 0;
+    sequenceLength = 0;
     //wait for motors to be not moving
     return RESULT_GOOD;
 }
@@ -502,21 +650,179 @@ enum ControlResult enterCoarseAlign() {
     fflush(stdout);
 #endif
 
+    //optical correction from the previous die does not carry over
+    projector_module::clearTransform();
+
+    //main pattern is preloaded under its path
+    const char *patternId = recipe.getDiePattern(dieNumber);
+
+    if(!projector_module::selectPattern(patternId != nullptr ? patternId : recipe.getPatternPath())) {
+        return RESULT_PROJECTOR_ERROR;
+    }
+
     //get wafer coordinates in millimeters
     float xmm = recipe.getDiePositions()[dieNumber].x;
     float ymm = recipe.getDiePositions()[dieNumber].y;
 
+    //edge dies are clipped to the wafer outline
+    projector_module::setWaferMask(recipe.getWaferSize(), xmm, ymm);
+
     //convert to motor coordinates
     __u32 motorX = stage_controller::millimetersToMicrosteps(xmm);
     __u32 motorY = stage_controller::millimetersToMicrosteps(ymm);
 
-    //move motors
-    if(stage_controller::setPosition(motorX, motorY)) {
+    //move motors; the end of the move is reported to pollStage
+    if(sequenceMode && !moveBySequence(dieNumber)) {
+#ifdef DEBUG_MODE_PROCESS_CONTROL
+        printf("[ProcessControl]   Stage sequence failed; moving die by die\n");
+        fflush(stdout);
+#endif
+        stage_controller::cancelSequence();
+        sequenceMode = false;
+    }
+
+    if(!sequenceMode) {
+        startMove(motorX, motorY);
+    }
+
+    return RESULT_GOOD;
+}
+
+void setWakeCallback(WakeCallback callback, void *ctx) {
+    wakeCallback = callback;
+    wakeCtx = ctx;
+}
+
+//Queues a move and has the stage watcher report its end, waking the controller
+//instead of being polled every tick.
+static void startMove(unsigned x, unsigned y) {
+    unsigned expected = stage_controller::predictMoveTime(targetX, targetY, x, y);
+
+    stage_controller::cancelMotionWatch();
+    motionArrived = false;
+    targetX = x;
+    targetY = y;
+    stage_telemetry::setTarget(x, y);
+    moveReply = stage_controller::setPositionAsync(x, y);
+    moveQueued = stage_telemetry::now();
+    stage_controller::watchMotion(expected, motionDone, nullptr);
+}
+
+//runs on the watcher thread
+static void motionDone(int status, unsigned x, unsigned y, void *ctx) {
+    (void) ctx;
+    motionStatus = status;
+    arrivedX = x;
+    arrivedY = y;
+    motionArrived.store(true);
+
+    if(wakeCallback != nullptr) {
+        wakeCallback(wakeCtx);
+    }
+}
+
+//Releases the stage from the previous die, or downloads the dies from this one
+//on when it is past the downloaded ones.
+static bool moveBySequence(int die) {
+    //a move ended by telemetry can leave the watcher running
+    stage_controller::cancelMotionWatch();
+    moveReply = std::future<int>();
+    motionArrived = false;
+    moveQueued = ~0ULL; //until the stage has been sent on
+
+    if(die > sequenceStart && die < sequenceStart + sequenceLength) {
+        targetX = stage_controller::millimetersToMicrosteps(recipe.getDiePositions()[die].x);
+        targetY = stage_controller::millimetersToMicrosteps(recipe.getDiePositions()[die].y);
+        stage_telemetry::setTarget(targetX, targetY);
+
+        if(!stage_controller::releaseStep(die - 1 - sequenceStart))
+            return false;
+
+        moveQueued = stage_telemetry::now();
+        return true;
+    }
+
+    std::vector<Recipe::Point> dies = recipe.getDiePositions();
+    std::vector<stage_controller::SequenceStep> steps;
+    int end = std::min((int) dies.size(), die + stage_controller::getSequenceCapacity());
+
+    for(int i = die; i < end; i++) {
+        stage_controller::SequenceStep step = {stage_controller::millimetersToMicrosteps(dies[i].x),
+                                               stage_controller::millimetersToMicrosteps(dies[i].y),
+                                               0, stage_controller::STEP_HOLD};
+        steps.push_back(step);
+    }
+
+    sequenceStart = die;
+    sequenceLength = steps.size();
+    targetX = steps[0].x;
+    targetY = steps[0].y;
+    stage_telemetry::setTarget(targetX, targetY);
+
+    if(!stage_controller::uploadSequence(steps.data(), steps.size()) ||
+       !stage_controller::startSequence(sequenceArrived, nullptr))
+        return false;
+
+    moveQueued = stage_telemetry::now();
+    return true;
+}
+
+//runs on the watcher thread
+static void sequenceArrived(int status, int step, unsigned x, unsigned y, void *ctx) {
+    (void) step;
+    motionDone(status, x, y, ctx);
+}
+
+//runs on the telemetry thread; pollStage decides whether the move has ended
+static void stageSettled(const stage_telemetry::Sample &sample, void *ctx) {
+    (void) ctx;
+
+    if(sample.requested > moveQueued && wakeCallback != nullptr) {
+        wakeCallback(wakeCtx);
+    }
+}
+
+//Reports the position once the move has ended; ready stays false until then.
+//Whichever of the motion watcher and telemetry sees the stage settle first ends
+//the move, so capture can start at the first settled sample.
+static enum ControlResult pollStage(bool &ready, unsigned &x, unsigned &y, unsigned char &stat) {
+    ready = false;
+
+    if(moveReply.valid()) {
+        if(moveReply.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return RESULT_GOOD;
+        }
+
+        if(moveReply.get() != (int) stage_controller::GOOD) {
+            stage_controller::cancelMotionWatch();
+            stage_controller::halt();
+            return RESULT_MOTOR_ERROR;
+        }
+    }
+
+    stage_telemetry::Sample sample;
+
+    if(!motionArrived.load()) {
+        if(stage_telemetry::latest(sample) && sample.requested > moveQueued &&
+           sample.stageStatus == stage_controller::STAGE_IN_POSITION) {
+            x = sample.x;
+            y = sample.y;
+            stat = stage_controller::STAGE_IN_POSITION;
+            ready = true;
+        }
+
         return RESULT_GOOD;
     }
-    else {
+
+    if(motionStatus != (int) stage_controller::GOOD) {
         return RESULT_MOTOR_ERROR;
     }
+
+    x = arrivedX;
+    y = arrivedY;
+    stat = stage_controller::STAGE_IN_POSITION;
+    ready = true;
+    return RESULT_GOOD;
 }
 
 enum ControlResult executeCoarseAlign() {
@@ -524,12 +830,15 @@ enum ControlResult executeCoarseAlign() {
     printf("[ProcessControl] Executing STATE_COARSE_ALIGN\n");
     fflush(stdout);
 #endif
-    __u32 x, y;
-    __u8 stat;
+    unsigned x, y;
+    unsigned char stat;
+    bool ready;
 
-    //get x and y position of stage
-    if(!stage_controller::getPosition(x, y, stat)) {
-        return RESULT_MOTOR_ERROR;
+    //get x and y position of stage once the move has ended
+    enum ControlResult result = pollStage(ready, x, y, stat);
+
+    if(result != RESULT_GOOD || !ready) {
+        return result;
     }
 
     //if finished moving, go to next state
@@ -556,8 +865,8 @@ enum ControlResult exitCoarseAlign() {
     printf("[ProcessControl] Exiting STATE_COARSE_ALIGN\n");
     fflush(stdout);
 #endif
-    //send halt command
-    if(stage_controller::halt()) {
+    //send halt command; a sequence holds the stage at the die by itself
+    if(sequenceMode || stage_controller::halt()) {
         return RESULT_GOOD;
     }
     else {
@@ -571,23 +880,66 @@ enum ControlResult enterFineAlignImage() {
     fflush(stdout);
 #endif
 
-    //capture image and check for error
-    if(!camera_module::captureImage()) {
+    stillRequested = false;
+    exposureStarted = false;
+    return RESULT_GOOD;
+}
+
+enum ControlResult executeFineAlignImage() {
+#ifdef DEBUG_MODE_PROCESS_CONTROL
+    printf("[ProcessControl] Executing STATE_FINE_ALIGN_IMAGE\n");
+    fflush(stdout);
+#endif
+
+    //a reconnecting camera resumes the pending capture by itself
+    switch(camera_module::getOpenState()) {
+    case camera_module::CAMERA_OPEN:
+        break;
+    case camera_module::CAMERA_RECONNECTING:
 #ifdef DEBUG_MODE_PROCESS_CONTROL
-        printf("[ProcessControl]   Could not capture image\n");
+        printf("[ProcessControl]   Waiting for camera to reconnect\n");
         fflush(stdout);
 #endif
+        return RESULT_GOOD;
+    default:
         return RESULT_CAMERA_ERROR;
     }
 
-    return RESULT_GOOD;
-}
+    //exposure is tuned on the first die of a layer and reused afterward
+    if(!exposureStarted) {
+        if(!camera_module::startAutoExposure(recipe.getPatternPath())) {
+#ifdef DEBUG_MODE_PROCESS_CONTROL
+            printf("[ProcessControl]   Could not start auto-exposure\n");
+            fflush(stdout);
+#endif
+            return RESULT_CAMERA_ERROR;
+        }
 
-enum ControlResult executeFineAlignImage() {
+        exposureStarted = true;
+    }
+
+    //capture once exposure has settled
+    if(!stillRequested) {
+        if(!camera_module::autoExposureDone()) {
 #ifdef DEBUG_MODE_PROCESS_CONTROL
-    printf("[ProcessControl] Executing STATE_FINE_ALIGN_IMAGE\n");
-    fflush(stdout);
+            printf("[ProcessControl]   Waiting for auto-exposure\n");
+            fflush(stdout);
 #endif
+            return RESULT_GOOD;
+        }
+
+        //capture image and check for error
+        if(!camera_module::captureImage()) {
+#ifdef DEBUG_MODE_PROCESS_CONTROL
+            printf("[ProcessControl]   Could not capture image\n");
+            fflush(stdout);
+#endif
+            return RESULT_CAMERA_ERROR;
+        }
+
+        stillRequested = true;
+        return RESULT_GOOD;
+    }
 
     //wait for camera to capture image
     if(camera_module::stillImageReady()) {
@@ -657,9 +1009,23 @@ enum ControlResult executeFineAlignImage() {
             fflush(stdout);
 #endif
 
+        //Small residuals are corrected by shifting the projected pattern by the
+        //whole displacement instead of the stage, since no image is taken after it.
+        //Both images share MILLIMETERS_PER_PIXEL, so no scale conversion is needed.
+        float shiftX = ALIGN_OPTICAL_GAIN * disp.x;
+        float shiftY = ALIGN_OPTICAL_GAIN * disp.y;
+
         if(distance < 0.1) { //adjust this value as needed
             nextState = STATE_EXPOSE;
         }
+        else if(sqrt(shiftX*shiftX + shiftY*shiftY) <= ALIGN_MAX_OPTICAL_SHIFT &&
+                projector_module::setTransform(shiftX, shiftY, 0)) {
+#ifdef DEBUG_MODE_PROCESS_CONTROL
+            printf("[ProcessControl]   Pattern shifted by (%.2f,%.2f) pixels\n", shiftX, shiftY);
+            fflush(stdout);
+#endif
+            nextState = STATE_EXPOSE;
+        }
         else {
             nextState = STATE_FINE_ALIGN_MOTOR;
         }
@@ -701,11 +1067,8 @@ enum ControlResult enterFineAlignMotor() {
     x += ALIGN_ALPHA * disp.x;
     y += ALIGN_ALPHA * disp.y;
 
-    //move motors
-    if(!stage_controller::setPosition(x, y)) {
-        return RESULT_MOTOR_ERROR;
-    }
-
+    //move motors; the end of the move is reported to pollStage
+    startMove(x, y);
     return RESULT_GOOD;
 }
 
@@ -716,10 +1079,13 @@ enum ControlResult executeFineAlignMotor() {
 #endif
     unsigned x, y;
     unsigned char stat;
+    bool ready;
 
-    //get x and y position of stage
-    if(!stage_controller::getPosition(x, y, stat)) {
-        return RESULT_MOTOR_ERROR;
+    //get x and y position of stage once the move has ended
+    enum ControlResult result = pollStage(ready, x, y, stat);
+
+    if(result != RESULT_GOOD || !ready) {
+        return result;
     }
 
     //if finished moving, go to next state
@@ -739,8 +1105,8 @@ enum ControlResult exitFineAlignMotor() {
     printf("[ProcessControl] Exiting STATE_FINE_ALIGN_MOTOR\n");
     fflush(stdout);
 #endif
-    //send halt command
-    if(!stage_controller::halt()) {
+    //send halt command, which would also end a sequence
+    if(!sequenceMode && !stage_controller::halt()) {
         return RESULT_MOTOR_ERROR;
     }
 
@@ -755,8 +1121,15 @@ enum ControlResult enterExpose() {
     fflush(stdout);
 #endif
 
-    //turn projector image on and begin timer with time from recipe (should be precise!)
-    projector_module::show(); //must modify this
+    //the projector times the exposure on its own thread
+    if(!projector_module::startExposure((unsigned) (recipe.getExposureTime() * 1000000 + 0.5f), dieNumber)) {
+#ifdef DEBUG_MODE_PROCESS_CONTROL
+        printf("[ProcessControl]   Could not start exposure\n");
+        fflush(stdout);
+#endif
+        return RESULT_PROJECTOR_ERROR;
+    }
+
     return RESULT_GOOD;
 }
 
@@ -767,10 +1140,14 @@ enum ControlResult executeExpose() {
     fflush(stdout);
 #endif
 
-    bool durationPassed = true; //must modify this
+    bool durationPassed = projector_module::exposureDone();
 
     if(durationPassed) {
-        projector_module::hide();
+#ifdef DEBUG_MODE_PROCESS_CONTROL
+        printf("[ProcessControl]   Die %d exposed for %uus (requested %.0fus)\n", dieNumber,
+               projector_module::getAchievedExposure(), recipe.getExposureTime() * 1000000);
+        fflush(stdout);
+#endif
         dieNumber++;
 
         if(dieNumber < (int) recipe.getDiePositions().size()) {
@@ -789,6 +1166,9 @@ enum ControlResult exitExpose() {
     printf("[ProcessControl] Exiting STATE_EXPOSE\n");
     fflush(stdout);
 #endif
+    //cuts the exposure short when leaving early, e.g. on abort
+    projector_module::abortExposure();
+    projector_module::hide();
     return RESULT_GOOD;
 }
 
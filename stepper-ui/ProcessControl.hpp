@@ -27,9 +27,11 @@ extern float *kernel;
 extern unsigned kernelWidth;
 extern unsigned kernelHeight;
 
-//last read motor position in wafer coordinates (millimeters)
+//last read motor position in wafer coordinates (millimeters), refreshed from
+//stage telemetry on every update, and its CLOCK_MONOTONIC time in nanoseconds
 extern float currentX;
 extern float currentY;
+extern unsigned long long currentTime;
 //each state should be designed for individual testing
 enum ControlState {
     STATE_INVALID,
@@ -63,6 +65,12 @@ extern enum ControlResult update();  //executes current state or transitions to
 extern enum ControlResult start();
 extern enum ControlResult abort();
 
+//Called from worker threads when there is new work for update(), such as the
+//stage reaching its target. The callee should schedule update() on its own
+//thread rather than call it directly.
+typedef void (*WakeCallback)(void *ctx);
+extern void setWakeCallback(WakeCallback callback, void *ctx);
+
 //state entry transition functions
 extern enum ControlResult enterReset();
 extern enum ControlResult enterAwaitUpload();
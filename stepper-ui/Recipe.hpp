@@ -21,6 +21,12 @@ public:
         float y;
     };
 
+    //extra pattern a die can expose instead of the main one
+    struct Pattern {
+        const char *id;
+        const char *path;
+    };
+
     Recipe() {
         erase();
     }
@@ -37,6 +43,15 @@ public:
         return patternPath;
     }
 
+    std::vector<Pattern> getPatterns() {
+        return patterns;
+    }
+
+    //id of the pattern exposed at a die, or nullptr for the main pattern
+    const char *getDiePattern(int die) {
+        return die >= 0 && die < (int) diePatterns.size() ? diePatterns[die] : nullptr;
+    }
+
     float getWaferSize() {
         return waferSize;
     }
@@ -49,6 +64,11 @@ public:
         return firstLayer;
     }
 
+    //pattern gray levels set the dose instead of being thresholded
+    bool isGrayscale() {
+        return grayscale;
+    }
+
     bool isValid() {
         return status == GOOD;
     }
@@ -59,10 +79,13 @@ public:
 
     void erase() {
         positions.clear();
+        diePatterns.clear();
+        patterns.clear();
         markPath = "";
         patternPath = "";
         waferSize = 0;
         exposureTime = 0;
+        grayscale = false;
         status = NONE;
     }
 
@@ -97,9 +120,12 @@ public:
 
         readFloatElement(root, "wafer-size", &waferSize, true);
         readFloatElement(root, "exposure-time", &exposureTime, true);
+        readBoolElement(root, "grayscale", &grayscale, false);
         readPathElement(root, "pattern", &patternPath, true);
+        readPatternsListElement(root, patterns, false);
         readPathElement(root, "alignment-mark", &markPath, true);
         readPointsListElement(root, positions, true);
+        checkDiePatterns();
 
         if(status == GOOD) {
 #ifdef DEBUG_MODE_RECIPE
@@ -123,10 +149,14 @@ private:
     //later, encapsulate these in a separate object called a "Design"
     bool firstLayer = false;
     float exposureTime;
+    bool grayscale;
     const char *patternPath;
     const char *markPath;
 
+    std::vector<Pattern> patterns;
+
     std::vector<Point> positions;
+    std::vector<const char *> diePatterns; //parallel to positions
 
     XMLDocument doc;
 
@@ -171,9 +201,49 @@ private:
         return true;
     }
 
+    //returns true if found and correct, false otherwise
+    bool readBoolElement(XMLElement *parent, const char elementName[64], bool *dest, bool required) {
+        XMLElement *boolElem = parent->FirstChildElement(elementName);
+
+        if(!boolElem) {
+            if(required) {
+#ifdef DEBUG_MODE_RECIPE
+                char msg[256] = "element '";
+                strncat(msg, elementName, strlen(elementName));
+                const char *suffix = "' was never specified.";
+                strncat(msg, suffix, strlen(suffix));
+                printf("[Recipe] %s\n", msg);
+                fflush(stdout);
+#endif
+                status = ERROR;
+            }
+            return false;
+        }
+
+        if(boolElem->QueryBoolText(dest) != XML_SUCCESS) {
+#ifdef DEBUG_MODE_RECIPE
+            char msg[256] = "element '";
+            strncat(msg, elementName, strlen(elementName));
+            const char *suffix = "' does not have boolean value.";
+            strncat(msg, suffix, strlen(suffix));
+            printf("[Recipe] %s\n", msg);
+            fflush(stdout);
+#endif
+            status = ERROR;
+            return false;
+        }
+
+        return true;
+    }
+
     //returns true if found and correct, false otherwise
     bool readPathElement(XMLElement *parent, const char elementName[64], const char **dest, bool required) {
-        XMLElement *pathElem = parent->FirstChildElement(elementName);
+        return readPath(parent->FirstChildElement(elementName), elementName, dest, required);
+    }
+
+    //elementName only names the element in DEBUG_MODE_RECIPE messages
+    bool readPath(XMLElement *pathElem, const char elementName[64], const char **dest, bool required) {
+        (void) elementName;
 
         if(!pathElem) {
             if(required) {
@@ -186,8 +256,8 @@ private:
                 fflush(stdout);
 #endif
                 status = ERROR;
-                return false;
             }
+            return false;
         }
 
         const char *elemText = pathElem->GetText();
@@ -226,7 +296,7 @@ private:
     }
 
     //returns true if found and correct, false otherwise
-    bool readPointElement(XMLElement *parent, XMLElement **child, Point &pt) {
+    bool readPointElement(XMLElement *parent, XMLElement **child, Point &pt, const char **pattern) {
         const char *elementName = "point";
 
         if(*child == 0) {
@@ -255,6 +325,7 @@ private:
             return false;
         }
 
+        *pattern = (*child)->Attribute("pattern");
         return true;
     }
 
@@ -280,26 +351,95 @@ private:
 
         XMLElement *child = 0;
         Point tmp;
+        const char *pattern;
 
-        while(readPointElement(posElem, &child, tmp)) {
+        while(readPointElement(posElem, &child, tmp, &pattern)) {
             pts.push_back(tmp);
+            diePatterns.push_back(pattern);
         }
 
         if(status == ERROR) return 0;
         else return pts.size();
     }
 
+    //<patterns><pattern id="...">path</pattern>...</patterns>
+    int readPatternsListElement(XMLElement *parent, std::vector<Pattern> &list, bool required) {
+        const char *elementName = "patterns";
+        XMLElement *listElem = parent->FirstChildElement(elementName);
+
+        if(!listElem) {
+            if(required) {
+#ifdef DEBUG_MODE_RECIPE
+                printf("[Recipe] element '%s' was never specified.\n", elementName);
+                fflush(stdout);
+#endif
+                status = ERROR;
+            }
+            return 0;
+        }
+
+        for(XMLElement *child = listElem->FirstChildElement("pattern"); child; child = child->NextSiblingElement("pattern")) {
+            Pattern tmp;
+            tmp.id = child->Attribute("id");
+
+            if(!tmp.id || findPattern(tmp.id) >= 0) {
+#ifdef DEBUG_MODE_RECIPE
+                printf("[Recipe] element 'pattern' is missing a unique 'id' attribute.\n");
+                fflush(stdout);
+#endif
+                status = ERROR;
+                return 0;
+            }
+
+            if(!readPath(child, "pattern", &tmp.path, true))
+                return 0;
+
+            list.push_back(tmp);
+        }
+
+        return list.size();
+    }
+
+    int findPattern(const char *id) {
+        for(int i = 0; i < (int) patterns.size(); i++) {
+            if(strcmp(patterns[i].id, id) == 0)
+                return i;
+        }
+
+        return -1;
+    }
+
+    //every die pattern must name an entry of the patterns list
+    void checkDiePatterns() {
+        for(int i = 0; i < (int) diePatterns.size(); i++) {
+            if(diePatterns[i] != nullptr && findPattern(diePatterns[i]) < 0) {
+#ifdef DEBUG_MODE_RECIPE
+                printf("[Recipe] die #%02d uses unknown pattern '%s'.\n", i, diePatterns[i]);
+                fflush(stdout);
+#endif
+                status = ERROR;
+            }
+        }
+    }
+
     void displayData() {
 #ifdef DEBUG_MODE_RECIPE
         printf("[Recipe] Recipe info:\n");
         printf("  Wafer size is %f millimeters.\n", waferSize);
         printf("  Exposure time is %f seconds.\n", exposureTime);
+        printf("  Pattern is %s.\n", grayscale ? "grayscale" : "binary");
         printf("  Pattern image is located at %s.\n", patternPath);
         printf("  Alignment mark image is located at %s.\n", markPath);
+
+        for(int i = 0; i < (int) patterns.size(); i++) {
+            printf("  Pattern '%s' is located at %s.\n", patterns[i].id, patterns[i].path);
+        }
+
         printf("  Die positions:\n");
 
         for(int i = 0; i < (int) positions.size(); i++) {
-            printf("    #%02d: %f, %f\n", i, positions[i].x, positions[i].y);
+            printf("    #%02d: %f, %f%s%s\n", i, positions[i].x, positions[i].y,
+                   diePatterns[i] ? ", pattern " : "", diePatterns[i] ? diePatterns[i] : "");
         }
 
         fflush(stdout);
@@ -0,0 +1,185 @@
+#include "config.hpp"
+
+#include "amcambackend.hpp"
+
+#ifdef DEBUG_MODE_GLOBAL
+#define DEBUG_MODE_CAMERA
+#endif
+
+#ifdef DEBUG_MODE_CAMERA
+#include <cstdio>
+#endif
+
+AmcamBackend::AmcamBackend() {
+    handle = NULL;
+    liveWidth = 0;
+    liveHeight = 0;
+    stillWidth = 0;
+    stillHeight = 0;
+}
+
+AmcamBackend::~AmcamBackend() {
+    close();
+}
+
+bool AmcamBackend::open() {
+    HRESULT hr;
+
+    if(isOpen())
+        return true;
+
+    handle = Amcam_Open(NULL);
+
+    if(handle == NULL) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[AmcamBackend] No camera found or open failed\n");
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    //still size is queried first so that the live size is left selected for streaming
+    hr = Amcam_put_eSize(handle, stillIndex);
+    if(SUCCEEDED(hr))
+        hr = Amcam_get_Size(handle, &stillWidth, &stillHeight);
+
+    if(FAILED(hr)) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[AmcamBackend] Failed to set or get still size; hr = %d\n", hr);
+        fflush(stdout);
+#endif
+        close();
+        return false;
+    }
+
+    hr = Amcam_put_eSize(handle, liveIndex);
+    if(SUCCEEDED(hr))
+        hr = Amcam_get_Size(handle, &liveWidth, &liveHeight);
+
+    //exposure is controlled by camera_module, not by the camera firmware
+    if(SUCCEEDED(hr))
+        hr = Amcam_put_AutoExpoEnable(handle, 0);
+
+    if(FAILED(hr)) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[AmcamBackend] Failed to configure live stream; hr = %d\n", hr);
+        fflush(stdout);
+#endif
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void AmcamBackend::close() {
+    if(isOpen()) {
+        Amcam_Close(handle);
+        handle = NULL;
+    }
+}
+
+bool AmcamBackend::isOpen() {
+    return handle != NULL;
+}
+
+bool AmcamBackend::getSize(bool still, int &width, int &height) {
+    if(!isOpen())
+        return false;
+
+    width = still ? stillWidth : liveWidth;
+    height = still ? stillHeight : liveHeight;
+    return true;
+}
+
+bool AmcamBackend::start(EventCallback callback, void *ctx) {
+    HRESULT hr = Amcam_StartPullModeWithCallback(handle, callback, ctx);
+
+    if(FAILED(hr)) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[AmcamBackend] Failed to start camera, hr = %d\n", hr);
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    return true;
+}
+
+bool AmcamBackend::snap() {
+    HRESULT hr = Amcam_Snap(handle, stillIndex);
+
+    if(FAILED(hr)) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[AmcamBackend] Failed to snap image, hr = %d\n", hr);
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    return true;
+}
+
+bool AmcamBackend::pullImage(void *buffer, bool still) {
+    HRESULT hr;
+    AmcamFrameInfoV2 info = {};
+
+    if(still)
+        hr = Amcam_PullStillImageV2(handle, buffer, 24, &info);
+    else
+        hr = Amcam_PullImageV2(handle, buffer, 24, &info);
+
+    if(FAILED(hr)) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[AmcamBackend] Failed to pull image, hr = %d\n", hr);
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    return true;
+}
+
+bool AmcamBackend::getExposureRange(unsigned &minTime, unsigned &maxTime,
+                                    unsigned short &minGain, unsigned short &maxGain) {
+    unsigned defTime;
+    unsigned short defGain;
+
+    HRESULT hr = Amcam_get_ExpTimeRange(handle, &minTime, &maxTime, &defTime);
+    if(SUCCEEDED(hr))
+        hr = Amcam_get_ExpoAGainRange(handle, &minGain, &maxGain, &defGain);
+
+    return SUCCEEDED(hr);
+}
+
+bool AmcamBackend::getExposure(unsigned &time, unsigned short &gain) {
+    HRESULT hr = Amcam_get_ExpoTime(handle, &time);
+    if(SUCCEEDED(hr))
+        hr = Amcam_get_ExpoAGain(handle, &gain);
+
+    return SUCCEEDED(hr);
+}
+
+bool AmcamBackend::setExposure(unsigned time, unsigned short gain) {
+    HRESULT hr = Amcam_put_ExpoTime(handle, time);
+    if(SUCCEEDED(hr))
+        hr = Amcam_put_ExpoAGain(handle, gain);
+
+    if(FAILED(hr)) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[AmcamBackend] Failed to set exposure, hr = %d\n", hr);
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    return true;
+}
+
+bool AmcamBackend::requestHistogram(HistogramCallback callback, void *ctx) {
+    return SUCCEEDED(Amcam_GetHistogram(handle, callback, ctx));
+}
+
+void AmcamBackend::setHotPlugCallback(HotPlugCallback callback, void *ctx) {
+    Amcam_HotPlug(callback, ctx);
+}
@@ -0,0 +1,41 @@
+#ifndef AMCAMBACKEND_HPP
+#define AMCAMBACKEND_HPP
+
+#include "camerabackend.hpp"
+
+//camera backend for the AmScope camera, using libamcam.so
+class AmcamBackend : public CameraBackend {
+
+public:
+    AmcamBackend();
+    ~AmcamBackend();
+
+    bool open() override;
+    void close() override;
+    bool isOpen() override;
+    bool getSize(bool still, int &width, int &height) override;
+    bool start(EventCallback callback, void *ctx) override;
+    bool snap() override;
+    bool pullImage(void *buffer, bool still) override;
+    bool getExposureRange(unsigned &minTime, unsigned &maxTime,
+                          unsigned short &minGain, unsigned short &maxGain) override;
+    bool getExposure(unsigned &time, unsigned short &gain) override;
+    bool setExposure(unsigned time, unsigned short gain) override;
+    bool requestHistogram(HistogramCallback callback, void *ctx) override;
+    void setHotPlugCallback(HotPlugCallback callback, void *ctx) override;
+
+private:
+    //resolution indices passed to Amcam_put_eSize and Amcam_Snap
+    static const int liveIndex = 1;
+    static const int stillIndex = 0;
+
+    HAmcam handle;
+
+    int liveWidth;
+    int liveHeight;
+    int stillWidth;
+    int stillHeight;
+
+};
+
+#endif // AMCAMBACKEND_HPP
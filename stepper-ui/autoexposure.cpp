@@ -0,0 +1,151 @@
+#include "config.hpp"
+
+#include "autoexposure.hpp"
+
+#include <cstdlib>
+
+#ifdef DEBUG_MODE_GLOBAL
+#define DEBUG_MODE_CAMERA
+#endif
+
+#ifdef DEBUG_MODE_CAMERA
+#include <cstdio>
+#endif
+
+AutoExposure::AutoExposure() {
+    minTime = 1;
+    maxTime = CAMERA_AE_MAX_EXPOSURE_TIME;
+    minGain = 100;
+    maxGain = 100;
+    current = {0, 0};
+    best = {0, 0};
+    bestError = 256;
+    iterations = 0;
+    done = true;
+}
+
+void AutoExposure::setLimits(unsigned minTime, unsigned maxTime, unsigned short minGain, unsigned short maxGain) {
+    this->minTime = minTime;
+    this->maxTime = maxTime < CAMERA_AE_MAX_EXPOSURE_TIME ? maxTime : CAMERA_AE_MAX_EXPOSURE_TIME;
+    this->minGain = minGain;
+    this->maxGain = maxGain;
+}
+
+void AutoExposure::begin(Setting initial) {
+    current = initial;
+    best = initial;
+    bestError = 256;
+    iterations = 0;
+    done = false;
+}
+
+bool AutoExposure::update(const float histogram[256], Setting &next) {
+    if(done) {
+        next = best;
+        return true;
+    }
+
+    iterations++;
+
+    float total = 0;
+    for(int i = 0; i < 256; i++) {
+        total += histogram[i];
+    }
+
+    double product = (double) current.time * current.gain;
+    int error = 256;
+
+    if(total > 0) {
+        int high = percentile(histogram, 0.99f);
+        int low = percentile(histogram, 0.01f);
+        float saturated = (histogram[254] + histogram[255]) / total;
+
+#ifdef DEBUG_MODE_CAMERA
+        printf("[AutoExposure] %uus @ %u%%: low %d, high %d, saturated %.3f\n",
+               current.time, current.gain, low, high, saturated);
+        fflush(stdout);
+#endif
+
+        if(saturated > CAMERA_AE_MAX_SATURATION) {
+            //bright level is unknown; back off hard
+            product *= saturated > 0.2f ? 0.25 : 0.5;
+        }
+        else {
+            error = abs(high - CAMERA_AE_TARGET_LEVEL);
+            double scale = (double) CAMERA_AE_TARGET_LEVEL / (high > 1 ? high : 1);
+            product *= scale < 16 ? scale : 16;
+        }
+    }
+    else {
+        product *= 2;
+    }
+
+    if(error < bestError) {
+        bestError = error;
+        best = current;
+    }
+
+    Setting proposed = split(product);
+    bool stuck = proposed.time == current.time && proposed.gain == current.gain;
+
+    if(error <= CAMERA_AE_TOLERANCE || stuck || iterations >= CAMERA_AE_MAX_ITERATIONS) {
+        done = true;
+        next = best;
+        return true;
+    }
+
+    current = proposed;
+    next = current;
+    return false;
+}
+
+bool AutoExposure::isDone() {
+    return done;
+}
+
+int AutoExposure::getIterations() {
+    return iterations;
+}
+
+AutoExposure::Setting AutoExposure::getResult() {
+    return best;
+}
+
+int AutoExposure::percentile(const float histogram[256], float fraction) {
+    float total = 0;
+    for(int i = 0; i < 256; i++) {
+        total += histogram[i];
+    }
+
+    float count = 0;
+    for(int i = 0; i < 256; i++) {
+        count += histogram[i];
+        if(count >= fraction * total) {
+            return i;
+        }
+    }
+
+    return 255;
+}
+
+//prefers exposure time over gain, since gain also amplifies noise
+AutoExposure::Setting AutoExposure::split(double product) {
+    Setting s;
+    double time = product / minGain;
+
+    if(time < minTime)
+        time = minTime;
+    else if(time > maxTime)
+        time = maxTime;
+
+    double gain = product / time;
+
+    if(gain < minGain)
+        gain = minGain;
+    else if(gain > maxGain)
+        gain = maxGain;
+
+    s.time = (unsigned) (time + 0.5);
+    s.gain = (unsigned short) (gain + 0.5);
+    return s;
+}
@@ -0,0 +1,50 @@
+#ifndef AUTOEXPOSURE_HPP
+#define AUTOEXPOSURE_HPP
+
+//Histogram-driven exposure search. Brightness is modeled as proportional to
+//exposure time * gain, so each step solves for the setting that puts the
+//bright end of the histogram on the target level; with a linear sensor this
+//converges in one or two steps after the first measurement.
+class AutoExposure {
+
+public:
+    struct Setting {
+        unsigned time;          //microseconds
+        unsigned short gain;    //percent
+    };
+
+    AutoExposure();
+
+    void setLimits(unsigned minTime, unsigned maxTime, unsigned short minGain, unsigned short maxGain);
+    void begin(Setting initial);
+
+    //Consumes a luminance histogram taken with the current setting. Returns true
+    //when the search is finished; otherwise next is the setting to measure next.
+    bool update(const float histogram[256], Setting &next);
+
+    bool isDone();
+    int getIterations();
+
+    //setting that came closest to the target
+    Setting getResult();
+
+    //gray level below which the given fraction of pixels lie
+    static int percentile(const float histogram[256], float fraction);
+
+private:
+    unsigned minTime;
+    unsigned maxTime;
+    unsigned short minGain;
+    unsigned short maxGain;
+
+    Setting current;
+    Setting best;
+    int bestError;
+    int iterations;
+    bool done;
+
+    Setting split(double product);
+
+};
+
+#endif // AUTOEXPOSURE_HPP
@@ -0,0 +1,46 @@
+#ifndef CAMERABACKEND_HPP
+#define CAMERABACKEND_HPP
+
+#include "amcam.h"
+
+//Device behind camera_module. Events use the AMCAM_EVENT_* codes and frames are
+//24-bit RGB with rows padded to TDIBWIDTHBYTES, matching the Amcam SDK.
+class CameraBackend {
+
+public:
+    typedef PAMCAM_EVENT_CALLBACK EventCallback;
+    typedef PIAMCAM_HISTOGRAM_CALLBACK HistogramCallback;
+    typedef PAMCAM_HOTPLUG HotPlugCallback;
+
+    virtual ~CameraBackend() {}
+
+    virtual bool open() = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() = 0;
+
+    //resolution of live frames, or of snapped frames if still is true
+    virtual bool getSize(bool still, int &width, int &height) = 0;
+
+    //begins frame delivery; callback may be invoked from another thread
+    virtual bool start(EventCallback callback, void *ctx) = 0;
+
+    //requests a still frame; AMCAM_EVENT_STILLIMAGE is raised when it arrives
+    virtual bool snap() = 0;
+
+    //copies the most recent live or still frame into buffer
+    virtual bool pullImage(void *buffer, bool still) = 0;
+
+    //manual exposure; time in microseconds, analog gain in percent
+    virtual bool getExposureRange(unsigned &minTime, unsigned &maxTime,
+                                  unsigned short &minGain, unsigned short &maxGain) = 0;
+    virtual bool getExposure(unsigned &time, unsigned short &gain) = 0;
+    virtual bool setExposure(unsigned time, unsigned short gain) = 0;
+
+    //requests the luminance histogram of the live stream; only valid after start
+    virtual bool requestHistogram(HistogramCallback callback, void *ctx) = 0;
+
+    //notified when a device is plugged in or removed; may be invoked from another thread
+    virtual void setHotPlugCallback(HotPlugCallback callback, void *ctx) = 0;
+};
+
+#endif // CAMERABACKEND_HPP
@@ -1,6 +1,17 @@
 #include "config.hpp"
 
 #include "cameramodule.hpp"
+#include "amcambackend.hpp"
+#include "autoexposure.hpp"
+#include "framepool.hpp"
+#include "frametiming.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
 
 #ifdef DEBUG_MODE_GLOBAL
 #define DEBUG_MODE_CAMERA
@@ -12,60 +23,100 @@
 
 namespace camera_module {
 
-static const int liveIndex = 1;
-static const int stillIndex = 0;
-
-static HAmcam cameraHandle = NULL;
+static AmcamBackend amcamBackend;
+#ifdef EMULATION_MODE_CAMERA
+SimulatedCamera simulatedCamera;
+static CameraBackend *backend = &simulatedCamera;
+#else
+static CameraBackend *backend = &amcamBackend;
+#endif
+static bool streaming = false;
+
+//connection state; devices are opened on openThread and published on the GUI thread
+static std::atomic<int> openState(CAMERA_CLOSED);
+static std::thread openThread;
+static std::atomic<bool> openFinished(false);
+static bool openSucceeded = false;
+static std::atomic<bool> connectionLost(false);
+static std::atomic<bool> devicePlugged(false);
+static std::chrono::steady_clock::time_point lostTime;
+static std::chrono::steady_clock::time_point retryTime;
+
+//session restored after a reconnect
+static bool resumeStream = false;
+static bool resumeStill = false;
+static bool exposureApplied = false;
+static AutoExposure::Setting appliedExposure;
 
 static int liveWidth = 0;
 static int liveHeight = 0;
 DynamicImage *liveImage = NULL;
-static void *liveData = NULL;
+static FramePool livePool;
 static QImage *livePtr = NULL;
 
 static int stillWidth = 0;
 static int stillHeight = 0;
 DynamicImage *stillImage = NULL;
-static void *stillData = NULL;
+static FramePool stillPool;
 static QImage *stillPtr = NULL;
 
 bool liveImageGood = false;
 bool stillImageGood = false;
 
+//frame_timing id of the outstanding still capture
+static std::atomic<unsigned> stillFrame(0);
+static std::atomic<bool> stillPending(false);
+static bool stillConsumed = false;
+
+//auto-exposure state, shared with the camera callback thread
+static std::mutex exposureMutex;
+static AutoExposure autoExposure;
+static std::map<std::string, AutoExposure::Setting> exposureCache;
+static std::string exposureKey;
+static bool exposureActive = false;
+static bool histogramPending = false;
+static int exposureSettleFrames = 0;
+
 static void __stdcall callback(unsigned nEvent, void* pCallbackCtx);
+static void __stdcall histogramCallback(const float aHistY[256], const float aHistR[256],
+                                        const float aHistG[256], const float aHistB[256], void *pCtx);
+static void __stdcall hotPlugCallback(void *pCallbackCtx);
+static bool startStream();
+static bool applyExposure(AutoExposure::Setting setting);
 
 bool liveImageReady() {
     return liveImageGood;
 }
 
 bool stillImageReady() {
+    if(stillImageGood && !stillConsumed) {
+        frame_timing::stamp(stillFrame, frame_timing::STAGE_CONSUMED);
+        stillConsumed = true;
+    }
+
     return stillImageGood;
 }
 
 bool isOpen() {
-    return cameraHandle != NULL;
+    return openState == CAMERA_OPEN;
 }
 
-bool openCamera() {
-    HRESULT hr;
+OpenState getOpenState() {
+    return (OpenState) openState.load();
+}
 
-    if(isOpen()) {
-#ifdef DEBUG_MODE_CAMERA
-        printf("[CameraModule] Camera is already open\n");
-        fflush(stdout);
-#endif
-        return true;
-    }
+bool setBackend(CameraBackend *newBackend) {
+    if(openState != CAMERA_CLOSED || newBackend == NULL)
+        return false;
 
-    cameraHandle = Amcam_Open(NULL);
-    liveData = NULL;
-    livePtr = NULL;
-    stillData = NULL;
-    stillPtr = NULL;
-    liveImageGood = false;
-    stillImageGood = false;
+    backend = newBackend;
+    return true;
+}
 
-    if(cameraHandle == NULL) {
+//Opens the device and allocates frame buffers without touching Qt objects,
+//so it is safe to run off the GUI thread.
+static bool openDevice() {
+    if(!backend->open()) {
 #ifdef DEBUG_MODE_CAMERA
         printf("[CameraModule] No camera found or open failed\n");
         fflush(stdout);
@@ -73,106 +124,312 @@ bool openCamera() {
         return false;
     }
 
-    hr = Amcam_put_eSize(cameraHandle, stillIndex);
-    if(SUCCEEDED(hr))
-        hr = Amcam_get_Size(cameraHandle, &stillWidth, &stillHeight);
-
-    if (FAILED(hr)) {
+    if(!backend->getSize(true, stillWidth, stillHeight)) {
 #ifdef DEBUG_MODE_CAMERA
-        printf("[CameraModule] Failed to set or get still size; hr = %d\n", hr);
+        printf("[CameraModule] Failed to get still size\n");
         fflush(stdout);
 #endif
+        backend->close();
         return false;
     }
     else {
-        stillData = malloc(TDIBWIDTHBYTES(24 * stillWidth) * stillHeight);
-        if (NULL == stillData) {
+        if (!stillPool.allocate(CAMERA_FRAME_POOL_SIZE, stillWidth, stillHeight)) {
 #ifdef DEBUG_MODE_CAMERA
             printf("[CameraModule] Failed to allocate memory for still image data\n");
             fflush(stdout);
 #endif
+            backend->close();
             return false;
         }
     }
 
-    hr = Amcam_put_eSize(cameraHandle, liveIndex);
-    if(SUCCEEDED(hr))
-        hr = Amcam_get_Size(cameraHandle, &liveWidth, &liveHeight);
-
-    if (FAILED(hr)) {
+    if(!backend->getSize(false, liveWidth, liveHeight)) {
 #ifdef DEBUG_MODE_CAMERA
-        printf("[CameraModule] Failed to set or get live size; hr = %d\n", hr);
+        printf("[CameraModule] Failed to get live size\n");
         fflush(stdout);
 #endif
+        backend->close();
         return false;
     }
     else {
-        liveData = malloc(TDIBWIDTHBYTES(24 * liveWidth) * liveHeight);
-        if (NULL == liveData) {
+        if (!livePool.allocate(CAMERA_FRAME_POOL_SIZE, liveWidth, liveHeight)) {
 #ifdef DEBUG_MODE_CAMERA
             printf("[CameraModule] Failed to allocate memory for live image data\n");
             fflush(stdout);
 #endif
+            backend->close();
             return false;
         }
     }
 
-    livePtr = new QImage(liveWidth, liveHeight, QImage::Format_RGB888);
+#ifdef DEBUG_MODE_CAMERA
+    printf("[CameraModule] Camera opened: live resolution %dx%d, still resolution %dx%d\n",
+           liveWidth, liveHeight, stillWidth, stillHeight);
+    fflush(stdout);
+#endif
+    return true;
+}
+
+//Image providers are created once and kept for the life of the program, since
+//the QML engine holds on to them across resets and reconnects.
+static void publishImages() {
+    if(!livePtr)
+        livePtr = new QImage();
+
+    *livePtr = QImage(liveWidth, liveHeight, QImage::Format_RGB888);
     livePtr->fill(Qt::black);
 
-    liveImage = new DynamicImage();
+    if(!liveImage)
+        liveImage = new DynamicImage();
+
     liveImage->setImage(livePtr);
 
-    stillPtr = new QImage(stillWidth, stillHeight, QImage::Format_RGB888);
+    if(!stillPtr)
+        stillPtr = new QImage();
+
+    *stillPtr = QImage(stillWidth, stillHeight, QImage::Format_RGB888);
     stillPtr->fill(Qt::black);
 
-    stillImage = new DynamicImage();
+    if(!stillImage)
+        stillImage = new DynamicImage();
+
     stillImage->setImage(stillPtr);
+}
+
+void createImages() {
+    if(!liveImage) {
+        publishImages();
+    }
+}
 
+static void joinOpenThread() {
+    if(openThread.joinable()) {
+        openThread.join();
+    }
+}
+
+static void startOpenThread() {
+    openFinished = false;
+    openThread = std::thread([]() {
+        openSucceeded = openDevice();
+        openFinished = true;
+    });
+}
+
+static void resetSession() {
+    liveImageGood = false;
+    stillImageGood = false;
+    streaming = false;
+    stillPending = false;
+    connectionLost = false;
+    devicePlugged = false;
+    resumeStream = false;
+    resumeStill = false;
+    exposureApplied = false;
+    backend->setHotPlugCallback(&hotPlugCallback, NULL);
+}
+
+bool openCamera() {
+    if(isOpen()) {
 #ifdef DEBUG_MODE_CAMERA
-    printf("[CameraModule] Camera opened: live resolution %dx%d, still resolution %dx%d\n",
-           liveWidth, liveHeight, stillWidth, stillHeight);
-    fflush(stdout);
+        printf("[CameraModule] Camera is already open\n");
+        fflush(stdout);
 #endif
+        return true;
+    }
+
+    joinOpenThread();
+    resetSession();
+
+    if(!openDevice()) {
+        openState = CAMERA_CLOSED;
+        return false;
+    }
+
+    publishImages();
+    openState = CAMERA_OPEN;
     return true;
 }
 
-void closeCamera() {
-    if(isOpen()) {
-        Amcam_Close(cameraHandle);
-        cameraHandle = NULL;
+bool openCameraAsync() {
+    if(openState == CAMERA_OPEN || openState == CAMERA_OPENING)
+        return true;
+
+    if(openState == CAMERA_RECONNECTING)
+        return false;
+
+    joinOpenThread();
+    resetSession();
+    openState = CAMERA_OPENING;
+    startOpenThread();
+    return true;
+}
+
+//closing the backend waits for its callback thread, so no frame is in flight afterward
+static void dropConnection() {
+    resumeStream = streaming;
+    resumeStill = stillPending;
+    streaming = false;
+    liveImageGood = false;
+    stillImageGood = false;
+
+    backend->close();
+
+    {
+        std::lock_guard<std::mutex> lock(exposureMutex);
+        histogramPending = false;
     }
 
-    if(liveImage) {
-        delete liveImage;
-        liveImage = NULL;
+    lostTime = std::chrono::steady_clock::now();
+    retryTime = lostTime + std::chrono::milliseconds(CAMERA_REOPEN_DELAY);
+    openState = CAMERA_RECONNECTING;
+
+#ifdef DEBUG_MODE_CAMERA
+    printf("[CameraModule] Camera disconnected; reconnecting\n");
+    fflush(stdout);
+#endif
+}
+
+//puts the reopened device back into the state the controller left it in
+static bool restoreSession() {
+    if(liveWidth != livePtr->width() || liveHeight != livePtr->height() ||
+       stillWidth != stillPtr->width() || stillHeight != stillPtr->height()) {
+        publishImages();
     }
 
-    if(liveData) {
-        free(liveData);
-        liveData = NULL;
+    if(exposureApplied && !applyExposure(appliedExposure))
+        return false;
+
+    if((resumeStream || resumeStill) && !startStream())
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(exposureMutex);
+        exposureSettleFrames = CAMERA_AE_SETTLE_FRAMES;
     }
 
-    if(livePtr) {
-        delete livePtr;
-        livePtr = NULL;
+    if(resumeStill) {
+        //same frame id, so the reconnect shows up in the capture latency
+        stillPending = true;
+
+        if(!backend->snap()) {
+            stillPending = false;
+            return false;
+        }
     }
 
-    if(stillImage) {
-        delete stillImage;
-        stillImage = NULL;
+#ifdef DEBUG_MODE_CAMERA
+    printf("[CameraModule] Camera reconnected after %dms\n",
+           (int) std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - lostTime).count());
+    fflush(stdout);
+#endif
+    return true;
+}
+
+void updateConnection() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    switch(openState) {
+    case CAMERA_OPEN:
+        if(connectionLost.exchange(false)) {
+            dropConnection();
+        }
+        break;
+
+    case CAMERA_OPENING:
+        if(openFinished) {
+            joinOpenThread();
+
+            if(openSucceeded) {
+                publishImages();
+                openState = CAMERA_OPEN;
+            }
+            else {
+                openState = CAMERA_FAILED;
+            }
+        }
+        break;
+
+    case CAMERA_RECONNECTING:
+        if(openThread.joinable()) {
+            if(!openFinished)
+                break;
+
+            joinOpenThread();
+
+            if(openSucceeded) {
+                openState = CAMERA_OPEN;
+                connectionLost = false;
+
+                if(!restoreSession()) {
+                    dropConnection();
+                }
+                break;
+            }
+
+            retryTime = now + std::chrono::milliseconds(CAMERA_REOPEN_INTERVAL);
+        }
+
+        if(now - lostTime > std::chrono::milliseconds(CAMERA_RECONNECT_TIMEOUT)) {
+#ifdef DEBUG_MODE_CAMERA
+            printf("[CameraModule] Camera did not come back\n");
+            fflush(stdout);
+#endif
+            openState = CAMERA_FAILED;
+            break;
+        }
+
+        //a newly arrived device needs a moment before it can be opened
+        if(devicePlugged.exchange(false)) {
+            retryTime = now + std::chrono::milliseconds(CAMERA_REOPEN_DELAY);
+        }
+
+        if(now >= retryTime) {
+            startOpenThread();
+        }
+        break;
+
+    default:
+        break;
     }
+}
 
-    if(stillData) {
-        free(stillData);
-        stillData = NULL;
+void closeCamera() {
+    joinOpenThread();
+
+    if(backend->isOpen()) {
+        backend->close();
+    }
+
+    openState = CAMERA_CLOSED;
+    streaming = false;
+    stillPending = false;
+    connectionLost = false;
+
+    {
+        std::lock_guard<std::mutex> lock(exposureMutex);
+        exposureActive = false;
+        histogramPending = false;
+    }
+
+    //drop references to pooled buffers but keep the providers alive
+    if(livePtr) {
+        *livePtr = QImage(livePtr->width(), livePtr->height(), QImage::Format_RGB888);
+        livePtr->fill(Qt::black);
+        liveImage->setImage(livePtr);
     }
 
+    livePool.free();
+
     if(stillPtr) {
-        delete stillPtr;
-        stillPtr = NULL;
+        *stillPtr = QImage(stillPtr->width(), stillPtr->height(), QImage::Format_RGB888);
+        stillPtr->fill(Qt::black);
+        stillImage->setImage(stillPtr);
     }
 
+    stillPool.free();
+
     liveImageGood = false;
     stillImageGood = false;
 
@@ -183,40 +440,184 @@ void closeCamera() {
 }
 
 bool captureImage() {
-    HRESULT hr = Amcam_StartPullModeWithCallback(cameraHandle, &callback, NULL);
-    HRESULT hr2 = Amcam_Snap(cameraHandle, 0);
-
     liveImageGood = false;
     stillImageGood = false;
 
-    if (FAILED(hr)) {
+    if(!isOpen() || !startStream())
+        return false;
+
+    stillFrame = frame_timing::beginFrame();
+    stillConsumed = false;
+    stillPending = true;
+
+    if(!backend->snap()) {
+        stillPending = false;
 #ifdef DEBUG_MODE_CAMERA
-        printf("[CameraModule] Failed to start camera, hr = %d\n", hr);
+        printf("[CameraModule] Failed to snap image\n");
         fflush(stdout);
 #endif
         return false;
     }
-    else {
+
 #ifdef DEBUG_MODE_CAMERA
-        printf("[CameraModule] Waiting... ");
+    printf("[CameraModule] Waiting... ");
+    fflush(stdout);
+#endif
+    return true;
+}
+
+bool startAutoExposure(const char *key) {
+    AutoExposure::Setting initial;
+    unsigned minTime, maxTime;
+    unsigned short minGain, maxGain;
+
+    if(!isOpen())
+        return false;
+
+    std::unique_lock<std::mutex> lock(exposureMutex);
+    std::map<std::string, AutoExposure::Setting>::iterator cached = exposureCache.find(key);
+
+    if(cached != exposureCache.end()) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[CameraModule] Using cached exposure %uus @ %u%%\n", cached->second.time, cached->second.gain);
+        fflush(stdout);
+#endif
+        exposureActive = false;
+        return applyExposure(cached->second);
+    }
+
+    lock.unlock();
+
+    if(!startStream())
+        return false;
+
+    if(!backend->getExposureRange(minTime, maxTime, minGain, maxGain) ||
+       !backend->getExposure(initial.time, initial.gain)) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[CameraModule] Failed to read exposure settings\n");
         fflush(stdout);
 #endif
+        return false;
+    }
+
+    lock.lock();
+    autoExposure.setLimits(minTime, maxTime, minGain, maxGain);
+    autoExposure.begin(initial);
+    exposureKey = key;
+    exposureActive = true;
+    histogramPending = false;
+    exposureSettleFrames = CAMERA_AE_SETTLE_FRAMES;
+    return true;
+}
+
+bool autoExposureDone() {
+    std::lock_guard<std::mutex> lock(exposureMutex);
+    return !exposureActive;
+}
+
+void clearExposureCache() {
+    std::lock_guard<std::mutex> lock(exposureMutex);
+    exposureCache.clear();
+}
+
+static bool startStream() {
+    if(streaming)
         return true;
+
+    if(!backend->start(&callback, NULL)) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[CameraModule] Failed to start camera\n");
+        fflush(stdout);
+#endif
+        return false;
     }
+
+    streaming = true;
+    return true;
 }
 
-void callback(unsigned nEvent, void *pCallbackCtx) {
-    HRESULT hr;
-    AmcamFrameInfoV2 info = {};
+//remembers the setting so it can be restored after a reconnect
+static bool applyExposure(AutoExposure::Setting setting) {
+    if(!backend->setExposure(setting.time, setting.gain))
+        return false;
+
+    appliedExposure = setting;
+    exposureApplied = true;
+    return true;
+}
+
+//measures every live frame after the previous exposure change has settled
+static void requestExposureMeasurement() {
+    std::unique_lock<std::mutex> lock(exposureMutex);
+
+    if(!exposureActive || histogramPending)
+        return;
+
+    if(exposureSettleFrames > 0) {
+        exposureSettleFrames--;
+        return;
+    }
+
+    histogramPending = true;
+    lock.unlock();
+
+    //histogram may be delivered before requestHistogram returns
+    if(!backend->requestHistogram(&histogramCallback, NULL)) {
+        lock.lock();
+        histogramPending = false;
+    }
+}
+
+void histogramCallback(const float aHistY[256], const float aHistR[256],
+                       const float aHistG[256], const float aHistB[256], void *pCtx) {
+    //exposure is tuned on luminance only
+    (void) aHistR;
+    (void) aHistG;
+    (void) aHistB;
+    (void) pCtx;
+
+    AutoExposure::Setting next;
+    std::lock_guard<std::mutex> lock(exposureMutex);
+
+    histogramPending = false;
+
+    if(!exposureActive)
+        return;
+
+    bool finished = autoExposure.update(aHistY, next);
+    applyExposure(next);
 
+    if(finished) {
+        exposureCache[exposureKey] = next;
+        exposureActive = false;
+#ifdef DEBUG_MODE_CAMERA
+        printf("[CameraModule] Exposure settled at %uus @ %u%% after %d frames\n",
+               next.time, next.gain, autoExposure.getIterations());
+        fflush(stdout);
+#endif
+    }
+    else {
+        exposureSettleFrames = CAMERA_AE_SETTLE_FRAMES;
+    }
+}
+
+void hotPlugCallback(void *pCallbackCtx) {
+    (void) pCallbackCtx;
+    devicePlugged = true;
+}
+
+void callback(unsigned nEvent, void *pCallbackCtx) {
     if (AMCAM_EVENT_IMAGE == nEvent) {
-        hr = Amcam_PullImageV2(cameraHandle, liveData, 24, &info);
+        int slot = livePool.acquire();
 
-        if (FAILED(hr)) {
+        if (slot < 0) {
 #ifdef DEBUG_MODE_CAMERA
-            printf("[CameraModule] Failed to pull image, hr = %d\n", hr);
+            printf("[CameraModule] No free live buffer; frame dropped\n");
             fflush(stdout);
 #endif
+        }
+        else if (!backend->pullImage(livePool.data(slot), false)) {
+            livePool.release(slot);
             liveImageGood = false;
         }
         else {
@@ -224,33 +625,55 @@ void callback(unsigned nEvent, void *pCallbackCtx) {
             printf("[CameraModule] Live image captured.\n");
             fflush(stdout);
 #endif
-            QImage img((const uchar *) liveData, liveWidth, liveHeight, QImage::Format_RGB888);
-            *livePtr = img;
+            //shares the pooled buffer; the previous frame's buffer returns to the pool
+            *livePtr = livePool.wrap(slot);
+            livePool.release(slot);
             liveImage->setImage(livePtr);
             liveImageGood = true;
+            requestExposureMeasurement();
+        }
+    }
+    else if(AMCAM_EVENT_EXPO_START == nEvent || AMCAM_EVENT_EXPO_STOP == nEvent) {
+        if (stillPending) {
+            frame_timing::stamp(stillFrame, AMCAM_EVENT_EXPO_START == nEvent ?
+                                    frame_timing::STAGE_EXPOSURE_START : frame_timing::STAGE_EXPOSURE_END);
         }
     }
     else if(AMCAM_EVENT_STILLIMAGE == nEvent) {
-        hr = Amcam_PullStillImageV2(cameraHandle, stillData, 24, &info);
+        unsigned frame = stillFrame;
+        frame_timing::stamp(frame, frame_timing::STAGE_FRAME_READY);
+        stillPending = false;
+
+        int slot = stillPool.acquire();
 
-        if (FAILED(hr)) {
+        if (slot < 0) {
 #ifdef DEBUG_MODE_CAMERA
-            printf("[CameraModule] Failed to pull image, hr = %d\n", hr);
+            printf("[CameraModule] No free still buffer; frame dropped\n");
             fflush(stdout);
 #endif
             stillImageGood = false;
         }
+        else if (!backend->pullImage(stillPool.data(slot), true)) {
+            stillPool.release(slot);
+            stillImageGood = false;
+        }
         else {
+            frame_timing::stamp(frame, frame_timing::STAGE_PULLED);
 #ifdef DEBUG_MODE_CAMERA
             printf("[CameraModule] Still image captured.\n");
             fflush(stdout);
 #endif
-            QImage img((const uchar *) stillData, stillWidth, stillHeight, QImage::Format_RGB888);
-            *stillPtr = img;
+            *stillPtr = stillPool.wrap(slot);
+            stillPool.release(slot);
             stillImage->setImage(stillPtr);
+            frame_timing::stamp(frame, frame_timing::STAGE_CONVERTED);
             stillImageGood = true;
         }
     }
+    else if(AMCAM_EVENT_DISCONNECTED == nEvent || AMCAM_EVENT_ERROR == nEvent) {
+        //the device cannot be closed from its own callback; updateConnection does it
+        connectionLost = true;
+    }
     else {
 #ifdef DEBUG_MODE_CAMERA
         printf("[CameraModule] Other callback: %d\n", nEvent);
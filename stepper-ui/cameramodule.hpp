@@ -1,20 +1,58 @@
 #ifndef CAMERAMODULE_HPP
 #define CAMERAMODULE_HPP
 
+#include "config.hpp"
+
 #include "amcam.h"
 
 #include "DynamicImage.h"
+#include "camerabackend.hpp"
+
+#ifdef EMULATION_MODE_CAMERA
+#include "simulatedcamera.hpp"
+#endif
 
 namespace camera_module {
+    enum OpenState {
+        CAMERA_CLOSED,
+        CAMERA_OPENING,      //openCameraAsync in progress
+        CAMERA_OPEN,
+        CAMERA_RECONNECTING, //device lost; being reopened
+        CAMERA_FAILED        //open failed or device did not come back
+    };
+
     extern DynamicImage *liveImage;
     extern DynamicImage *stillImage;
 
+    //Creates liveImage and stillImage, blank until the camera opens, so they
+    //can be registered with the QML engine up front. Needs the QApplication.
+    extern void createImages();
+
     extern bool liveImageReady();
     extern bool stillImageReady();
     extern bool isOpen();
+    extern OpenState getOpenState();
     extern bool openCamera();
     extern void closeCamera();
+
+    //Opens the camera on a worker thread. Call updateConnection() periodically
+    //from the GUI thread to finish opening and to recover from disconnects.
+    extern bool openCameraAsync();
+    extern void updateConnection();
     extern bool captureImage();
+
+    //Tunes exposure on the live stream, or applies the setting cached under key.
+    //Call autoExposureDone() until it returns true before capturing.
+    extern bool startAutoExposure(const char *key);
+    extern bool autoExposureDone();
+    extern void clearExposureCache();
+
+    //selects the device used by openCamera; camera must be closed
+    extern bool setBackend(CameraBackend *backend);
+
+#ifdef EMULATION_MODE_CAMERA
+    extern SimulatedCamera simulatedCamera;
+#endif
 }
 
 #endif // CAMERAMODULE_HPP
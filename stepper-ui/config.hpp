@@ -5,6 +5,8 @@
 //#define EMULATION_MODE_GLOBAL
 
 #define EMULATION_MODE_I2C
+//#define EMULATION_MODE_CAMERA
+//#define EMULATION_MODE_PROJECTOR
 
 #define DEBUG_MODE_PROCESS_CONTROL
 //#define DEBUG_MODE_I2C
@@ -16,6 +18,8 @@
 
 #ifdef EMULATION_MODE_GLOBAL
 #define EMULATION_MODE_I2C
+#define EMULATION_MODE_CAMERA
+#define EMULATION_MODE_PROJECTOR
 #endif
 
 #ifdef DEBUG_MODE_GLOBAL
@@ -28,9 +32,51 @@
 #define DEBUG_MODE_RECIPE
 #endif
 
+#define I2C_COMBINED_TRANSACTIONS (1) //write each stage command and read its response in one I2C_RDWR transfer
+#define STAGE_MAX_RETRIES (3) //times a failed or damaged stage exchange is repeated before it is an error
+
+#define STAGE_MAX_VELOCITY (10.0) //millimeters per second per axis, for predicting move times
+#define STAGE_ACCELERATION (50.0) //millimeters per second squared
+#define STAGE_POLL_SLOW_INTERVAL (100) //milliseconds between position polls well before the predicted arrival
+#define STAGE_POLL_FAST_INTERVAL (5) //milliseconds between position polls near the predicted arrival
+#define STAGE_POLL_FAST_WINDOW (200) //milliseconds before the predicted arrival at which fast polling starts
+#define STAGE_MOTION_TIMEOUT (10000) //milliseconds past the predicted arrival before a move is an error
+#define STAGE_GPIO_CHIP "/dev/gpiochip0"
+#define STAGE_GPIO_LINE (-1) //line the stage raises on motion complete; -1 to poll only
+#define STAGE_TELEMETRY_INTERVAL (10) //milliseconds between position samples for telemetry
+#define STAGE_TELEMETRY_WINDOW (50) //milliseconds of samples a velocity estimate is fitted to
+#define STAGE_EMULATED_BACKLASH (0.02) //millimeters of lost motion when an emulated axis reverses
+#define STAGE_EMULATED_SETTLE_TIME (30) //milliseconds the emulated stage rings around its target after a move
+#define STAGE_EMULATED_SETTLE_NOISE (0.002) //peak position error in millimeters while the emulated stage rings
+
 #define MOTOR_SPAN_IN_MILLIMETERS (200)
 #define MOTOR_MILLIMETERS_PER_MICROSTEP (5.0/(256*200)) //256 microsteps * 200 steps = one revolution = 5mm
 #define MILLIMETERS_PER_PIXEL (0.5/1080)
 #define ALIGN_ALPHA (0.1*MILLIMETERS_PER_PIXEL/MOTOR_MILLIMETERS_PER_MICROSTEP)
+#define ALIGN_OPTICAL_GAIN (-1.0) //projector pixels of pattern shift per pixel of measured displacement; undamped, and opposite to the stage correction since the pattern moves instead of the wafer
+#define ALIGN_MAX_OPTICAL_SHIFT (4.0) //largest residual in projector pixels corrected by shifting the pattern
+#define WAFER_EDGE_EXCLUSION (1.0f) //millimeters at the wafer rim left unexposed
+
+#define PROJECTOR_PATTERN_SCALE (1.0) //projector pixels per pattern pixel
+#define PROJECTOR_MIRROR_HORIZONTAL (0) //set to 1 if the optics flip the image left to right
+#define PROJECTOR_MIRROR_VERTICAL (0)
+#define PROJECTOR_DITHER (1) //error-diffuse patterns on framebuffers with fewer than 8 bits per channel
+#define PROJECTOR_FRAMEBUFFER_PAGES (9) //blank page plus one per bit-plane of a grayscale pattern; spare pages hold preloaded patterns
+
+#define DOSE_LOG_PATH "/tmp/stepper-ui-dose.bin" //binary per-die exposure record, appended across runs
+#define DOSE_LOG_FLUSH_INTERVAL (100) //milliseconds between writes of buffered dose records
+
+#define CAMERA_FRAME_POOL_SIZE (4) //buffers per stream; frames are dropped while all are referenced
+
+#define CAMERA_REOPEN_DELAY (200) //milliseconds after a disconnect or hot-plug arrival before reopening
+#define CAMERA_REOPEN_INTERVAL (500) //milliseconds between failed reopen attempts
+#define CAMERA_RECONNECT_TIMEOUT (5000) //milliseconds before a lost camera is an error
+
+#define CAMERA_AE_TARGET_LEVEL (200) //99th percentile gray level sought by auto-exposure
+#define CAMERA_AE_TOLERANCE (12)
+#define CAMERA_AE_MAX_SATURATION (0.005f) //fraction of clipped pixels tolerated
+#define CAMERA_AE_MAX_ITERATIONS (6)
+#define CAMERA_AE_SETTLE_FRAMES (2) //live frames skipped after each exposure change
+#define CAMERA_AE_MAX_EXPOSURE_TIME (200000) //microseconds
 
 #endif // CONFIG_HPP
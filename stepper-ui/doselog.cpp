@@ -0,0 +1,176 @@
+#include "config.hpp"
+
+#include "doselog.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+
+#ifdef DEBUG_MODE_GLOBAL
+#define DEBUG_MODE_PROJECTOR
+#endif
+
+namespace dose_log {
+
+//Single producer, single consumer: the exposure thread advances head and the
+//writer advances tail, each published with release ordering.
+static Record ring[RING_SIZE];
+static std::atomic<unsigned> head(0);
+static std::atomic<unsigned> tail(0);
+static std::atomic<unsigned> dropped(0);
+static std::atomic<unsigned> droppedTotal(0);
+
+static FILE *file = nullptr;
+static std::thread writer;
+static bool stopping = false;
+static std::mutex mutex;
+static std::condition_variable wake;
+
+static void run();
+static void drain();
+
+static unsigned long long clockNanoseconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool open(const char *path) {
+    close();
+
+    file = fopen(path, "ab");
+
+    if(file == nullptr) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[DoseLog] Could not open %s\n", path);
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    Header header;
+    memcpy(header.magic, "SDLG", sizeof(header.magic));
+    header.version = VERSION;
+    header.recordSize = sizeof(Record);
+    header.realtime = clockNanoseconds(CLOCK_REALTIME);
+    header.monotonic = clockNanoseconds(CLOCK_MONOTONIC);
+    fwrite(&header, sizeof(header), 1, file);
+    fflush(file);
+
+    head = 0;
+    tail = 0;
+    dropped = 0;
+    droppedTotal = 0;
+    stopping = false;
+    writer = std::thread(run);
+
+#ifdef DEBUG_MODE_PROJECTOR
+    printf("[DoseLog] Logging exposures to %s\n", path);
+    fflush(stdout);
+#endif
+    return true;
+}
+
+void close() {
+    if(writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        wake.notify_one();
+        writer.join();
+    }
+
+    if(file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+bool isOpen() {
+    return file != nullptr;
+}
+
+void record(Event event, int die, unsigned commanded, int plane, unsigned long long time) {
+    if(file == nullptr)
+        return;
+
+    unsigned h = head.load(std::memory_order_relaxed);
+
+    if(h - tail.load(std::memory_order_acquire) >= (unsigned) RING_SIZE) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Record &r = ring[h % RING_SIZE];
+    r.event = event;
+    r.plane = plane;
+    r.die = die < 0 || die >= NO_DIE ? NO_DIE : die;
+    r.commanded = commanded;
+    r.time = time;
+
+    head.store(h + 1, std::memory_order_release);
+}
+
+unsigned getDroppedCount() {
+    return droppedTotal + dropped.load();
+}
+
+static void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while(!stopping) {
+        wake.wait_for(lock, std::chrono::milliseconds(DOSE_LOG_FLUSH_INTERVAL));
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+
+    lock.unlock();
+    drain();
+}
+
+//copies out whatever is in the ring, in at most two contiguous runs
+static void drain() {
+    unsigned t = tail.load(std::memory_order_relaxed);
+    unsigned h = head.load(std::memory_order_acquire);
+    bool written = false;
+
+    while(t != h) {
+        unsigned start = t % RING_SIZE;
+        unsigned count = h - t;
+
+        if(start + count > (unsigned) RING_SIZE)
+            count = RING_SIZE - start;
+
+        fwrite(&ring[start], sizeof(Record), count, file);
+        t += count;
+        tail.store(t, std::memory_order_release);
+        written = true;
+    }
+
+    unsigned lost = dropped.exchange(0);
+
+    if(lost > 0) {
+        Record overflow = {EVENT_OVERFLOW, 0, NO_DIE, lost, clockNanoseconds(CLOCK_MONOTONIC)};
+        fwrite(&overflow, sizeof(overflow), 1, file);
+        droppedTotal += lost;
+        written = true;
+
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[DoseLog] Dropped %u records\n", lost);
+        fflush(stdout);
+#endif
+    }
+
+    if(written)
+        fflush(file);
+}
+
+}
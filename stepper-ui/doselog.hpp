@@ -0,0 +1,59 @@
+#ifndef DOSELOG_HPP
+#define DOSELOG_HPP
+
+//Record of when the pattern was actually on the wafer for each die. The
+//exposure thread appends fixed-size records to a preallocated lock-free ring;
+//a writer thread drains it to an append-only binary file, so logging never
+//blocks or allocates while an exposure is being timed.
+//
+//File layout: a Header each time the log is opened, followed by Records. All
+//fields are in host byte order. Record times are CLOCK_MONOTONIC; the header
+//pairs that clock with CLOCK_REALTIME so they can be placed on the calendar.
+namespace dose_log {
+
+enum Event {
+    EVENT_ON = 1,       //pattern (or bit-plane) reached the screen
+    EVENT_OFF = 2,      //blank frame reached the screen at the end of the exposure
+    EVENT_ABORTED = 3,  //blank frame reached the screen after an abort
+    EVENT_OVERFLOW = 4  //ring was full; commanded holds the number of records lost
+};
+
+struct Header {
+    char magic[4];              //"SDLG"
+    unsigned short version;
+    unsigned short recordSize;
+    unsigned long long realtime;  //nanoseconds since the epoch
+    unsigned long long monotonic; //nanoseconds, taken together with realtime
+};
+
+struct Record {
+    unsigned char event;
+    unsigned char plane;        //bit-plane for EVENT_ON, 0 otherwise
+    unsigned short die;         //index in the recipe; 0xFFFF if none
+    unsigned commanded;         //requested exposure in microseconds
+    unsigned long long time;    //CLOCK_MONOTONIC nanoseconds
+};
+
+static_assert(sizeof(Header) == 24, "dose log header must stay packed");
+static_assert(sizeof(Record) == 16, "dose log record must stay packed");
+
+const unsigned short VERSION = 1;
+const int RING_SIZE = 1024;
+const unsigned short NO_DIE = 0xFFFF;
+
+//appends to path; false if the file cannot be opened
+extern bool open(const char *path);
+
+//drains the ring and closes the file
+extern void close();
+extern bool isOpen();
+
+//Called from the exposure thread only. Never blocks; when the ring is full the
+//record is counted as dropped and an EVENT_OVERFLOW is written later.
+extern void record(Event event, int die, unsigned commanded, int plane, unsigned long long time);
+
+extern unsigned getDroppedCount();
+
+}
+
+#endif // DOSELOG_HPP
@@ -0,0 +1,296 @@
+#include "config.hpp"
+
+#include "emulatedframebuffer.hpp"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <ctime>
+
+#ifdef DEBUG_MODE_GLOBAL
+#define DEBUG_MODE_PROJECTOR
+#endif
+
+#ifdef DEBUG_MODE_PROJECTOR
+#include <cstdio>
+#endif
+
+static unsigned long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+EmulatedFramebuffer::EmulatedFramebuffer() {
+    settings = defaultSettings();
+    fd = -1;
+    epoch = 0;
+    pendingTime = 0;
+    pendingOffset = 0;
+    panPending = false;
+    memset(&varInfo, 0, sizeof(varInfo));
+    memset(&fixInfo, 0, sizeof(fixInfo));
+}
+
+EmulatedFramebuffer::~EmulatedFramebuffer() {
+    close();
+}
+
+EmulatedFramebuffer::Settings EmulatedFramebuffer::defaultSettings() {
+    Settings s;
+    s.path = "/tmp/stepper-ui-fb.raw";
+    s.width = 1920;
+    s.height = 1080;
+    s.bitsPerPixel = 32;
+    s.pages = 9;
+    s.framePeriod = 16667;
+    return s;
+}
+
+void EmulatedFramebuffer::setSettings(const Settings &settings) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->settings = settings;
+}
+
+EmulatedFramebuffer::Settings EmulatedFramebuffer::getSettings() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return settings;
+}
+
+std::vector<EmulatedFramebuffer::Flip> EmulatedFramebuffer::takeFlips() {
+    std::lock_guard<std::mutex> lock(mutex);
+    latchPan(now());
+
+    std::vector<Flip> taken;
+    taken.swap(flips);
+    return taken;
+}
+
+unsigned long long EmulatedFramebuffer::getVsyncCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return fd >= 0 ? vsyncIndex(now()) : 0;
+}
+
+bool EmulatedFramebuffer::open() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(fd >= 0)
+        return true;
+
+    if(settings.width <= 0 || settings.height <= 0 || settings.pages < 1 ||
+       (settings.bitsPerPixel != 8 && settings.bitsPerPixel != 16 &&
+        settings.bitsPerPixel != 24 && settings.bitsPerPixel != 32))
+        return false;
+
+    memset(&varInfo, 0, sizeof(varInfo));
+    memset(&fixInfo, 0, sizeof(fixInfo));
+
+    varInfo.xres = varInfo.xres_virtual = settings.width;
+    varInfo.yres = varInfo.yres_virtual = settings.height;
+    varInfo.bits_per_pixel = settings.bitsPerPixel;
+
+    if(settings.bitsPerPixel == 8) {
+        varInfo.grayscale = 1;
+        varInfo.red.length = varInfo.green.length = varInfo.blue.length = 8;
+    }
+    else if(settings.bitsPerPixel == 16) {
+        varInfo.red.offset = 11;
+        varInfo.red.length = 5;
+        varInfo.green.offset = 5;
+        varInfo.green.length = 6;
+        varInfo.blue.length = 5;
+    }
+    else {
+        varInfo.red.offset = 16;
+        varInfo.red.length = 8;
+        varInfo.green.offset = 8;
+        varInfo.green.length = 8;
+        varInfo.blue.length = 8;
+    }
+
+    //timings chosen so the mode describes the configured refresh period
+    if(settings.framePeriod > 0) {
+        varInfo.pixclock = (unsigned long long) settings.framePeriod * 1000000ULL /
+                           ((unsigned long long) settings.width * settings.height);
+    }
+
+    strncpy(fixInfo.id, "emulated", sizeof(fixInfo.id) - 1);
+    fixInfo.type = FB_TYPE_PACKED_PIXELS;
+    fixInfo.visual = settings.bitsPerPixel == 8 ? FB_VISUAL_STATIC_PSEUDOCOLOR : FB_VISUAL_TRUECOLOR;
+    fixInfo.ypanstep = 1;
+    fixInfo.line_length = (settings.width * settings.bitsPerPixel / 8 + 63) / 64 * 64;
+    fixInfo.smem_len = fixInfo.line_length * settings.height * settings.pages;
+
+    fd = ::open(settings.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0 || ftruncate(fd, fixInfo.smem_len) != 0) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[EmulatedFramebuffer] Could not create %s\n", settings.path);
+        fflush(stdout);
+#endif
+        if(fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+
+        return false;
+    }
+
+    epoch = now();
+    panPending = false;
+    flips.clear();
+
+#ifdef DEBUG_MODE_PROJECTOR
+    printf("[EmulatedFramebuffer] %dx%d, %d bpp, %d pages in %s\n", settings.width, settings.height,
+           settings.bitsPerPixel, settings.pages, settings.path);
+    fflush(stdout);
+#endif
+    return true;
+}
+
+void EmulatedFramebuffer::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool EmulatedFramebuffer::isOpen() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return fd >= 0;
+}
+
+bool EmulatedFramebuffer::getVarInfo(struct fb_var_screeninfo &info) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(fd < 0)
+        return false;
+
+    latchPan(now());
+    info = varInfo;
+    return true;
+}
+
+//only the virtual height and offsets may change, within the file's memory
+bool EmulatedFramebuffer::setVarInfo(struct fb_var_screeninfo &info) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(fd < 0)
+        return false;
+
+    unsigned maxHeight = fixInfo.smem_len / fixInfo.line_length;
+    unsigned virtualHeight = info.yres_virtual < varInfo.yres ? varInfo.yres :
+                             info.yres_virtual > maxHeight ? maxHeight : info.yres_virtual;
+
+    varInfo.yres_virtual = virtualHeight;
+    varInfo.xoffset = 0;
+    varInfo.yoffset = info.yoffset + varInfo.yres <= virtualHeight ? info.yoffset : 0;
+    panPending = false;
+
+    info = varInfo;
+    return true;
+}
+
+bool EmulatedFramebuffer::getFixInfo(struct fb_fix_screeninfo &info) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(fd < 0)
+        return false;
+
+    info = fixInfo;
+    return true;
+}
+
+bool EmulatedFramebuffer::pan(const struct fb_var_screeninfo &info) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(fd < 0 || info.xoffset != 0 || info.yoffset + varInfo.yres > varInfo.yres_virtual)
+        return false;
+
+    unsigned long long time = now();
+    latchPan(time);
+
+    //without a vsync clock the pan is immediate
+    if(settings.framePeriod == 0) {
+        Flip flip = {time, info.yoffset};
+        varInfo.yoffset = info.yoffset;
+        recordFlip(flip);
+        return true;
+    }
+
+    pendingOffset = info.yoffset;
+    pendingTime = time;
+    panPending = true;
+    return true;
+}
+
+bool EmulatedFramebuffer::waitForVsync() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if(fd < 0 || settings.framePeriod == 0)
+        return false;
+
+    unsigned long long period = settings.framePeriod * 1000ULL;
+    unsigned long long next = epoch + (vsyncIndex(now()) + 1) * period;
+    lock.unlock();
+
+    struct timespec ts;
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+
+    lock.lock();
+    latchPan(now());
+    return true;
+}
+
+void *EmulatedFramebuffer::map(size_t length) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(fd < 0 || length > fixInfo.smem_len)
+        return NULL;
+
+    void *mapped = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+void EmulatedFramebuffer::unmap(void *address, size_t length) {
+    munmap(address, length);
+}
+
+unsigned long long EmulatedFramebuffer::vsyncIndex(unsigned long long time) {
+    if(settings.framePeriod == 0)
+        return 0;
+
+    return (time - epoch) / (settings.framePeriod * 1000ULL);
+}
+
+//a pending pan reaches the screen at the first vsync after it was requested
+void EmulatedFramebuffer::latchPan(unsigned long long time) {
+    if(!panPending)
+        return;
+
+    unsigned long long period = settings.framePeriod * 1000ULL;
+    unsigned long long latch = epoch + (vsyncIndex(pendingTime) + 1) * period;
+
+    if(time < latch)
+        return;
+
+    Flip flip = {latch, pendingOffset};
+    varInfo.yoffset = pendingOffset;
+    recordFlip(flip);
+    panPending = false;
+}
+
+//bounded so a session nobody inspects does not grow without limit
+void EmulatedFramebuffer::recordFlip(const Flip &flip) {
+    if(flips.size() >= MAX_FLIPS)
+        flips.erase(flips.begin());
+
+    flips.push_back(flip);
+}
@@ -0,0 +1,77 @@
+#ifndef EMULATEDFRAMEBUFFER_HPP
+#define EMULATEDFRAMEBUFFER_HPP
+
+#include "framebufferdevice.hpp"
+
+#include <mutex>
+#include <vector>
+
+//Framebuffer device backed by a memory-mapped file, so projector output can be
+//inspected and exposure timing measured without a display. Vertical blanks
+//occur on a CLOCK_MONOTONIC grid at the configured refresh period, and pans
+//take effect at the next one, as on real hardware.
+class EmulatedFramebuffer : public FramebufferDevice {
+
+public:
+    struct Settings {
+        const char *path;       //backing file; created or truncated on open
+        int width;
+        int height;
+        int bitsPerPixel;       //8 (gray), 16 (RGB565), 24 or 32 (RGB888)
+        int pages;              //virtual screen heights of memory available for panning
+        unsigned framePeriod;   //microseconds between vsyncs; 0 disables FBIO_WAITFORVSYNC
+    };
+
+    //a pan that reached the screen
+    struct Flip {
+        unsigned long long time; //CLOCK_MONOTONIC nanoseconds of the latching vsync
+        unsigned yoffset;
+    };
+
+    EmulatedFramebuffer();
+    ~EmulatedFramebuffer();
+
+    static Settings defaultSettings();
+
+    //takes effect at the next open
+    void setSettings(const Settings &settings);
+    Settings getSettings();
+
+    //flips since the last call, oldest first
+    std::vector<Flip> takeFlips();
+    unsigned long long getVsyncCount();
+
+    bool open() override;
+    void close() override;
+    bool isOpen() override;
+    bool getVarInfo(struct fb_var_screeninfo &info) override;
+    bool setVarInfo(struct fb_var_screeninfo &info) override;
+    bool getFixInfo(struct fb_fix_screeninfo &info) override;
+    bool pan(const struct fb_var_screeninfo &info) override;
+    bool waitForVsync() override;
+    void *map(size_t length) override;
+    void unmap(void *address, size_t length) override;
+
+private:
+    static const unsigned MAX_FLIPS = 4096;
+
+    Settings settings;
+    int fd;
+    struct fb_var_screeninfo varInfo;
+    struct fb_fix_screeninfo fixInfo;
+
+    unsigned long long epoch;       //time of vsync 0
+    unsigned long long pendingTime; //when the pending pan was requested
+    unsigned pendingOffset;
+    bool panPending;
+    std::vector<Flip> flips;
+
+    std::mutex mutex;
+
+    unsigned long long vsyncIndex(unsigned long long time);
+    void latchPan(unsigned long long time);
+    void recordFlip(const Flip &flip);
+
+};
+
+#endif // EMULATEDFRAMEBUFFER_HPP
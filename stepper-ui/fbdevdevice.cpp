@@ -0,0 +1,170 @@
+#include "config.hpp"
+
+#include "fbdevdevice.hpp"
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstdio>
+
+#ifdef DEBUG_MODE_GLOBAL
+#define DEBUG_MODE_PROJECTOR
+#endif
+
+static void printErrno(int num);
+
+FbdevDevice::FbdevDevice(const char *path) {
+    this->path = path;
+    fd = -1;
+}
+
+FbdevDevice::~FbdevDevice() {
+    close();
+}
+
+bool FbdevDevice::open() {
+    __s32 res;
+    struct fb_fix_screeninfo fixedScrInfo;
+    struct fb_var_screeninfo varScrInfo;
+
+    if(isOpen())
+        return true;
+
+    //get file descriptor of hdmi framebuffer
+    fd = ::open(path, O_RDWR); //make sure this is the correct framebuffer
+
+    if(fd < 0) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[FbdevDevice] Device file not found\n");
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+#ifdef DEBUG_MODE_PROJECTOR
+    printf("[FbdevDevice] Device file found\n");
+    fflush(stdout);
+#endif
+
+    //get variable screen info
+    res = ioctl(fd, FBIOGET_VSCREENINFO, &varScrInfo);
+    int errsv = errno;
+
+    if(res == -1) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[FbdevDevice] Could not read variable screen info:\n\t");
+        printErrno(errsv);
+        fflush(stdout);
+#endif
+        close();
+        return false;
+    }
+
+    //get fixed screen info
+    res = ioctl(fd, FBIOGET_FSCREENINFO, &fixedScrInfo);
+    errsv = errno;
+
+    if(res < 0) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[FbdevDevice] Could not read fixed screen info:\n\t");
+        printErrno(errsv);
+        fflush(stdout);
+#endif
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void FbdevDevice::close() {
+    if(isOpen()) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool FbdevDevice::isOpen() {
+    return fd >= 0;
+}
+
+bool FbdevDevice::getVarInfo(struct fb_var_screeninfo &info) {
+    return ioctl(fd, FBIOGET_VSCREENINFO, &info) == 0;
+}
+
+bool FbdevDevice::setVarInfo(struct fb_var_screeninfo &info) {
+    if(ioctl(fd, FBIOPUT_VSCREENINFO, &info) < 0)
+        return false;
+
+    return getVarInfo(info);
+}
+
+bool FbdevDevice::getFixInfo(struct fb_fix_screeninfo &info) {
+    return ioctl(fd, FBIOGET_FSCREENINFO, &info) == 0;
+}
+
+bool FbdevDevice::pan(const struct fb_var_screeninfo &info) {
+    struct fb_var_screeninfo request = info;
+    return ioctl(fd, FBIOPAN_DISPLAY, &request) == 0;
+}
+
+bool FbdevDevice::waitForVsync() {
+    __u32 crtc = 0;
+    return ioctl(fd, FBIO_WAITFORVSYNC, &crtc) == 0;
+}
+
+void *FbdevDevice::map(size_t length) {
+    void *mapped = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+void FbdevDevice::unmap(void *address, size_t length) {
+    munmap(address, length);
+}
+
+static void printErrno(int num) {
+    switch (num) {
+    case EAGAIN:
+        printf("EAGAIN\n");
+        break;
+    case EBADF:
+        printf("EBADF\n");
+        break;
+    case EDESTADDRREQ:
+        printf("EDESTADDRREQ\n");
+        break;
+    case EDQUOT:
+        printf("EDQUOT\n");
+        break;
+    case EFAULT:
+        printf("EFAULT\n");
+        break;
+    case EFBIG:
+        printf("EFBIG\n");
+        break;
+    case EINTR:
+        printf("EINTR\n");
+        break;
+    case EINVAL:
+        printf("EINVAL\n");
+        break;
+    case EIO:
+        printf("EIO\n");
+        break;
+    case ENOSPC:
+        printf("ENOSPC\n");
+        break;
+    case EPIPE:
+        printf("EPIPE\n");
+        break;
+    case EREMOTEIO:
+        printf("EREMOTEIO\n");
+        break;
+    default:
+        printf("other: %08X\n", num);
+    }
+    fflush(stdout);
+}
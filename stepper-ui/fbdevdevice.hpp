@@ -0,0 +1,30 @@
+#ifndef FBDEVDEVICE_HPP
+#define FBDEVDEVICE_HPP
+
+#include "framebufferdevice.hpp"
+
+//framebuffer device for the projector's HDMI output through the Linux fbdev driver
+class FbdevDevice : public FramebufferDevice {
+
+public:
+    explicit FbdevDevice(const char *path = "/dev/fb0");
+    ~FbdevDevice();
+
+    bool open() override;
+    void close() override;
+    bool isOpen() override;
+    bool getVarInfo(struct fb_var_screeninfo &info) override;
+    bool setVarInfo(struct fb_var_screeninfo &info) override;
+    bool getFixInfo(struct fb_fix_screeninfo &info) override;
+    bool pan(const struct fb_var_screeninfo &info) override;
+    bool waitForVsync() override;
+    void *map(size_t length) override;
+    void unmap(void *address, size_t length) override;
+
+private:
+    const char *path;
+    int fd;
+
+};
+
+#endif // FBDEVDEVICE_HPP
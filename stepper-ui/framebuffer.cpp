@@ -0,0 +1,379 @@
+#include "config.hpp"
+
+#include "framebuffer.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef DEBUG_MODE_GLOBAL
+#define DEBUG_MODE_PROJECTOR
+#endif
+
+#ifdef DEBUG_MODE_PROJECTOR
+#include <cstdio>
+#endif
+
+Framebuffer::Framebuffer() {
+    device = NULL;
+    buffer = NULL;
+    length = 0;
+    pageCount = 0;
+    resized = false;
+    memset(&varInfo, 0, sizeof(varInfo));
+    memset(&originalVarInfo, 0, sizeof(originalVarInfo));
+    memset(&fixInfo, 0, sizeof(fixInfo));
+}
+
+Framebuffer::~Framebuffer() {
+    unmap();
+}
+
+bool Framebuffer::map(FramebufferDevice *device, int pages) {
+    unmap();
+
+    if(!device->getVarInfo(varInfo)) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[Framebuffer] Could not read screen info\n");
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    this->device = device;
+    originalVarInfo = varInfo;
+
+    if(!allocatePages(pages)) {
+        unmap();
+        return false;
+    }
+
+    if(varInfo.bits_per_pixel != 8 && varInfo.bits_per_pixel != 16 &&
+       varInfo.bits_per_pixel != 24 && varInfo.bits_per_pixel != 32) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[Framebuffer] Unsupported pixel depth: %d bpp\n", varInfo.bits_per_pixel);
+        fflush(stdout);
+#endif
+        unmap();
+        return false;
+    }
+
+    void *mapped = device->map(fixInfo.smem_len);
+
+    if(mapped == NULL) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[Framebuffer] Could not map framebuffer memory\n");
+        fflush(stdout);
+#endif
+        unmap();
+        return false;
+    }
+
+    buffer = (unsigned char *) mapped;
+    length = fixInfo.smem_len;
+
+#ifdef DEBUG_MODE_PROJECTOR
+    printf("[Framebuffer] Mapped %zu bytes: %dx%d, %d bpp, stride %d, RGB offsets %d/%d/%d, %d page(s)\n",
+           length, varInfo.xres, varInfo.yres, varInfo.bits_per_pixel, fixInfo.line_length,
+           varInfo.red.offset, varInfo.green.offset, varInfo.blue.offset, pageCount);
+    fflush(stdout);
+#endif
+    return true;
+}
+
+//Asks for a virtual screen several pages high. Drivers that refuse, or that
+//cannot pan, fall back to a single page updated by copying.
+bool Framebuffer::allocatePages(int pages) {
+    struct fb_var_screeninfo request = varInfo;
+    request.yres_virtual = pages * varInfo.yres;
+    request.xoffset = 0;
+    request.yoffset = 0;
+
+    if(varInfo.yres_virtual < request.yres_virtual || varInfo.yoffset != 0) {
+        if(device->setVarInfo(request)) {
+            resized = true;
+        }
+
+        //the driver may adjust any field, so read back what it accepted
+        if(!device->getVarInfo(varInfo))
+            return false;
+    }
+
+    if(!device->getFixInfo(fixInfo))
+        return false;
+
+    size_t frameSize = getFrameSize();
+    pageCount = 0;
+
+    if(frameSize == 0)
+        return false;
+
+    while(pageCount < pages && (size_t) (pageCount + 1) * varInfo.yres <= varInfo.yres_virtual &&
+          frameSize * (pageCount + 1) <= fixInfo.smem_len) {
+        pageCount++;
+    }
+
+    //without panning support only the page at the current offset is visible
+    if(pageCount > 1 && fixInfo.ypanstep == 0 && fixInfo.ywrapstep == 0)
+        pageCount = 1;
+
+    if(pageCount == 0 || (size_t) fixInfo.line_length * (varInfo.yoffset + varInfo.yres) > fixInfo.smem_len) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[Framebuffer] Visible page lies outside framebuffer memory\n");
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    return true;
+}
+
+void Framebuffer::unmap() {
+    if(buffer != NULL) {
+        device->unmap(buffer, length);
+        buffer = NULL;
+        length = 0;
+    }
+
+    if(resized) {
+        device->setVarInfo(originalVarInfo);
+        resized = false;
+    }
+
+    device = NULL;
+    pageCount = 0;
+}
+
+bool Framebuffer::isMapped() {
+    return buffer != NULL;
+}
+
+int Framebuffer::getWidth() {
+    return varInfo.xres;
+}
+
+int Framebuffer::getHeight() {
+    return varInfo.yres;
+}
+
+int Framebuffer::getBitsPerPixel() {
+    return varInfo.bits_per_pixel;
+}
+
+unsigned Framebuffer::getStride() {
+    return fixInfo.line_length;
+}
+
+size_t Framebuffer::getFrameSize() {
+    return (size_t) fixInfo.line_length * varInfo.yres;
+}
+
+bool Framebuffer::convert(const QImage &image, std::vector<unsigned char> &frame, bool dither) {
+    if(!isMapped() || image.isNull())
+        return false;
+
+    QImage rgb = image.convertToFormat(QImage::Format_RGB888);
+    int bytes = varInfo.bits_per_pixel / 8;
+    int width = getWidth();
+    int height = getHeight();
+    int left = (width - rgb.width()) / 2;
+    int top = (height - rgb.height()) / 2;
+
+    //Floyd-Steinberg error for the current and next row, per channel
+    int bits[3] = {channelBits(0), channelBits(1), channelBits(2)};
+    bool diffuse = dither && (bits[0] < 8 || bits[1] < 8 || bits[2] < 8);
+    std::vector<int> error(diffuse ? 2 * 3 * (rgb.width() + 2) : 0, 0);
+    int rowSize = 3 * (rgb.width() + 2);
+
+    frame.assign(getFrameSize(), 0);
+
+    for(int y = 0; y < rgb.height(); y++) {
+        int *current = diffuse ? &error[(y & 1) * rowSize] : NULL;
+        int *next = diffuse ? &error[((y + 1) & 1) * rowSize] : NULL;
+
+        if(diffuse)
+            std::fill(next, next + rowSize, 0);
+
+        if(top + y < 0 || top + y >= height)
+            continue;
+
+        const unsigned char *src = rgb.constScanLine(y);
+        unsigned char *dst = frame.data() + (size_t) fixInfo.line_length * (top + y);
+
+        for(int x = 0; x < rgb.width(); x++) {
+            unsigned char c[3] = {src[3*x], src[3*x + 1], src[3*x + 2]};
+
+            if(diffuse) {
+                for(int i = 0; i < 3; i++) {
+                    int e = 3 * (x + 1) + i;
+                    int value = c[i] + current[e] / 16;
+                    value = value < 0 ? 0 : value > 255 ? 255 : value;
+
+                    //nearest level representable in the channel, expanded back to 8 bits
+                    int levels = (1 << bits[i]) - 1;
+                    int quantized = (value * levels + 127) / 255 * 255 / levels;
+                    int residual = value - quantized;
+
+                    current[e + 3] += residual * 7;
+                    next[e - 3] += residual * 3;
+                    next[e] += residual * 5;
+                    next[e + 3] += residual;
+                    c[i] = quantized;
+                }
+            }
+
+            if(left + x < 0 || left + x >= width)
+                continue;
+
+            unsigned value = pack(c[0], c[1], c[2]);
+            unsigned char *pixel = dst + bytes * (left + x);
+
+            //fbdev pixels are stored in host (little-endian) byte order
+            for(int i = 0; i < bytes; i++) {
+                pixel[i] = (value >> (8 * i)) & 0xFF;
+            }
+        }
+    }
+
+    return true;
+}
+
+void Framebuffer::blit(const std::vector<unsigned char> &frame) {
+    write(getVisiblePage(), frame);
+}
+
+void Framebuffer::clear() {
+    if(!isMapped())
+        return;
+
+    memset(page(getVisiblePage()), 0, getFrameSize());
+}
+
+int Framebuffer::getPageCount() {
+    return pageCount;
+}
+
+int Framebuffer::getVisiblePage() {
+    return pageCount > 1 ? varInfo.yoffset / varInfo.yres : 0;
+}
+
+bool Framebuffer::write(int index, const std::vector<unsigned char> &frame) {
+    if(!isMapped() || index < 0 || index >= pageCount || frame.size() != getFrameSize())
+        return false;
+
+    memcpy(page(index), frame.data(), frame.size());
+    return true;
+}
+
+bool Framebuffer::writeRegion(int index, const std::vector<unsigned char> &frame, int left, int top, int right, int bottom) {
+    if(frame.size() != getFrameSize() || !clipRegion(index, left, top, right, bottom))
+        return false;
+
+    int bytes = varInfo.bits_per_pixel / 8;
+    size_t offset = (size_t) fixInfo.line_length * top + bytes * left;
+    unsigned char *dst = page(index) + offset;
+    const unsigned char *src = frame.data() + offset;
+
+    for(int y = top; y < bottom; y++) {
+        memcpy(dst, src, bytes * (right - left));
+        dst += fixInfo.line_length;
+        src += fixInfo.line_length;
+    }
+
+    return true;
+}
+
+bool Framebuffer::clearRegion(int index, int left, int top, int right, int bottom) {
+    if(!clipRegion(index, left, top, right, bottom))
+        return false;
+
+    int bytes = varInfo.bits_per_pixel / 8;
+    unsigned char *dst = page(index) + (size_t) fixInfo.line_length * top + bytes * left;
+
+    for(int y = top; y < bottom; y++) {
+        memset(dst, 0, bytes * (right - left));
+        dst += fixInfo.line_length;
+    }
+
+    return true;
+}
+
+//false if nothing is left to touch
+bool Framebuffer::clipRegion(int index, int &left, int &top, int &right, int &bottom) {
+    if(!isMapped() || index < 0 || index >= pageCount)
+        return false;
+
+    left = std::max(left, 0);
+    top = std::max(top, 0);
+    right = std::min(right, getWidth());
+    bottom = std::min(bottom, getHeight());
+    return left < right && top < bottom;
+}
+
+bool Framebuffer::flip(int index) {
+    if(!isMapped() || index < 0 || index >= pageCount)
+        return false;
+
+    if(index == getVisiblePage())
+        return true;
+
+    struct fb_var_screeninfo pan = varInfo;
+    pan.xoffset = 0;
+    pan.yoffset = index * varInfo.yres;
+
+    if(!device->pan(pan)) {
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[Framebuffer] Could not pan to page %d\n", index);
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    varInfo.xoffset = pan.xoffset;
+    varInfo.yoffset = pan.yoffset;
+    return true;
+}
+
+bool Framebuffer::waitForVsync() {
+    if(!isMapped())
+        return false;
+
+    return device->waitForVsync();
+}
+
+unsigned Framebuffer::getFramePeriod() {
+    //pixclock is the pixel period in picoseconds
+    unsigned long long lineLength = varInfo.left_margin + varInfo.xres + varInfo.right_margin + varInfo.hsync_len;
+    unsigned long long lines = varInfo.upper_margin + varInfo.yres + varInfo.lower_margin + varInfo.vsync_len;
+
+    return (unsigned) (varInfo.pixclock * lineLength * lines / 1000);
+}
+
+static unsigned packChannel(unsigned char c, const struct fb_bitfield &field) {
+    unsigned value = field.length <= 8 ? c >> (8 - field.length) : (unsigned) c << (field.length - 8);
+    return value << field.offset;
+}
+
+//8 bpp is treated as grayscale, since the projector only shows intensity
+unsigned Framebuffer::pack(unsigned char r, unsigned char g, unsigned char b) {
+    if(varInfo.bits_per_pixel == 8)
+        return (r*77 + g*150 + b*29) >> 8;
+
+    return packChannel(r, varInfo.red) | packChannel(g, varInfo.green) | packChannel(b, varInfo.blue);
+}
+
+int Framebuffer::channelBits(int channel) {
+    if(varInfo.bits_per_pixel == 8)
+        return 8;
+
+    const struct fb_bitfield &field = channel == 0 ? varInfo.red : channel == 1 ? varInfo.green : varInfo.blue;
+    return field.length < 1 ? 1 : field.length < 8 ? field.length : 8;
+}
+
+//with a single page the visible area may sit at a nonzero offset
+unsigned char *Framebuffer::page(int index) {
+    if(pageCount == 1)
+        return buffer + (size_t) fixInfo.line_length * varInfo.yoffset + varInfo.xoffset * (varInfo.bits_per_pixel / 8);
+
+    return buffer + getFrameSize() * index;
+}
@@ -0,0 +1,81 @@
+#ifndef FRAMEBUFFER_HPP
+#define FRAMEBUFFER_HPP
+
+#include "framebufferdevice.hpp"
+
+#include <QImage>
+
+#include <linux/fb.h>
+
+#include <vector>
+
+//Memory-mapped view of a framebuffer device. Images are converted once into
+//the device's native pixel layout and row stride, so putting a frame on screen
+//is a single memcpy. When the driver allows a virtual height of several
+//screens, frames are kept in separate pages and shown with a FBIOPAN_DISPLAY flip.
+class Framebuffer {
+
+public:
+    Framebuffer();
+    ~Framebuffer();
+
+    //asks for up to pages screens of virtual height; getPageCount() tells what was granted
+    bool map(FramebufferDevice *device, int pages = 2);
+    void unmap();
+    bool isMapped();
+
+    int getWidth();
+    int getHeight();
+    int getBitsPerPixel();
+    unsigned getStride();
+    size_t getFrameSize();
+
+    //Converts image to the native format, centered and clipped to the visible
+    //resolution. frame is resized to getFrameSize() bytes. With dither set,
+    //channels narrower than 8 bits are error-diffused instead of truncated.
+    bool convert(const QImage &image, std::vector<unsigned char> &frame, bool dither = false);
+
+    //copies a converted frame to the visible page
+    void blit(const std::vector<unsigned char> &frame);
+    void clear();
+
+    //1 if the driver refused a taller virtual screen
+    int getPageCount();
+    int getVisiblePage();
+
+    //copies a converted frame to a page without showing it
+    bool write(int page, const std::vector<unsigned char> &frame);
+
+    //Same as write and clear, limited to pixels [left, right) of rows
+    //[top, bottom); the rectangle is clipped to the screen.
+    bool writeRegion(int page, const std::vector<unsigned char> &frame, int left, int top, int right, int bottom);
+    bool clearRegion(int page, int left, int top, int right, int bottom);
+
+    //pans the display to a page; takes effect at the next vsync on most drivers
+    bool flip(int page);
+
+    //blocks until the next vertical blank; false if the driver has no FBIO_WAITFORVSYNC
+    bool waitForVsync();
+
+    //refresh period from the mode timings in nanoseconds, or 0 if the driver leaves them unset
+    unsigned getFramePeriod();
+
+private:
+    FramebufferDevice *device;
+    unsigned char *buffer;
+    size_t length;
+    int pageCount;
+    bool resized;
+    struct fb_var_screeninfo varInfo;
+    struct fb_var_screeninfo originalVarInfo;
+    struct fb_fix_screeninfo fixInfo;
+
+    unsigned pack(unsigned char r, unsigned char g, unsigned char b);
+    int channelBits(int channel);
+    unsigned char *page(int index);
+    bool allocatePages(int pages);
+    bool clipRegion(int index, int &left, int &top, int &right, int &bottom);
+
+};
+
+#endif // FRAMEBUFFER_HPP
@@ -0,0 +1,36 @@
+#ifndef FRAMEBUFFERDEVICE_HPP
+#define FRAMEBUFFERDEVICE_HPP
+
+#include <linux/fb.h>
+
+#include <cstddef>
+
+//Display behind projector_module, modeled on the fbdev ioctl interface so the
+//real device is a thin wrapper around /dev/fb0.
+class FramebufferDevice {
+
+public:
+    virtual ~FramebufferDevice() {}
+
+    virtual bool open() = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() = 0;
+
+    //FBIOGET_VSCREENINFO, FBIOPUT_VSCREENINFO and FBIOGET_FSCREENINFO;
+    //setVarInfo updates info with the values the device accepted
+    virtual bool getVarInfo(struct fb_var_screeninfo &info) = 0;
+    virtual bool setVarInfo(struct fb_var_screeninfo &info) = 0;
+    virtual bool getFixInfo(struct fb_fix_screeninfo &info) = 0;
+
+    //FBIOPAN_DISPLAY to info.xoffset/yoffset
+    virtual bool pan(const struct fb_var_screeninfo &info) = 0;
+
+    //FBIO_WAITFORVSYNC; false if the device cannot report vertical blanks
+    virtual bool waitForVsync() = 0;
+
+    //maps length bytes of framebuffer memory; NULL on failure
+    virtual void *map(size_t length) = 0;
+    virtual void unmap(void *address, size_t length) = 0;
+};
+
+#endif // FRAMEBUFFERDEVICE_HPP
@@ -0,0 +1,123 @@
+#include "config.hpp"
+
+#include "framecodec.hpp"
+
+#include <chrono>
+
+namespace frame_codec {
+
+__u8 crc(const __u8 *bytes, int length) {
+    __u8 value = 0;
+
+    for(int i = 0; i < length; i++) {
+        value = CRC_TABLE.entries[value ^ bytes[i]];
+    }
+
+    return value;
+}
+
+void encodeBatch(const CommandID *commands, const __u32 *data, int count, frame *requests) {
+    for(int i = 0; i < count; i++) {
+        requests[i] = encode(commands[i], data[i]);
+    }
+}
+
+void linkTransfer(frame *requests, frame *replies, int count, struct i2c_msg *messages) {
+    for(int i = 0; i < count; i++) {
+        messages[2*i].flags = 0;
+        messages[2*i].len = sizeof(frame);
+        messages[2*i].buf = (__u8 *) &requests[i];
+        messages[2*i + 1].flags = I2C_M_RD;
+        messages[2*i + 1].len = sizeof(frame);
+        messages[2*i + 1].buf = (__u8 *) &replies[i];
+    }
+}
+
+int decodeBatch(const frame *requests, const frame *replies, int count, __u32 *data, __u8 *stageStatus) {
+    int status = 0;
+
+    for(int i = 0; i < count; i++) {
+        status |= check(replies[i], requests[i].command);
+
+        if(data != NULL) {
+            data[i] = dataOf(replies[i]);
+        }
+
+        if(stageStatus != NULL) {
+            stageStatus[i] = isKnownStatus(replies[i].status) ? STAGE_STATUSES[replies[i].status] : 0xFF;
+        }
+    }
+
+    return status;
+}
+
+//Runs the codec over full queues of frames: requests are encoded and linked
+//into a transfer, replies built from them are decoded, and extended frames
+//get their CRC checked. The sink keeps the compiler from dropping the work.
+void benchmark(FILE *out) {
+    typedef std::chrono::steady_clock clock;
+    const int BATCH = 8;
+    const int ROUNDS = 200000;
+
+    CommandID commands[BATCH];
+    __u32 data[BATCH];
+    frame requests[BATCH];
+    frame replies[BATCH];
+    struct i2c_msg messages[2 * BATCH];
+    extendedFrame extended[BATCH];
+    __u32 decoded[BATCH];
+    __u8 stageStatus[BATCH];
+    volatile unsigned sink = 0;
+
+    for(int i = 0; i < BATCH; i++) {
+        commands[i] = i % 2 ? stage_controller::CMD_SETY : stage_controller::CMD_SETX;
+        data[i] = 0x01000000 * i + 12345;
+    }
+
+    clock::time_point start = clock::now();
+
+    for(int round = 0; round < ROUNDS; round++) {
+        data[round % BATCH] = round;
+        encodeBatch(commands, data, BATCH, requests);
+        linkTransfer(requests, replies, BATCH, messages);
+        sink += requests[round % BATCH].checksum + messages[1].len;
+    }
+
+    clock::time_point encoded = clock::now();
+
+    for(int i = 0; i < BATCH; i++) {
+        replies[i] = encode(requests[i].command, data[i], stage_controller::STAGE_MOVING);
+    }
+
+    for(int round = 0; round < ROUNDS; round++) {
+        replies[round % BATCH].data[0] = round;
+        sink += decodeBatch(requests, replies, BATCH, decoded, stageStatus) + decoded[round % BATCH];
+    }
+
+    clock::time_point decodedTime = clock::now();
+
+    for(int round = 0; round < ROUNDS; round++) {
+        for(int i = 0; i < BATCH; i++) {
+            extended[i] = encodeExtended(stage_controller::CMD_SETXY, round, i, stage_controller::STAGE_MOVING);
+        }
+
+        for(int i = 0; i < BATCH; i++) {
+            sink += crc((const __u8 *) &extended[i], sizeof(extendedFrame) - 1) == extended[i].crc;
+        }
+    }
+
+    clock::time_point checked = clock::now();
+    double frames = (double) BATCH * ROUNDS;
+
+    fprintf(out, "frame codec, %d rounds of %d-frame batches\n", ROUNDS, BATCH);
+    fprintf(out, "encode + link:    %6.2f ns/frame\n",
+            std::chrono::duration<double, std::nano>(encoded - start).count() / frames);
+    fprintf(out, "decode + check:   %6.2f ns/frame\n",
+            std::chrono::duration<double, std::nano>(decodedTime - encoded).count() / frames);
+    fprintf(out, "extended + CRC:   %6.2f ns/frame\n",
+            std::chrono::duration<double, std::nano>(checked - decodedTime).count() / frames);
+    fprintf(out, "(sink %u)\n", (unsigned) sink);
+    fflush(out);
+}
+
+}
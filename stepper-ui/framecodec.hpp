@@ -0,0 +1,206 @@
+#ifndef FRAMECODEC_HPP
+#define FRAMECODEC_HPP
+
+#include "stagecontroller.h"
+
+#include <linux/i2c.h>
+
+#include <cstdio>
+
+//Packing and checking of stage frames. Everything that works on a single frame
+//is constexpr, so frames built from constants are checked by the compiler, and
+//the batch functions work on arrays of frames, which are contiguous bytes that
+//an I2C_RDWR transfer can point into directly.
+namespace frame_codec {
+
+using stage_controller::frame;
+using stage_controller::extendedFrame;
+using stage_controller::CommandID;
+
+const __u8 MAGIC = 0x5A;
+const __u8 EXTENDED_MAGIC = 0xA5;
+const __u8 CHECK_VALUE = 0xFF;
+const __u8 ERROR_COMMAND = 0xFF; //command byte of the reply to a request the stage rejected
+
+struct CommandInfo {
+    CommandID id;
+    const char *name;
+    bool extended;   //only valid in extended frames
+    bool idempotent; //safe to send again when its reply is lost
+};
+
+//moves are to absolute positions and steps are written by index; calibration
+//restarts homing and a sequence start goes back to its first step
+constexpr CommandInfo COMMANDS[] = {
+    {stage_controller::CMD_HALT,       "HALT",       false, true},
+    {stage_controller::CMD_GETWIDTH,   "GETWIDTH",   false, true},
+    {stage_controller::CMD_GETHEIGHT,  "GETHEIGHT",  false, true},
+    {stage_controller::CMD_GETX,       "GETX",       false, true},
+    {stage_controller::CMD_GETY,       "GETY",       false, true},
+    {stage_controller::CMD_SETX,       "SETX",       false, true},
+    {stage_controller::CMD_SETY,       "SETY",       false, true},
+    {stage_controller::CMD_CALIB,      "CALIB",      false, false},
+    {stage_controller::CMD_GETVERSION, "GETVERSION", false, true},
+    {stage_controller::CMD_GETXY,      "GETXY",      true,  true},
+    {stage_controller::CMD_SETXY,      "SETXY",      true,  true},
+    {stage_controller::CMD_SEQCLEAR,   "SEQCLEAR",   false, true},
+    {stage_controller::CMD_SEQSTEP,    "SEQSTEP",    false, true},
+    {stage_controller::CMD_SEQTARGET,  "SEQTARGET",  true,  true},
+    {stage_controller::CMD_SEQSTART,   "SEQSTART",   false, false},
+    {stage_controller::CMD_SEQRELEASE, "SEQRELEASE", false, true},
+    {stage_controller::CMD_SEQSTATUS,  "SEQSTATUS",  true,  true},
+};
+
+constexpr bool commandsInOrder(int i) {
+    return i == stage_controller::CMD_COUNT || (COMMANDS[i].id == i && commandsInOrder(i + 1));
+}
+
+static_assert(sizeof(COMMANDS) / sizeof(COMMANDS[0]) == stage_controller::CMD_COUNT, "every command needs a table entry");
+static_assert(commandsInOrder(0), "command table must be in CommandID order");
+
+//stage status byte to StageStatus; anything past the table is ERROR_UNKNOWN_STATUS
+constexpr __u8 STAGE_STATUSES[] = {
+    stage_controller::STAGE_NOT_READY,
+    stage_controller::STAGE_MOVING,
+    stage_controller::STAGE_IN_POSITION,
+};
+
+constexpr bool isKnownCommand(__u8 command) {
+    return command < stage_controller::CMD_COUNT;
+}
+
+constexpr bool isIdempotent(__u8 command) {
+    return isKnownCommand(command) && COMMANDS[command].idempotent;
+}
+
+constexpr bool isKnownStatus(__u8 status) {
+    return status < sizeof(STAGE_STATUSES);
+}
+
+constexpr __u8 byteOf(__u32 value, int index) {
+    return value >> (8 * index) & 0xFF;
+}
+
+constexpr __u8 checksumOf(__u8 magic, __u8 command, __u32 data, __u8 status) {
+    return CHECK_VALUE - (__u8) (magic + command + byteOf(data, 0) + byteOf(data, 1) +
+                                 byteOf(data, 2) + byteOf(data, 3) + status);
+}
+
+//data fields are little endian
+constexpr __u32 dataOf(const frame &f) {
+    return (__u32) f.data[3] << 24 | f.data[2] << 16 | f.data[1] << 8 | f.data[0];
+}
+
+constexpr __u8 checksum(const frame &f) {
+    return checksumOf(f.magic, f.command, dataOf(f), f.status);
+}
+
+constexpr frame encode(__u8 command, __u32 data, __u8 status = 0) {
+    return frame{MAGIC, command, {byteOf(data, 0), byteOf(data, 1), byteOf(data, 2), byteOf(data, 3)},
+                 status, checksumOf(MAGIC, command, data, status)};
+}
+
+//magic and checksum intact, whatever the content
+constexpr bool isIntact(const frame &f) {
+    return f.magic == MAGIC && f.checksum == checksum(f);
+}
+
+//Status code of a reply, as processFrame reports it. Set expectedCommand to -1
+//if the check is unnecessary.
+constexpr int check(const frame &f, int expectedCommand) {
+    return (f.magic != MAGIC ? stage_controller::ERROR_MAGIC : 0) |
+           (expectedCommand != -1 && f.command != expectedCommand ? stage_controller::ERROR_UNEXPECTED_COMMAND : 0) |
+           (!isKnownCommand(f.command) ? stage_controller::ERROR_UNKNOWN_COMMAND : 0) |
+           (f.checksum != checksum(f) ? stage_controller::ERROR_CHECKSUM : 0) |
+           (!isKnownStatus(f.status) ? stage_controller::ERROR_UNKNOWN_STATUS : 0);
+}
+
+//CRC-8 with polynomial x^8 + x^2 + x + 1, initial value 0, one table lookup per byte
+constexpr __u8 crcShift(__u8 crc, int bits) {
+    return bits == 0 ? crc : crcShift(crc & 0x80 ? (__u8) (crc << 1 ^ 0x07) : (__u8) (crc << 1), bits - 1);
+}
+
+template<int... I> struct Indices {};
+template<int N, int... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+template<int... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+struct CrcTable {
+    __u8 entries[256];
+};
+
+template<int... I>
+constexpr CrcTable makeCrcTable(Indices<I...>) {
+    return CrcTable{{crcShift((__u8) I, 8)...}};
+}
+
+constexpr CrcTable CRC_TABLE = makeCrcTable(MakeIndices<256>::type());
+
+constexpr __u8 crcNext(__u8 crc, __u8 byte) {
+    return CRC_TABLE.entries[(__u8) (crc ^ byte)];
+}
+
+constexpr __u8 crcWord(__u8 crc, __u32 word) {
+    return crcNext(crcNext(crcNext(crcNext(crc, byteOf(word, 0)), byteOf(word, 1)), byteOf(word, 2)), byteOf(word, 3));
+}
+
+constexpr __u8 crcOf(__u8 magic, __u8 command, __u32 x, __u32 y, __u8 status) {
+    return crcNext(crcWord(crcWord(crcNext(crcNext(0, magic), command), x), y), status);
+}
+
+constexpr __u32 xOf(const extendedFrame &f) {
+    return (__u32) f.data[3] << 24 | f.data[2] << 16 | f.data[1] << 8 | f.data[0];
+}
+
+constexpr __u32 yOf(const extendedFrame &f) {
+    return (__u32) f.data[7] << 24 | f.data[6] << 16 | f.data[5] << 8 | f.data[4];
+}
+
+constexpr __u8 crc(const extendedFrame &f) {
+    return crcOf(f.magic, f.command, xOf(f), yOf(f), f.status);
+}
+
+constexpr extendedFrame encodeExtended(__u8 command, __u32 x, __u32 y, __u8 status = 0) {
+    return extendedFrame{EXTENDED_MAGIC, command,
+                         {byteOf(x, 0), byteOf(x, 1), byteOf(x, 2), byteOf(x, 3),
+                          byteOf(y, 0), byteOf(y, 1), byteOf(y, 2), byteOf(y, 3)},
+                         status, crcOf(EXTENDED_MAGIC, command, x, y, status)};
+}
+
+constexpr bool isIntact(const extendedFrame &f) {
+    return f.magic == EXTENDED_MAGIC && f.crc == crc(f);
+}
+
+constexpr int check(const extendedFrame &f, int expectedCommand) {
+    return (f.magic != EXTENDED_MAGIC ? stage_controller::ERROR_MAGIC : 0) |
+           (expectedCommand != -1 && f.command != expectedCommand ? stage_controller::ERROR_UNEXPECTED_COMMAND : 0) |
+           (!isKnownCommand(f.command) ? stage_controller::ERROR_UNKNOWN_COMMAND : 0) |
+           (f.crc != crc(f) ? stage_controller::ERROR_CHECKSUM : 0) |
+           (!isKnownStatus(f.status) ? stage_controller::ERROR_UNKNOWN_STATUS : 0);
+}
+
+static_assert(dataOf(encode(stage_controller::CMD_SETX, 0x12345678)) == 0x12345678, "data must round-trip");
+static_assert(check(encode(stage_controller::CMD_GETX, 0, 2), stage_controller::CMD_GETX) == 0, "encoded frames must check");
+static_assert(crcShift(0x01, 8) == 0x07 && CRC_TABLE.entries[0x80] == 0x89, "CRC-8 table uses polynomial 0x07");
+static_assert(check(encodeExtended(stage_controller::CMD_SETXY, 1, 2), stage_controller::CMD_SETXY) == 0,
+              "encoded extended frames must check");
+
+//CRC-8 of length bytes
+__u8 crc(const __u8 *bytes, int length);
+
+//Fills count frames; commands and data hold one entry per frame.
+void encodeBatch(const CommandID *commands, const __u32 *data, int count, frame *requests);
+
+//Points 2 * count I2C_RDWR messages at the frames: each request is written and
+//its reply read back after a repeated start. The transport fills in the address.
+void linkTransfer(frame *requests, frame *replies, int count, struct i2c_msg *messages);
+
+//Checks every reply against its request and returns the OR of their status
+//codes. data and stageStatus receive one entry per frame and may be NULL.
+int decodeBatch(const frame *requests, const frame *replies, int count, __u32 *data, __u8 *stageStatus);
+
+//times encoding, checking and CRCs of full batches and prints the cost per frame
+void benchmark(FILE *out);
+
+}
+
+#endif // FRAMECODEC_HPP
@@ -0,0 +1,100 @@
+#include "config.hpp"
+
+#include "framepool.hpp"
+#include "amcam.h"
+
+#include <cstdlib>
+
+FramePool::FramePool() {
+    width = 0;
+    height = 0;
+    stride = 0;
+}
+
+FramePool::~FramePool() {
+    free();
+}
+
+bool FramePool::allocate(unsigned count, int width, int height) {
+    free();
+
+    this->width = width;
+    this->height = height;
+    stride = TDIBWIDTHBYTES(24 * width);
+
+    //round up so consecutive cache lines are never shared between buffers
+    size_t size = ((size_t) stride * height + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+    for(unsigned i = 0; i < count; i++) {
+        void *data = NULL;
+
+        if(posix_memalign(&data, ALIGNMENT, size) != 0) {
+            free();
+            return false;
+        }
+
+        Slot *slot = new Slot;
+        slot->data = (unsigned char *) data;
+        slot->refs = 1;
+        buffers.push_back(slot);
+    }
+
+    return true;
+}
+
+//buffers still wrapped by a QImage are released when that image is destroyed
+void FramePool::free() {
+    for(unsigned i = 0; i < buffers.size(); i++) {
+        releaseSlot(buffers[i]);
+    }
+
+    buffers.clear();
+}
+
+int FramePool::acquire() {
+    for(unsigned i = 0; i < buffers.size(); i++) {
+        int idle = 1;
+
+        if(buffers[i]->refs.compare_exchange_strong(idle, 2)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void FramePool::retain(int slot) {
+    buffers[slot]->refs++;
+}
+
+void FramePool::release(int slot) {
+    releaseSlot(buffers[slot]);
+}
+
+unsigned char *FramePool::data(int slot) {
+    return buffers[slot]->data;
+}
+
+unsigned FramePool::getStride() {
+    return stride;
+}
+
+unsigned FramePool::getCount() {
+    return buffers.size();
+}
+
+QImage FramePool::wrap(int slot) {
+    retain(slot);
+    return QImage(buffers[slot]->data, width, height, stride, QImage::Format_RGB888, &FramePool::cleanup, buffers[slot]);
+}
+
+void FramePool::releaseSlot(Slot *slot) {
+    if(slot->refs.fetch_sub(1) == 1) {
+        std::free(slot->data);
+        delete slot;
+    }
+}
+
+void FramePool::cleanup(void *info) {
+    releaseSlot((Slot *) info);
+}
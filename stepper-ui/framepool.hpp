@@ -0,0 +1,54 @@
+#ifndef FRAMEPOOL_HPP
+#define FRAMEPOOL_HPP
+
+#include <QImage>
+
+#include <atomic>
+#include <vector>
+
+//Fixed set of 64-byte aligned 24-bit RGB frame buffers with TDIBWIDTHBYTES row
+//pitch. Slots are reference counted; wrap() hands a slot to Qt as a QImage
+//without copying, and the slot returns to the pool when the last QImage
+//sharing it is destroyed.
+class FramePool {
+
+public:
+    static const unsigned ALIGNMENT = 64;
+
+    FramePool();
+    ~FramePool();
+
+    bool allocate(unsigned count, int width, int height);
+    void free();
+
+    //returns a free slot holding one reference, or -1 if every slot is in use
+    int acquire();
+    void retain(int slot);
+    void release(int slot);
+
+    unsigned char *data(int slot);
+    unsigned getStride();
+    unsigned getCount();
+
+    //adds a reference that is dropped by the QImage cleanup function
+    QImage wrap(int slot);
+
+private:
+    //Heap allocated so buffers still referenced by a QImage can outlive free().
+    //The pool holds one reference itself, so an idle slot has refs == 1.
+    struct Slot {
+        unsigned char *data;
+        std::atomic<int> refs;
+    };
+
+    std::vector<Slot *> buffers;
+    int width;
+    int height;
+    unsigned stride;
+
+    static void releaseSlot(Slot *slot);
+    static void cleanup(void *info);
+
+};
+
+#endif // FRAMEPOOL_HPP
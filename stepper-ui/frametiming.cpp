@@ -0,0 +1,177 @@
+#include "config.hpp"
+
+#include "frametiming.hpp"
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <ctime>
+
+namespace frame_timing {
+
+static const unsigned NO_FRAME = 0xFFFFFFFF;
+
+//A record is rewritten in place when the ring wraps; readers check that the
+//frame id is unchanged before and after copying the stamps.
+struct Record {
+    std::atomic<unsigned> frame;
+    std::atomic<unsigned long long> stamps[STAGE_COUNT];
+};
+
+static Record ring[RING_SIZE];
+static std::atomic<unsigned> nextFrame(0);
+
+static const char *stageNames[STAGE_COUNT] = {
+    "snap request",
+    "exposure start",
+    "exposure end",
+    "frame ready",
+    "pulled",
+    "converted",
+    "consumed"
+};
+
+static bool collect(int from, Stage to, Stats &stats);
+
+unsigned long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned beginFrame() {
+    unsigned frame = nextFrame.fetch_add(1);
+
+    //an id of NO_FRAME would be ambiguous
+    if(frame == NO_FRAME)
+        frame = nextFrame.fetch_add(1);
+
+    Record &r = ring[frame % RING_SIZE];
+    r.frame.store(NO_FRAME);
+
+    for(int i = 0; i < STAGE_COUNT; i++) {
+        r.stamps[i].store(0);
+    }
+
+    r.stamps[STAGE_SNAP_REQUEST].store(now());
+    r.frame.store(frame);
+    return frame;
+}
+
+void stamp(unsigned frame, Stage stage) {
+    Record &r = ring[frame % RING_SIZE];
+
+    if(r.frame.load() == frame) {
+        r.stamps[stage].store(now());
+    }
+}
+
+bool getStats(Stage stage, Stats &stats) {
+    return collect(-1, stage, stats);
+}
+
+const char *getStageName(Stage stage) {
+    return stage < STAGE_COUNT ? stageNames[stage] : "";
+}
+
+void reset() {
+    for(int i = 0; i < RING_SIZE; i++) {
+        ring[i].frame.store(NO_FRAME);
+    }
+}
+
+//from < 0 measures from the latest earlier stage that was stamped
+static bool collect(int from, Stage to, Stats &stats) {
+    std::vector<unsigned> samples;
+    unsigned long long stamps[STAGE_COUNT];
+
+    stats = {};
+
+    if(to <= STAGE_SNAP_REQUEST || to >= STAGE_COUNT)
+        return false;
+
+    for(int i = 0; i < RING_SIZE; i++) {
+        unsigned frame = ring[i].frame.load();
+
+        if(frame == NO_FRAME)
+            continue;
+
+        for(int s = 0; s < STAGE_COUNT; s++) {
+            stamps[s] = ring[i].stamps[s].load();
+        }
+
+        if(ring[i].frame.load() != frame || stamps[to] == 0)
+            continue;
+
+        int start = from;
+
+        if(start < 0) {
+            for(start = to - 1; start > 0 && stamps[start] == 0; start--);
+        }
+
+        if(stamps[start] == 0 || stamps[start] > stamps[to])
+            continue;
+
+        samples.push_back((stamps[to] - stamps[start]) / 1000);
+    }
+
+    if(samples.empty())
+        return false;
+
+    std::sort(samples.begin(), samples.end());
+
+    stats.count = samples.size();
+    stats.min = samples.front();
+    stats.max = samples.back();
+    stats.p50 = samples[(samples.size() - 1) * 50 / 100];
+    stats.p99 = samples[(samples.size() - 1) * 99 / 100];
+
+    for(unsigned i = 0; i < samples.size(); i++) {
+        int bucket = 0;
+
+        while(bucket < HISTOGRAM_BUCKETS - 1 && samples[i] >> (bucket + 1) != 0) {
+            bucket++;
+        }
+
+        stats.histogram[bucket]++;
+    }
+
+    return true;
+}
+
+int report(char *buffer, size_t size) {
+    Stats stats;
+    int length = snprintf(buffer, size, "%-16s %6s %9s %9s %9s %9s (us)\n",
+                          "stage", "count", "min", "p50", "p99", "max");
+
+    for(int stage = STAGE_SNAP_REQUEST + 1; stage <= STAGE_COUNT; stage++) {
+        bool found;
+        const char *name;
+
+        if(stage == STAGE_COUNT) {
+            found = collect(STAGE_SNAP_REQUEST, STAGE_CONSUMED, stats);
+            name = "total";
+        }
+        else {
+            found = collect(-1, (Stage) stage, stats);
+            name = stageNames[stage];
+        }
+
+        if(!found || length < 0 || (size_t) length >= size)
+            continue;
+
+        length += snprintf(buffer + length, size - length, "%-16s %6u %9u %9u %9u %9u\n",
+                           name, stats.count, stats.min, stats.p50, stats.p99, stats.max);
+    }
+
+    return length;
+}
+
+void dump(FILE *out) {
+    char buffer[1024];
+    report(buffer, sizeof(buffer));
+    fputs(buffer, out);
+    fflush(out);
+}
+
+}
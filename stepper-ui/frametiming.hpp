@@ -0,0 +1,54 @@
+#ifndef FRAMETIMING_HPP
+#define FRAMETIMING_HPP
+
+#include <cstdio>
+#include <cstddef>
+
+//Per-frame CLOCK_MONOTONIC timestamps for still captures, kept in a lock-free
+//ring so the camera callback thread can stamp frames without blocking.
+namespace frame_timing {
+
+//points in a still frame's life, in order
+enum Stage {
+    STAGE_SNAP_REQUEST,     //captureImage called
+    STAGE_EXPOSURE_START,   //sensor exposure began (AMCAM_EVENT_EXPO_START)
+    STAGE_EXPOSURE_END,     //sensor exposure ended (AMCAM_EVENT_EXPO_STOP)
+    STAGE_FRAME_READY,      //frame transferred to host (AMCAM_EVENT_STILLIMAGE)
+    STAGE_PULLED,           //frame copied into a pool buffer
+    STAGE_CONVERTED,        //frame published as a QImage
+    STAGE_CONSUMED,         //controller saw stillImageReady()
+    STAGE_COUNT
+};
+
+const int RING_SIZE = 256;
+const int HISTOGRAM_BUCKETS = 24; //bucket i counts latencies in [2^i, 2^(i+1)) microseconds
+
+//latency of the interval ending at a stage, in microseconds
+struct Stats {
+    unsigned count;
+    unsigned min;
+    unsigned p50;
+    unsigned p99;
+    unsigned max;
+    unsigned histogram[HISTOGRAM_BUCKETS];
+};
+
+extern unsigned long long now(); //nanoseconds
+
+//starts a new frame record and stamps STAGE_SNAP_REQUEST; returns frame id
+extern unsigned beginFrame();
+extern void stamp(unsigned frame, Stage stage);
+
+//Interval from the latest earlier stage that was stamped, so stages a backend
+//never reports are folded into the next one. Returns false if no samples.
+extern bool getStats(Stage stage, Stats &stats);
+extern const char *getStageName(Stage stage);
+extern void reset();
+
+//human-readable p50/p99 table; returns number of characters written
+extern int report(char *buffer, size_t size);
+extern void dump(FILE *out);
+
+}
+
+#endif // FRAMETIMING_HPP
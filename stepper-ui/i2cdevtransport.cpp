@@ -0,0 +1,93 @@
+#include "config.hpp"
+
+#include "i2cdevtransport.hpp"
+
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+#ifdef DEBUG_MODE_GLOBAL
+#define DEBUG_MODE_I2C
+#endif
+
+I2cDevTransport::I2cDevTransport(const char *path, int address) {
+    this->path = path;
+    this->address = address;
+    fd = -1;
+}
+
+I2cDevTransport::~I2cDevTransport() {
+    close();
+}
+
+bool I2cDevTransport::open() {
+    if(isOpen())
+        return true;
+
+    fd = ::open(path, O_RDWR);
+
+    if(fd == -1) {
+#ifdef DEBUG_MODE_I2C
+        printf("device file '%-19s' not found\n", path);
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    if(ioctl(fd, I2C_SLAVE, address) == -1) {
+#ifdef DEBUG_MODE_I2C
+        printf("error configuring device address\n");
+        fflush(stdout);
+#endif
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void I2cDevTransport::close() {
+    if(isOpen()) {
+        if(::close(fd) == -1) {
+#ifdef DEBUG_MODE_I2C
+            printf("Could not terminate I2C communication.\n");
+            fflush(stdout);
+#endif
+        }
+
+        fd = -1;
+    }
+}
+
+bool I2cDevTransport::isOpen() {
+    return fd != -1;
+}
+
+//combined transfers need plain I2C messages, which SMBus-only adapters lack
+bool I2cDevTransport::supportsCombined() {
+    unsigned long funcs = 0;
+    return isOpen() && ioctl(fd, I2C_FUNCS, &funcs) != -1 && (funcs & I2C_FUNC_I2C);
+}
+
+int I2cDevTransport::write(const __u8 *bytes, int length) {
+    return ::write(fd, bytes, length);
+}
+
+int I2cDevTransport::read(__u8 *bytes, int length) {
+    return ::read(fd, bytes, length);
+}
+
+bool I2cDevTransport::transfer(struct i2c_msg *messages, int count) {
+    for(int i = 0; i < count; i++) {
+        messages[i].addr = address;
+    }
+
+    struct i2c_rdwr_ioctl_data data;
+    data.msgs = messages;
+    data.nmsgs = count;
+
+    return ioctl(fd, I2C_RDWR, &data) != -1;
+}
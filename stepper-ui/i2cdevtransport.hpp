@@ -0,0 +1,28 @@
+#ifndef I2CDEVTRANSPORT_HPP
+#define I2CDEVTRANSPORT_HPP
+
+#include "stagetransport.hpp"
+
+//stage link over a Linux I2C adapter through the i2c-dev driver
+class I2cDevTransport : public StageTransport {
+
+public:
+    explicit I2cDevTransport(const char *path = "/dev/i2c-1", int address = 0x0F);
+    ~I2cDevTransport();
+
+    bool open() override;
+    void close() override;
+    bool isOpen() override;
+    bool supportsCombined() override;
+    int write(const __u8 *bytes, int length) override;
+    int read(__u8 *bytes, int length) override;
+    bool transfer(struct i2c_msg *messages, int count) override;
+
+private:
+    const char *path;
+    int address;
+    int fd;
+
+};
+
+#endif // I2CDEVTRANSPORT_HPP
@@ -8,14 +8,19 @@
 #include <QScreen>
 #include <QWindow>
 
+#include <cstring>
+
 #include "imageinput.hpp"
 #include "FileSelect.hpp"
 #include "Recipe.hpp"
 #include "testbutton.hpp"
 #include "stagecontroller.h"
+#include "stageemulator.hpp"
 #include "projectormodule.hpp"
 #include "cameramodule.hpp"
 #include "ControlInterface.hpp"
+#include "frametiming.hpp"
+#include "framecodec.hpp"
 
 void testI2c(QVariant params) {
     printf("Beginning test\n");
@@ -72,14 +77,16 @@ void testProjector(QVariant params) {
     showing = !showing;
 }
 
+//the first press starts opening the camera, later ones capture once it is open
 void testCamera(QVariant params) {
-    if(camera_module::isOpen()) {
-    //    camera_module::closeCamera();
-    }
+    camera_module::updateConnection();
 
-    if(camera_module::openCamera()) {
+    if(camera_module::isOpen()) {
         camera_module::captureImage();
     }
+    else {
+        camera_module::openCameraAsync();
+    }
 }
 
 void testRecipe(QVariant params) {
@@ -87,14 +94,57 @@ void testRecipe(QVariant params) {
     recipe.read(params.toString().toStdString().c_str());
 }
 
+//dies per hour the emulated stage allows for a recipe, counting moves and exposures only
+int predictThroughput(const char *path) {
+    Recipe recipe;
+
+    if(!recipe.read(path)) {
+        printf("Could not read recipe '%s'\n", path);
+        return 1;
+    }
+
+    StageEmulator emulator;
+    std::vector<Recipe::Point> dies = recipe.getDiePositions();
+    double dwell = recipe.getExposureTime() * 1000;
+
+    printf("dies:       %zu\n", dies.size());
+    printf("exposure:   %.0f ms\n", dwell);
+    printf("throughput: %.1f dies/hour\n", emulator.predictDiesPerHour(dies, dwell));
+    fflush(stdout);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
+    //--predict-throughput <recipe> prints the emulated stage's dies/hour and exits
+    for(int i = 1; i + 1 < argc; i++) {
+        if(strcmp(argv[i], "--predict-throughput") == 0)
+            return predictThroughput(argv[i + 1]);
+    }
+
+    //--benchmark-codec times the stage frame codec and exits
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--benchmark-codec") == 0) {
+            frame_codec::benchmark(stdout);
+            return 0;
+        }
+    }
+
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
     QCoreApplication::setAttribute(Qt::AA_EnableHighDpiScaling);
 #endif
 
     QApplication app(argc, argv);
 
+    //--frame-timing prints camera latency statistics on exit
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--frame-timing") == 0) {
+            QObject::connect(&app, &QCoreApplication::aboutToQuit, []() {
+                frame_timing::dump(stdout);
+            });
+        }
+    }
+
     QQmlApplicationEngine engine;
     const QUrl url(QStringLiteral("qrc:/main.qml"));
     QObject::connect(&engine, &QQmlApplicationEngine::objectCreated,
@@ -137,17 +187,16 @@ int main(int argc, char *argv[])
     TestButton cameraTestBtn(testCamera);
     engine.rootContext()->setContextProperty("CameraTestCpp", &cameraTestBtn);
 
-    DynamicImage *liveImage;
-    DynamicImage *stillImage;
-    if(camera_module::openCamera() || 1) { //bypass check temporarily
-        liveImage = camera_module::liveImage;
-        engine.addImageProvider(QString("camera_live"), liveImage);
-        engine.rootContext()->setContextProperty("CameraLiveCpp", liveImage);
+    //the camera itself is opened in the background by the process controller
+    camera_module::createImages();
 
-        stillImage = camera_module::stillImage;
-        engine.addImageProvider(QString("camera_still"), stillImage);
-        engine.rootContext()->setContextProperty("CameraStillCpp", stillImage);
-    }
+    DynamicImage *liveImage = camera_module::liveImage;
+    engine.addImageProvider(QString("camera_live"), liveImage);
+    engine.rootContext()->setContextProperty("CameraLiveCpp", liveImage);
+
+    DynamicImage *stillImage = camera_module::stillImage;
+    engine.addImageProvider(QString("camera_still"), stillImage);
+    engine.rootContext()->setContextProperty("CameraStillCpp", stillImage);
 
     //process control interface
     ControlInterface control;
@@ -1,16 +1,24 @@
 #include "config.hpp"
 
 #include <linux/fb.h>
-#include <sys/ioctl.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <errno.h>
-#include <string.h>
 
 #include <cstdio>
 
 #include "projectormodule.hpp"
 #include "DynamicImage.h"
+#include "doselog.hpp"
+#include "fbdevdevice.hpp"
+#include "framebuffer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <ctime>
+#include <sys/mman.h>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
 
 #ifdef DEBUG_MODE_GLOBAL
 #define DEBUG_MODE_PROJECTOR
@@ -18,117 +26,701 @@
 
 namespace projector_module {
 
-static int projectorFd = -1; //projector file descriptor
+static FbdevDevice fbdevDevice;
+#ifdef EMULATION_MODE_PROJECTOR
+EmulatedFramebuffer emulatedFramebuffer;
+static FramebufferDevice *device = &emulatedFramebuffer;
+#else
+static FramebufferDevice *device = &fbdevDevice;
+#endif
 
-DynamicImage *projectedImage;
+DynamicImage *projectedImage = nullptr;
 static QImage *blankImage = nullptr;
 static QImage *patternImage = nullptr;
 static int width = 0;
 static int height = 0;
 
+static Framebuffer framebuffer;
+
+//Patterns prepared at recipe load, so exposure never converts pixels. A binary
+//pattern has a single frame; a grayscale pattern has one frame per bit-plane,
+//least significant first, each shown for a time proportional to its weight.
+struct PreparedPattern {
+    QImage preview;
+    QImage gray;    //source for transformed copies
+    PatternMode mode;
+    std::vector<std::vector<unsigned char> > planes;
+    int firstPage;  //first framebuffer page holding the planes, or -1 if only in RAM
+    bool locked;    //planes are pinned with mlock
+};
+
+//preloaded patterns by id; map nodes never move, so pointers stay valid
+static std::map<std::string, PreparedPattern> patternCache;
+static PreparedPattern directPattern; //set through setPattern
+static const PreparedPattern *activePattern = nullptr;
+
+//copy of the loaded pattern resampled by setTransform, shown in its place
+static const PreparedPattern *basePattern = nullptr;
+static PreparedPattern transformedPattern;
+
+//The blank frame stays in the front page and the planes of the active pattern
+//in the pages behind it, so every change of frame is a single pan with no copy.
+static const int BLANK_PAGE = 0;
+static const int GRAYSCALE_BITS = 8;
+static bool patternStaged = false;
+
+//Preloaded patterns take whole page ranges from the top of the framebuffer
+//down; the pages from 1 up to residentFloor are left for staging patterns that
+//did not fit, and for transformed copies.
+static int residentFloor = 0;
+
+//Wafer outline in projector pixels while exposing a die (maskRadius < 0 when
+//there is none). Parts of the pattern outside it are blanked in place as runs
+//of pixels, so only the clipped region of each page is ever rewritten.
+struct MaskSegment {
+    int y;
+    int left;
+    int right;
+};
+
+static float maskCenterX = 0;
+static float maskCenterY = 0;
+static float maskRadius = -1;
+static std::vector<MaskSegment> maskSegments;     //for the active pattern
+static const PreparedPattern *maskedPattern = nullptr; //pattern whose pages are blanked
+static int maskedFirstPage = 0;
+
+//exposure engine; the thread only touches the framebuffer, not the Qt preview
+static std::thread exposureThread;
+static std::atomic<bool> exposureRunning(false);
+static std::atomic<bool> exposureCancel(false);
+static unsigned exposureAchieved = 0;
+static int exposureDie = -1;
+static unsigned exposureCommanded = 0;
+
+struct ExposureStep {
+    int plane;
+    unsigned long long duration; //nanoseconds
+    unsigned frames;             //refresh frames the plane is up for with vsync
+};
+
+static std::vector<ExposureStep> exposureSteps;
+static bool vsyncSupported = false;
+static unsigned framePeriod = 0; //nanoseconds
+
 bool isOpen();
 bool openProjector();
 void closeProjector();
 void setPattern(QImage image);
 void show();
 void hide();
-static void printErrno(int num);
+static void showFrame(int plane);
+static void hideFrame();
+static void measureFramePeriod();
+static QImage fitPattern(const QImage &image);
+static bool preparePlanes(PreparedPattern &prepared);
+static QImage resample(const QImage &gray, float dx, float dy, float degrees);
+static void stagePattern();
+static void stagePages();
+static int stagedPage(int plane);
+static void maskPages();
+static void unmaskPages();
+static bool prepareFile(const char *path, PatternMode mode, PreparedPattern &prepared);
+static void makeResident(PreparedPattern &prepared);
+static bool planExposure(const PreparedPattern &pattern, unsigned long long duration, bool allPlanes,
+                         std::vector<ExposureStep> &steps);
 
 bool isOpen() {
-    return projectorFd >= 0;
+    return device->isOpen();
+}
+
+bool setDevice(FramebufferDevice *newDevice) {
+    if(isOpen() || newDevice == NULL)
+        return false;
+
+    device = newDevice;
+    return true;
 }
 
 bool openProjector() {
-    __s32 res;
-    struct fb_fix_screeninfo fixedScrInfo;
     struct fb_var_screeninfo varScrInfo;
 
     if(isOpen())
         return true;
 
-    //get file descriptor of hdmi framebuffer
-    projectorFd = open("/dev/fb0", O_RDWR); //make sure this is the correct framebuffer
+    if(!device->open() || !device->getVarInfo(varScrInfo)) {
+        closeProjector();
+        return false;
+    }
 
-    if(projectorFd < 0) {
 #ifdef DEBUG_MODE_PROJECTOR
-        printf("[ProjectorModule] Device file not found\n");
+    //print info
+    printf("[ProjectorModule] Variable display info: %dx%d, %d bpp\n", varScrInfo.xres, varScrInfo.yres, varScrInfo.bits_per_pixel);
+    printf("  Virtual size:        %dx%d\n", varScrInfo.xres_virtual, varScrInfo.yres_virtual);
+    printf("  Visible offset:      %dx%d\n", varScrInfo.xoffset, varScrInfo.yoffset);
+    fflush(stdout);
+#endif
+
+    width = varScrInfo.xres;
+    height = varScrInfo.yres;
+
+    if(!framebuffer.map(device, PROJECTOR_FRAMEBUFFER_PAGES)) {
+        closeProjector();
+        return false;
+    }
+
+    activePattern = nullptr;
+    basePattern = nullptr;
+    residentFloor = framebuffer.getPageCount();
+    framebuffer.flip(BLANK_PAGE);
+    framebuffer.clear();
+    measureFramePeriod();
+
+    //a missing log does not stop exposures
+    dose_log::open(DOSE_LOG_PATH);
+
+    blankImage = new QImage(projector_module::width, projector_module::height, QImage::Format::Format_Grayscale8);
+    blankImage->fill(Qt::black);
+    patternImage = blankImage;
+
+    //the QML engine keeps the provider, so it outlives a close
+    if(projectedImage == nullptr)
+        projectedImage = new DynamicImage();
+
+    projectedImage->setImage(blankImage);
+
+    return true;
+}
+
+void closeProjector() {
+    abortExposure();
+    dose_log::close();
+    framebuffer.unmap();
+    activePattern = nullptr;
+    basePattern = nullptr;
+    transformedPattern.planes.clear();
+    directPattern.planes.clear();
+    clearPatterns();
+    maskRadius = -1;
+    maskSegments.clear();
+
+    if(isOpen()) {
+        device->close();
+    }
+
+    if(blankImage != nullptr) {
+        delete blankImage;
+        blankImage = nullptr;
+        patternImage = nullptr;
+    }
+}
+
+void setPattern(QImage *pattern) {
+    patternImage = pattern;
+
+    //converted now so show() is a plain copy or a flip
+    directPattern.preview = *pattern;
+    directPattern.gray = pattern->convertToFormat(QImage::Format_Grayscale8);
+    directPattern.mode = PATTERN_BINARY;
+    directPattern.planes.resize(1);
+    directPattern.firstPage = -1;
+    activePattern = nullptr;
+    basePattern = nullptr;
+
+    if(framebuffer.convert(*pattern, directPattern.planes[0])) {
+        activePattern = &directPattern;
+        basePattern = activePattern;
+    }
+
+    stagePattern();
+}
+
+bool loadPattern(const char *path, PatternMode mode) {
+    return preloadPattern(path, path, mode) && selectPattern(path);
+}
+
+bool preloadPattern(const char *id, const char *path, PatternMode mode) {
+    std::map<std::string, PreparedPattern>::iterator cached = patternCache.find(id);
+
+    if(cached != patternCache.end()) {
+        if(cached->second.mode == mode)
+            return true;
+
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[ProjectorModule] Pattern id %s is already loaded in another mode\n", id);
         fflush(stdout);
 #endif
         return false;
     }
 
+    PreparedPattern prepared;
+
+    if(!prepareFile(path, mode, prepared)) {
+        return false;
+    }
+
+    //insert first, so the planes are pinned at their final address
+    PreparedPattern &slot = patternCache.insert(std::make_pair(std::string(id), prepared)).first->second;
+    makeResident(slot);
+
 #ifdef DEBUG_MODE_PROJECTOR
-    printf("[ProjectorModule] Device file found\n");
+    if(slot.firstPage >= 0)
+        printf("[ProjectorModule] Pattern %s preloaded into pages %d-%d\n", id,
+               slot.firstPage, slot.firstPage + (int) slot.planes.size() - 1);
+    else
+        printf("[ProjectorModule] Pattern %s preloaded into RAM\n", id);
     fflush(stdout);
 #endif
+    return true;
+}
+
+bool selectPattern(const char *id) {
+    std::map<std::string, PreparedPattern>::iterator cached = patternCache.find(id);
+
+    if(cached == patternCache.end() || exposureRunning)
+        return false;
+
+    if(activePattern == &cached->second)
+        return true;
 
-    //get variable screen info
-    res = ioctl(projectorFd, FBIOGET_VSCREENINFO, &varScrInfo);
-    int errsv = errno;
+    patternImage = &cached->second.preview;
+    activePattern = &cached->second;
+    basePattern = activePattern;
+    stagePattern();
+    return true;
+}
+
+void clearPatterns() {
+    if(exposureRunning)
+        return;
+
+    unmaskPages();
+
+    if(basePattern != &directPattern) {
+        activePattern = nullptr;
+        basePattern = nullptr;
+        patternStaged = false;
+    }
+
+    for(std::map<std::string, PreparedPattern>::iterator it = patternCache.begin(); it != patternCache.end(); ++it) {
+        if(it->second.locked) {
+            for(unsigned i = 0; i < it->second.planes.size(); i++) {
+                if(!it->second.planes[i].empty())
+                    munlock(it->second.planes[i].data(), it->second.planes[i].size());
+            }
+        }
+    }
+
+    patternCache.clear();
+    residentFloor = framebuffer.getPageCount();
+    maskPages();
+}
+
+static bool prepareFile(const char *path, PatternMode mode, PreparedPattern &prepared) {
+    QImage image;
 
-    if(res == -1) {
+    if(!isOpen() || !image.load(path)) {
 #ifdef DEBUG_MODE_PROJECTOR
-        printf("[ProjectorModule] Could not read variable screen info:\n\t");
-        printErrno(errsv);
+        printf("[ProjectorModule] Could not load pattern %s\n", path);
         fflush(stdout);
 #endif
-        closeProjector();
         return false;
     }
 
-    //get fixed screen info
-    res = ioctl(projectorFd, FBIOGET_FSCREENINFO, &fixedScrInfo);
-    errsv = errno;
+    prepared.preview = fitPattern(image);
+    prepared.gray = prepared.preview.convertToFormat(QImage::Format_Grayscale8);
+    prepared.mode = mode;
+    prepared.firstPage = -1;
+    prepared.locked = false;
+
+    if(!preparePlanes(prepared)) {
+        return false;
+    }
 
-    if(res < 0) {
 #ifdef DEBUG_MODE_PROJECTOR
-        printf("[ProjectorModule] Could not read fixed screen info:\n\t");
-        printErrno(errsv);
-        fflush(stdout);
+    printf("[ProjectorModule] Prepared pattern %s: %dx%d -> %dx%d\n", path,
+           image.width(), image.height(), prepared.preview.width(), prepared.preview.height());
+    fflush(stdout);
 #endif
-        closeProjector();
+    return true;
+}
+
+//Gives a preloaded pattern its own framebuffer pages when they can be spared
+//while still leaving room to stage a pattern of the same size, and without
+//overwriting the pattern currently staged; otherwise it stays in RAM and is
+//copied in when selected. The RAM copy is pinned in both cases, since it is
+//also the fallback when flipping fails mid-run.
+static void makeResident(PreparedPattern &prepared) {
+    int pages = prepared.planes.size();
+    int staging = pages;
+
+    //selectPattern does not restage the active pattern, so its pages must survive
+    if(activePattern != nullptr && activePattern->firstPage < 0 && patternStaged &&
+       (int) activePattern->planes.size() > staging) {
+        staging = activePattern->planes.size();
+    }
+
+    prepared.locked = true;
+
+    for(unsigned i = 0; i < prepared.planes.size(); i++) {
+        if(!prepared.planes[i].empty() && mlock(prepared.planes[i].data(), prepared.planes[i].size()) != 0) {
+            prepared.locked = false;
+        }
+    }
+
+    if(!prepared.locked) {
+        //usually RLIMIT_MEMLOCK; the pattern still works, it may just fault in
+        for(unsigned i = 0; i < prepared.planes.size(); i++) {
+            if(!prepared.planes[i].empty())
+                munlock(prepared.planes[i].data(), prepared.planes[i].size());
+        }
+    }
+
+    if(residentFloor - pages < 1 + staging)
+        return;
+
+    for(int i = 0; i < pages; i++) {
+        if(!prepared.planes[i].empty() && !framebuffer.write(residentFloor - pages + i, prepared.planes[i]))
+            return;
+    }
+
+    residentFloor -= pages;
+    prepared.firstPage = residentFloor;
+}
+
+bool setTransform(float dx, float dy, float degrees) {
+    if(basePattern == nullptr || exposureRunning)
+        return false;
+
+    if(dx == 0 && dy == 0 && degrees == 0) {
+        clearTransform();
+        return true;
+    }
+
+    //offsets are in wafer orientation; undo the mirroring applied at load
+    if(PROJECTOR_MIRROR_HORIZONTAL)
+        dx = -dx;
+
+    if(PROJECTOR_MIRROR_VERTICAL)
+        dy = -dy;
+
+    if(PROJECTOR_MIRROR_HORIZONTAL != PROJECTOR_MIRROR_VERTICAL)
+        degrees = -degrees;
+
+    transformedPattern.mode = basePattern->mode;
+    transformedPattern.firstPage = -1;
+    transformedPattern.gray = resample(basePattern->gray, dx, dy, degrees);
+    transformedPattern.preview = transformedPattern.gray;
+
+    if(!preparePlanes(transformedPattern)) {
+        clearTransform();
         return false;
     }
 
 #ifdef DEBUG_MODE_PROJECTOR
-    //print info
-    printf("[ProjectorModule] Variable display info: %dx%d, %d bpp\n", varScrInfo.xres, varScrInfo.yres, varScrInfo.bits_per_pixel);
-    printf("  Virtual size:        %dx%d\n", varScrInfo.xres_virtual, varScrInfo.yres_virtual);
-    printf("  Visible offset:      %dx%d\n", varScrInfo.xoffset, varScrInfo.yoffset);
+    printf("[ProjectorModule] Pattern shifted by (%.2f,%.2f) px, rotated %.3f deg\n", dx, dy, degrees);
     fflush(stdout);
 #endif
 
-    //update width and height here
-    //width = varScrInfo.xres;
-    //height = varScrInfo.yres;
+    patternImage = &transformedPattern.preview;
+    activePattern = &transformedPattern;
+    stagePattern();
+    return true;
+}
+
+void clearTransform() {
+    if(activePattern == &transformedPattern && basePattern != nullptr && !exposureRunning) {
+        patternImage = (QImage *) &basePattern->preview;
+        activePattern = basePattern;
+        stagePattern();
+    }
+}
+
+//bilinear sample with zero outside the image; weights are 8-bit fractions
+static inline unsigned char sample(const QImage &gray, int ix, int iy, int wx, int wy) {
+    int w = gray.width();
+    int h = gray.height();
+    int p[4] = {0, 0, 0, 0};
 
-    height = 1080;
-    width = 1920;
+    for(int i = 0; i < 4; i++) {
+        int x = ix + (i & 1);
+        int y = iy + (i >> 1);
 
-    blankImage = new QImage(projector_module::width, projector_module::height, QImage::Format::Format_RGB888);
-    blankImage->fill(Qt::black);
-    patternImage = blankImage;
-    projectedImage = new DynamicImage();
-    projectedImage->setImage(blankImage);
+        if(x >= 0 && x < w && y >= 0 && y < h)
+            p[i] = gray.constScanLine(y)[x];
+    }
+
+    int top = p[0] * (256 - wx) + p[1] * wx;
+    int bottom = p[2] * (256 - wx) + p[3] * wx;
+    return (top * (256 - wy) + bottom * wy + 32768) >> 16;
+}
+
+//Resamples about the image center. A pure shift has the same bilinear weights
+//at every pixel, so they are computed once; a rotation steps the source
+//position in 16.16 fixed point along each row.
+static QImage resample(const QImage &gray, float dx, float dy, float degrees) {
+    int w = gray.width();
+    int h = gray.height();
+    QImage out(w, h, QImage::Format_Grayscale8);
+
+    if(degrees == 0) {
+        int fx = (int) floor(-dx * 256 + 0.5f);
+        int fy = (int) floor(-dy * 256 + 0.5f);
+        int ox = fx >> 8;
+        int oy = fy >> 8;
+        int wx = fx & 0xFF;
+        int wy = fy & 0xFF;
+        int w00 = (256 - wx) * (256 - wy);
+        int w01 = wx * (256 - wy);
+        int w10 = (256 - wx) * wy;
+        int w11 = wx * wy;
+
+        for(int y = 0; y < h; y++) {
+            unsigned char *dst = out.scanLine(y);
+            int sy = y + oy;
+
+            for(int x = 0; x < w; x++) {
+                int sx = x + ox;
+
+                if(sx >= 0 && sx < w - 1 && sy >= 0 && sy < h - 1) {
+                    const unsigned char *r0 = gray.constScanLine(sy) + sx;
+                    const unsigned char *r1 = gray.constScanLine(sy + 1) + sx;
+                    dst[x] = (r0[0] * w00 + r0[1] * w01 + r1[0] * w10 + r1[1] * w11 + 32768) >> 16;
+                }
+                else {
+                    dst[x] = sample(gray, sx, sy, wx, wy);
+                }
+            }
+        }
+
+        return out;
+    }
+
+    //inverse map: source = R(-angle) * (destination - center - shift) + center
+    double angle = -degrees * M_PI / 180;
+    double c = cos(angle);
+    double sn = sin(angle);
+    double cx = (w - 1) / 2.0;
+    double cy = (h - 1) / 2.0;
+    int stepX = (int) floor(c * 65536 + 0.5);
+    int stepY = (int) floor(sn * 65536 + 0.5);
+
+    for(int y = 0; y < h; y++) {
+        unsigned char *dst = out.scanLine(y);
+        double rx = -cx - dx;
+        double ry = y - cy - dy;
+        long long fx = (long long) floor((c * rx - sn * ry + cx) * 65536 + 0.5);
+        long long fy = (long long) floor((sn * rx + c * ry + cy) * 65536 + 0.5);
+
+        for(int x = 0; x < w; x++, fx += stepX, fy += stepY) {
+            int ix = (int) (fx >> 16);
+            int iy = (int) (fy >> 16);
+            dst[x] = sample(gray, ix, iy, (int) (fx >> 8) & 0xFF, (int) (fy >> 8) & 0xFF);
+        }
+    }
+
+    return out;
+}
+
+//a plane with no pixels set is left empty and skipped during exposure
+static bool preparePlanes(PreparedPattern &prepared) {
+    if(prepared.mode == PATTERN_BINARY) {
+        prepared.planes.resize(1);
+        return framebuffer.convert(prepared.preview, prepared.planes[0], PROJECTOR_DITHER);
+    }
+
+    const QImage &gray = prepared.gray;
+    prepared.planes.assign(GRAYSCALE_BITS, std::vector<unsigned char>());
+
+    for(int bit = 0; bit < GRAYSCALE_BITS; bit++) {
+        QImage plane(gray.width(), gray.height(), QImage::Format_Grayscale8);
+        bool used = false;
+
+        for(int y = 0; y < gray.height(); y++) {
+            const unsigned char *src = gray.constScanLine(y);
+            unsigned char *dst = plane.scanLine(y);
+
+            for(int x = 0; x < gray.width(); x++) {
+                dst[x] = (src[x] >> bit) & 1 ? 255 : 0;
+                used |= dst[x] != 0;
+            }
+        }
+
+        if(used && !framebuffer.convert(plane, prepared.planes[bit]))
+            return false;
+    }
 
     return true;
 }
 
-void closeProjector() {
-    if(isOpen()) {
-        close(projectorFd);
-        projectorFd = -1;
+//scaling is smooth so edge pixels keep their share of the dose through dithering
+static QImage fitPattern(const QImage &image) {
+    QImage fitted = image;
+
+    if(PROJECTOR_PATTERN_SCALE != 1.0) {
+        fitted = fitted.scaled((int) (image.width() * PROJECTOR_PATTERN_SCALE + 0.5),
+                               (int) (image.height() * PROJECTOR_PATTERN_SCALE + 0.5),
+                               Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
     }
 
-    if(blankImage != nullptr) {
-        delete blankImage;
-        blankImage = nullptr;
-        patternImage = nullptr;
+    if(PROJECTOR_MIRROR_HORIZONTAL || PROJECTOR_MIRROR_VERTICAL) {
+        fitted = fitted.mirrored(PROJECTOR_MIRROR_HORIZONTAL, PROJECTOR_MIRROR_VERTICAL);
     }
+
+#ifdef DEBUG_MODE_PROJECTOR
+    if(fitted.width() > width || fitted.height() > height) {
+        printf("[ProjectorModule] Pattern is larger than the projector and will be clipped\n");
+        fflush(stdout);
+    }
+#endif
+
+    return fitted;
 }
 
-void setPattern(QImage *pattern) {
-    patternImage = pattern;
+//puts the active pattern in its pages, moving the wafer mask along with it
+static void stagePattern() {
+    unmaskPages();
+    stagePages();
+    maskPages();
+}
+
+static void stagePages() {
+    patternStaged = false;
+
+    if(activePattern == nullptr)
+        return;
+
+    //a preloaded pattern already sits in its own pages
+    if(activePattern->firstPage >= 0) {
+        framebuffer.flip(BLANK_PAGE);
+        patternStaged = true;
+        return;
+    }
+
+    if(residentFloor < 1 + (int) activePattern->planes.size())
+        return;
+
+    framebuffer.flip(BLANK_PAGE);
+    patternStaged = true;
+
+    for(unsigned i = 0; i < activePattern->planes.size(); i++) {
+        if(!activePattern->planes[i].empty() && !framebuffer.write(1 + i, activePattern->planes[i])) {
+            patternStaged = false;
+        }
+    }
+}
+
+static int stagedPage(int plane) {
+    return (activePattern->firstPage >= 0 ? activePattern->firstPage : 1) + plane;
+}
+
+bool setWaferMask(float waferSize, float dieX, float dieY) {
+    if(exposureRunning || waferSize <= 0)
+        return false;
+
+    float radius = waferSize / 2;
+    float sx = PROJECTOR_MIRROR_HORIZONTAL ? -1 : 1;
+    float sy = PROJECTOR_MIRROR_VERTICAL ? -1 : 1;
+
+    //the field is centered on the die; positions are measured from the wafer's corner
+    maskCenterX = width / 2.0f + sx * (radius - dieX) / MILLIMETERS_PER_PIXEL;
+    maskCenterY = height / 2.0f + sy * (radius - dieY) / MILLIMETERS_PER_PIXEL;
+    maskRadius = std::max(radius - WAFER_EDGE_EXCLUSION, 0.0f) / MILLIMETERS_PER_PIXEL;
+
+    unmaskPages();
+    maskPages();
+
+#ifdef DEBUG_MODE_PROJECTOR
+    printf("[ProjectorModule] Wafer mask blanks %u runs of the pattern\n", (unsigned) maskSegments.size());
+    fflush(stdout);
+#endif
+    return true;
+}
+
+void clearWaferMask() {
+    if(exposureRunning)
+        return;
+
+    maskRadius = -1;
+    unmaskPages();
+    maskSegments.clear();
+}
+
+//Runs of the active pattern's area that fall outside the mask circle, per row;
+//pixels count as inside when their centers are.
+static void buildMaskSegments() {
+    maskSegments.clear();
+
+    if(maskRadius < 0 || activePattern == nullptr)
+        return;
+
+    int left = std::max((width - activePattern->preview.width()) / 2, 0);
+    int top = std::max((height - activePattern->preview.height()) / 2, 0);
+    int right = std::min(left + activePattern->preview.width(), width);
+    int bottom = std::min(top + activePattern->preview.height(), height);
+
+    for(int y = top; y < bottom; y++) {
+        float dy = y + 0.5f - maskCenterY;
+        MaskSegment segment = {y, left, right};
+
+        if(std::fabs(dy) >= maskRadius) {
+            maskSegments.push_back(segment);
+            continue;
+        }
+
+        float half = std::sqrt(maskRadius * maskRadius - dy * dy);
+        int inLeft = (int) std::ceil(maskCenterX - half - 0.5f);
+        int inRight = (int) std::floor(maskCenterX + half - 0.5f) + 1;
+
+        if(inLeft > left) {
+            segment.right = std::min(inLeft, right);
+            maskSegments.push_back(segment);
+        }
+
+        if(inRight < right) {
+            segment.left = std::max(inRight, left);
+            segment.right = right;
+            maskSegments.push_back(segment);
+        }
+    }
+}
+
+static void maskPages() {
+    buildMaskSegments();
+
+    if(maskSegments.empty() || !patternStaged)
+        return;
+
+    maskedPattern = activePattern;
+    maskedFirstPage = stagedPage(0);
+
+    for(unsigned i = 0; i < activePattern->planes.size(); i++) {
+        if(activePattern->planes[i].empty())
+            continue;
+
+        for(unsigned j = 0; j < maskSegments.size(); j++) {
+            const MaskSegment &m = maskSegments[j];
+            framebuffer.clearRegion(maskedFirstPage + i, m.left, m.y, m.right, m.y + 1);
+        }
+    }
+}
+
+//copies the blanked runs back from the prepared planes
+static void unmaskPages() {
+    if(maskedPattern == nullptr)
+        return;
+
+    for(unsigned i = 0; i < maskedPattern->planes.size(); i++) {
+        if(maskedPattern->planes[i].empty())
+            continue;
+
+        for(unsigned j = 0; j < maskSegments.size(); j++) {
+            const MaskSegment &m = maskSegments[j];
+            framebuffer.writeRegion(maskedFirstPage + i, maskedPattern->planes[i], m.left, m.y, m.right, m.y + 1);
+        }
+    }
+
+    maskedPattern = nullptr;
 }
 
 void show() {
@@ -136,6 +728,17 @@ void show() {
     printf("[ProjectorModule] Showing pattern image\n");
     fflush(stdout);
 #endif
+    //a grayscale pattern is previewed by its most significant used plane
+    if(activePattern != nullptr) {
+        int plane = activePattern->planes.size() - 1;
+
+        while(plane > 0 && activePattern->planes[plane].empty()) {
+            plane--;
+        }
+
+        showFrame(plane);
+    }
+
     projectedImage->setImage(patternImage);
 }
 
@@ -144,51 +747,264 @@ void hide() {
     printf("[ProjectorModule] Showing blank image\n");
     fflush(stdout);
 #endif
+    hideFrame();
     projectedImage->setImage(blankImage);
 }
 
-static void printErrno(int num) {
-    switch (num) {
-    case EAGAIN:
-        printf("EAGAIN\n");
-        break;
-    case EBADF:
-        printf("EBADF\n");
-        break;
-    case EDESTADDRREQ:
-        printf("EDESTADDRREQ\n");
-        break;
-    case EDQUOT:
-        printf("EDQUOT\n");
-        break;
-    case EFAULT:
-        printf("EFAULT\n");
-        break;
-    case EFBIG:
-        printf("EFBIG\n");
-        break;
-    case EINTR:
-        printf("EINTR\n");
-        break;
-    case EINVAL:
-        printf("EINVAL\n");
-        break;
-    case EIO:
-        printf("EIO\n");
-        break;
-    case ENOSPC:
-        printf("ENOSPC\n");
-        break;
-    case EPIPE:
-        printf("EPIPE\n");
-        break;
-    case EREMOTEIO:
-        printf("EREMOTEIO\n");
-        break;
-    default:
-        printf("other: %08X\n", num);
+static void showFrame(int plane) {
+    if(activePattern == nullptr || activePattern->planes[plane].empty()) {
+        hideFrame();
+        return;
+    }
+
+    if(patternStaged && !framebuffer.flip(stagedPage(plane))) {
+        //panning is not working; copy into the front page from now on
+        patternStaged = false;
+    }
+
+    if(!patternStaged) {
+        framebuffer.blit(activePattern->planes[plane]);
+
+        for(unsigned j = 0; j < maskSegments.size(); j++) {
+            const MaskSegment &m = maskSegments[j];
+            framebuffer.clearRegion(framebuffer.getVisiblePage(), m.left, m.y, m.right, m.y + 1);
+        }
+    }
+}
+
+static void hideFrame() {
+    if(!patternStaged || !framebuffer.flip(BLANK_PAGE)) {
+        patternStaged = false;
+        framebuffer.clear();
+    }
+}
+
+static unsigned long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//sleeps in short slices so an abort does not wait out a long exposure
+static void sleepUntil(unsigned long long deadline) {
+    const unsigned long long slice = 10000000ULL;
+
+    while(!exposureCancel) {
+        unsigned long long current = now();
+
+        if(current >= deadline)
+            break;
+
+        unsigned long long wake = deadline - current > slice ? current + slice : deadline;
+        struct timespec ts;
+        ts.tv_sec = wake / 1000000000ULL;
+        ts.tv_nsec = wake % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+}
+
+//the mode timings are often left at zero, so fall back to timing a few vsyncs
+static void measureFramePeriod() {
+    vsyncSupported = framebuffer.waitForVsync();
+    framePeriod = framebuffer.getFramePeriod();
+
+    if(vsyncSupported && framePeriod == 0) {
+        const int frames = 4;
+        unsigned long long start = now();
+
+        for(int i = 0; i < frames; i++) {
+            framebuffer.waitForVsync();
+        }
+
+        framePeriod = (now() - start) / frames;
     }
+
+#ifdef DEBUG_MODE_PROJECTOR
+    printf("[ProjectorModule] Vsync %s, frame period %uus\n",
+           vsyncSupported ? "available" : "not available", framePeriod / 1000);
     fflush(stdout);
+#endif
+}
+
+//Splits the exposure into one step per used plane, or per plane with allPlanes;
+//bit-plane k of a grayscale pattern gets 2^k/255 of the time, so a pixel's
+//dose follows its gray level. With vsync each step is rounded to whole frames,
+//carrying the rounding over to the next plane so the total dose and the plane
+//ratios stay as close as page flips allow. Returns false if a plane would get
+//no frame at all.
+static bool planExposure(const PreparedPattern &pattern, unsigned long long duration, bool allPlanes,
+                         std::vector<ExposureStep> &steps) {
+    steps.clear();
+
+    if(pattern.mode == PATTERN_BINARY) {
+        ExposureStep step = {0, duration, 0};
+        steps.push_back(step);
+    }
+    else {
+        unsigned total = (1 << GRAYSCALE_BITS) - 1;
+
+        for(int bit = GRAYSCALE_BITS - 1; bit >= 0; bit--) {
+            if(!allPlanes && pattern.planes[bit].empty())
+                continue;
+
+            ExposureStep step = {bit, duration * (1ULL << bit) / total, 0};
+            steps.push_back(step);
+        }
+    }
+
+    if(!vsyncSupported || framePeriod == 0)
+        return true;
+
+    unsigned long long planned = 0;
+    unsigned long long shown = 0;
+
+    for(unsigned i = 0; i < steps.size(); i++) {
+        planned += steps[i].duration;
+        unsigned long long frames = (planned + framePeriod / 2) / framePeriod - shown;
+
+        //page flips cannot show a plane for less than a frame
+        if(frames == 0) {
+#ifdef DEBUG_MODE_PROJECTOR
+            printf("[ProjectorModule] Exposure of %lluus leaves plane %d without a frame at %uus per frame\n",
+                   duration / 1000, steps[i].plane, framePeriod / 1000);
+            fflush(stdout);
+#endif
+            steps.clear();
+            return false;
+        }
+
+        steps[i].frames = frames;
+        shown += frames;
+    }
+
+    return true;
+}
+
+static void runExposure() {
+    unsigned long long start = now();
+    unsigned long long end = start;
+
+    if(exposureSteps.empty()) {
+        //nothing to expose
+    }
+    else if(vsyncSupported && framePeriod > 0) {
+        bool first = true;
+
+        //each pan latches at the next vsync, so a frame is up from the vsync after the call
+        framebuffer.waitForVsync();
+
+        for(unsigned i = 0; i < exposureSteps.size() && !exposureCancel; i++) {
+            unsigned frames = exposureSteps[i].frames;
+            showFrame(exposureSteps[i].plane);
+
+            for(unsigned f = 0; f < frames && !exposureCancel; f++) {
+                framebuffer.waitForVsync();
+
+                if(f == 0) {
+                    unsigned long long shown = now();
+                    dose_log::record(dose_log::EVENT_ON, exposureDie, exposureCommanded, exposureSteps[i].plane, shown);
+
+                    if(first) {
+                        start = shown;
+                        first = false;
+                    }
+                }
+            }
+        }
+
+        hideFrame();
+        framebuffer.waitForVsync();
+        end = first ? start : now();
+    }
+    else {
+        unsigned long long deadline = start;
+
+        for(unsigned i = 0; i < exposureSteps.size() && !exposureCancel; i++) {
+            deadline += exposureSteps[i].duration;
+            showFrame(exposureSteps[i].plane);
+            dose_log::record(dose_log::EVENT_ON, exposureDie, exposureCommanded, exposureSteps[i].plane, now());
+            sleepUntil(deadline);
+        }
+
+        hideFrame();
+        end = now();
+    }
+
+    if(!exposureSteps.empty()) {
+        dose_log::record(exposureCancel ? dose_log::EVENT_ABORTED : dose_log::EVENT_OFF,
+                         exposureDie, exposureCommanded, 0, end);
+    }
+
+    exposureAchieved = (end - start) / 1000;
+    exposureRunning = false;
+}
+
+bool startExposure(unsigned microseconds, int die) {
+    if(!isOpen() || exposureRunning)
+        return false;
+
+    if(exposureThread.joinable()) {
+        exposureThread.join();
+    }
+
+    exposureSteps.clear();
+
+    if(activePattern != nullptr && !planExposure(*activePattern, microseconds * 1000ULL, false, exposureSteps))
+        return false;
+
+    exposureAchieved = 0;
+    exposureDie = die;
+    exposureCommanded = microseconds;
+    exposureCancel = false;
+    exposureRunning = true;
+    projectedImage->setImage(patternImage);
+
+    exposureThread = std::thread(runExposure);
+    return true;
+}
+
+//Every plane is counted, since the gray edges of a shifted pattern can fill
+//planes the loaded one left empty.
+bool canExpose(unsigned microseconds) {
+    std::vector<ExposureStep> steps;
+
+    for(std::map<std::string, PreparedPattern>::iterator i = patternCache.begin(); i != patternCache.end(); ++i) {
+        if(!planExposure(i->second, microseconds * 1000ULL, true, steps))
+            return false;
+    }
+
+    return true;
+}
+
+bool exposureDone() {
+    if(exposureRunning)
+        return false;
+
+    if(exposureThread.joinable()) {
+        exposureThread.join();
+        projectedImage->setImage(blankImage);
+
+#ifdef DEBUG_MODE_PROJECTOR
+        printf("[ProjectorModule] Exposure finished after %uus\n", exposureAchieved);
+        fflush(stdout);
+#endif
+    }
+
+    return true;
+}
+
+void abortExposure() {
+    exposureCancel = true;
+
+    if(exposureThread.joinable()) {
+        exposureThread.join();
+    }
+
+    exposureRunning = false;
+}
+
+unsigned getAchievedExposure() {
+    return exposureAchieved;
 }
 
 }
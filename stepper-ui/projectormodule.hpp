@@ -1,7 +1,14 @@
 #ifndef PROJECTORMODULE_HPP
 #define PROJECTORMODULE_HPP
 
+#include "config.hpp"
+
 #include "DynamicImage.h"
+#include "framebufferdevice.hpp"
+
+#ifdef EMULATION_MODE_PROJECTOR
+#include "emulatedframebuffer.hpp"
+#endif
 
 #ifdef DEBUG_MODE_GLOBAL
 #define DEBUG_MODE_PROJECTOR
@@ -9,15 +16,71 @@
 
 namespace projector_module {
 
+enum PatternMode {
+    PATTERN_BINARY,
+    PATTERN_GRAYSCALE //gray level sets the dose through bit-plane temporal dithering
+};
+
 extern DynamicImage *projectedImage;
 
 extern bool isOpen();
 extern bool openProjector();
 extern void closeProjector();
 extern void setPattern(QImage *image);
+
+//Loads a pattern file and prepares it for display: scaled by
+//PROJECTOR_PATTERN_SCALE, mirrored for the optics, dithered and converted to
+//the framebuffer format. Grayscale patterns are split into bit-planes here.
+//Results are cached by path until the projector closes.
+extern bool loadPattern(const char *path, PatternMode mode = PATTERN_BINARY);
+
+//Prepares a pattern like loadPattern and keeps it under id, so runs that
+//expose different patterns per die or per layer switch without reloading.
+//Spare framebuffer pages hold whole patterns, making a switch a page flip;
+//the rest stay in pinned RAM and are copied in by selectPattern.
+extern bool preloadPattern(const char *id, const char *path, PatternMode mode = PATTERN_BINARY);
+extern bool selectPattern(const char *id);
+extern void clearPatterns();
+
+//Shifts (in projector pixels, fractions allowed) and rotates (in degrees about
+//the pattern center) the loaded pattern for the next exposures, so a small
+//alignment residual is corrected optically. Not allowed during an exposure.
+extern bool setTransform(float dx, float dy, float degrees);
+extern void clearTransform();
+
+//Blanks the parts of the pattern that would land outside the wafer, less
+//WAFER_EDGE_EXCLUSION, with the field centered on the die at (dieX, dieY)
+//millimeters. Only the clipped rows of the staged pages are rewritten, and
+//they are restored when the mask moves or is cleared.
+extern bool setWaferMask(float waferSize, float dieX, float dieY);
+extern void clearWaferMask();
 extern void show();
 extern void hide();
 
+//selects the display used by openProjector; projector must be closed
+extern bool setDevice(FramebufferDevice *device);
+
+//Shows the pattern for the given time on a dedicated thread, then blanks the
+//projector. With FBIO_WAITFORVSYNC the duration is rounded to whole refresh
+//frames and counted in vsyncs; otherwise it is timed with clock_nanosleep.
+//Each on and off transition is written to the dose log under the die index.
+//With vsync every used plane needs at least one frame: a binary pattern needs
+//half a frame period, and a grayscale pattern using bit-plane 0 about 128 frame
+//periods (2.1s at 60Hz). Shorter exposures are refused.
+extern bool startExposure(unsigned microseconds, int die = -1);
+
+//false if startExposure would refuse the duration for a loaded or preloaded pattern
+extern bool canExpose(unsigned microseconds);
+extern bool exposureDone();
+extern void abortExposure();
+
+//time the pattern was actually on screen, in microseconds
+extern unsigned getAchievedExposure();
+
+#ifdef EMULATION_MODE_PROJECTOR
+extern EmulatedFramebuffer emulatedFramebuffer;
+#endif
+
 }
 
 #endif // PROJECTORMODULE_HPP
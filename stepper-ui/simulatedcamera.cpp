@@ -0,0 +1,468 @@
+#include "config.hpp"
+
+#include "simulatedcamera.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#ifdef DEBUG_MODE_GLOBAL
+#define DEBUG_MODE_CAMERA
+#endif
+
+#ifdef DEBUG_MODE_CAMERA
+#include <cstdio>
+#endif
+
+SimulatedCamera::SimulatedCamera() {
+    settings = defaultSettings();
+    positionSource = nullptr;
+    sceneWidth = 0;
+    sceneHeight = 0;
+    liveCount = 0;
+    stillCount = 0;
+    exposureTime = settings.exposureTime;
+    exposureGain = 100;
+    opened = false;
+    running = false;
+    snapPending = false;
+    disconnectPending = false;
+    pluggedTime = std::chrono::steady_clock::now();
+    hotPlugCallback = nullptr;
+    hotPlugCtx = nullptr;
+    snapX = 0;
+    snapY = 0;
+    callback = nullptr;
+    callbackCtx = nullptr;
+}
+
+SimulatedCamera::~SimulatedCamera() {
+    close();
+
+    if(plugThread.joinable()) {
+        plugThread.join();
+    }
+}
+
+SimulatedCamera::Settings SimulatedCamera::defaultSettings() {
+    Settings s;
+    s.liveWidth = 640;
+    s.liveHeight = 480;
+    s.stillWidth = 1280;
+    s.stillHeight = 960;
+    s.fieldWidth = 0;
+    s.offsetX = 0;
+    s.offsetY = 0;
+    s.rotation = 0;
+    s.noise = 4;
+    s.blurRadius = 1;
+    s.background = 40;
+    s.contrast = 160;
+    s.exposureTime = 10000;
+    s.latency = 150;
+    s.openLatency = 300;
+    s.livePeriod = 100;
+    s.seed = 1;
+    return s;
+}
+
+//takes effect on the next open() for resolution, and on the next frame otherwise
+void SimulatedCamera::setSettings(const Settings &settings) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->settings = settings;
+}
+
+SimulatedCamera::Settings SimulatedCamera::getSettings() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return settings;
+}
+
+void SimulatedCamera::setScene(const unsigned char *grayscale, unsigned width, unsigned height,
+                               const std::vector<Recipe::Point> &dies) {
+    std::lock_guard<std::mutex> lock(mutex);
+    sceneWidth = width;
+    sceneHeight = height;
+    scene.assign(grayscale, grayscale + width*height);
+    this->dies = dies;
+}
+
+//source is called from snap() for still frames and from the worker thread for live frames
+void SimulatedCamera::setPositionSource(PositionSource source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    positionSource = source;
+}
+
+void SimulatedCamera::unplug(unsigned downtime) {
+    if(plugThread.joinable()) {
+        plugThread.join();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    pluggedTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(downtime);
+    disconnectPending = running;
+    wake.notify_all();
+
+    plugThread = std::thread([this, downtime]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(downtime));
+        HotPlugCallback cb;
+        void *ctx;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cb = hotPlugCallback;
+            ctx = hotPlugCtx;
+        }
+
+        if(cb != nullptr)
+            cb(ctx);
+    });
+}
+
+bool SimulatedCamera::open() {
+    unsigned openLatency = getSettings().openLatency;
+    std::this_thread::sleep_for(std::chrono::milliseconds(openLatency));
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(std::chrono::steady_clock::now() < pluggedTime) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[SimulatedCamera] Device unplugged\n");
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    if(settings.liveWidth <= 0 || settings.liveHeight <= 0 ||
+       settings.stillWidth <= 0 || settings.stillHeight <= 0) {
+#ifdef DEBUG_MODE_CAMERA
+        printf("[SimulatedCamera] Invalid resolution\n");
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    liveFrame.assign(TDIBWIDTHBYTES(24 * settings.liveWidth) * settings.liveHeight, 0);
+    stillFrame.assign(TDIBWIDTHBYTES(24 * settings.stillWidth) * settings.stillHeight, 0);
+    liveCount = 0;
+    stillCount = 0;
+    exposureTime = settings.exposureTime;
+    exposureGain = 100;
+    snapPending = false;
+    opened = true;
+    return true;
+}
+
+//must not be called from the event callback, as with Amcam_Close
+void SimulatedCamera::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+        opened = false;
+        snapPending = false;
+        wake.notify_all();
+    }
+
+    if(worker.joinable()) {
+        worker.join();
+    }
+}
+
+bool SimulatedCamera::isOpen() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return opened;
+}
+
+bool SimulatedCamera::getSize(bool still, int &width, int &height) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(!opened)
+        return false;
+
+    width = still ? settings.stillWidth : settings.liveWidth;
+    height = still ? settings.stillHeight : settings.liveHeight;
+    return true;
+}
+
+bool SimulatedCamera::start(EventCallback callback, void *ctx) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(!opened || running)
+        return false;
+
+    this->callback = callback;
+    callbackCtx = ctx;
+    running = true;
+    worker = std::thread(&SimulatedCamera::run, this);
+    return true;
+}
+
+bool SimulatedCamera::snap() {
+    float x = 0;
+    float y = 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(!running)
+        return false;
+
+    //sample the stage when the snap is requested so the frame does not depend on thread timing
+    if(positionSource != nullptr && !positionSource(x, y))
+        return false;
+
+    snapX = x;
+    snapY = y;
+    snapDue = std::chrono::steady_clock::now() + std::chrono::milliseconds(settings.latency);
+    snapPending = true;
+    wake.notify_all();
+    return true;
+}
+
+bool SimulatedCamera::pullImage(void *buffer, bool still) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(!opened)
+        return false;
+
+    std::vector<unsigned char> &frame = still ? stillFrame : liveFrame;
+    memcpy(buffer, frame.data(), frame.size());
+    return true;
+}
+
+bool SimulatedCamera::getExposureRange(unsigned &minTime, unsigned &maxTime,
+                                       unsigned short &minGain, unsigned short &maxGain) {
+    minTime = minExposureTime;
+    maxTime = maxExposureTime;
+    minGain = minExposureGain;
+    maxGain = maxExposureGain;
+    return true;
+}
+
+bool SimulatedCamera::getExposure(unsigned &time, unsigned short &gain) {
+    std::lock_guard<std::mutex> lock(mutex);
+    time = exposureTime;
+    gain = exposureGain;
+    return true;
+}
+
+bool SimulatedCamera::setExposure(unsigned time, unsigned short gain) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(time < minExposureTime || time > maxExposureTime ||
+       gain < minExposureGain || gain > maxExposureGain)
+        return false;
+
+    exposureTime = time;
+    exposureGain = gain;
+    return true;
+}
+
+//histogram of the last live frame, delivered before returning
+bool SimulatedCamera::requestHistogram(HistogramCallback callback, void *ctx) {
+    float hist[256] = {};
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if(!running)
+            return false;
+
+        unsigned pitch = TDIBWIDTHBYTES(24 * settings.liveWidth);
+
+        for(int y = 0; y < settings.liveHeight; y++) {
+            for(int x = 0; x < settings.liveWidth; x++) {
+                hist[liveFrame[pitch*y + 3*x]] += 1;
+            }
+        }
+    }
+
+    //frames are gray, so every channel has the same histogram
+    callback(hist, hist, hist, hist, ctx);
+    return true;
+}
+
+void SimulatedCamera::setHotPlugCallback(HotPlugCallback callback, void *ctx) {
+    std::lock_guard<std::mutex> lock(mutex);
+    hotPlugCallback = callback;
+    hotPlugCtx = ctx;
+}
+
+void SimulatedCamera::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::chrono::steady_clock::time_point liveDue = std::chrono::steady_clock::now();
+
+    while(running) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        unsigned event = 0;
+
+        if(disconnectPending) {
+            //device is gone; no more frames until it is reopened
+            disconnectPending = false;
+            snapPending = false;
+            event = AMCAM_EVENT_DISCONNECTED;
+        }
+        else if(now < pluggedTime) {
+            wake.wait_until(lock, pluggedTime);
+            continue;
+        }
+        else if(snapPending && now >= snapDue) {
+            snapPending = false;
+            render(stillFrame, settings.stillWidth, settings.stillHeight, snapX, snapY,
+                   settings.seed ^ (stillCount * 2654435761u));
+            stillCount++;
+            event = AMCAM_EVENT_STILLIMAGE;
+        }
+        else if(settings.livePeriod > 0 && now >= liveDue) {
+            float x = 0;
+            float y = 0;
+
+            if(positionSource != nullptr)
+                positionSource(x, y);
+
+            render(liveFrame, settings.liveWidth, settings.liveHeight, x, y,
+                   ~settings.seed ^ (liveCount * 2654435761u));
+            liveCount++;
+            liveDue = now + std::chrono::milliseconds(settings.livePeriod);
+            event = AMCAM_EVENT_IMAGE;
+        }
+
+        if(event != 0) {
+            EventCallback cb = callback;
+            void *ctx = callbackCtx;
+
+            //callback pulls the frame, which takes the lock
+            lock.unlock();
+            cb(event, ctx);
+            lock.lock();
+            continue;
+        }
+
+        if(snapPending && (settings.livePeriod == 0 || snapDue < liveDue))
+            wake.wait_until(lock, snapDue);
+        else if(settings.livePeriod > 0)
+            wake.wait_until(lock, liveDue);
+        else
+            wake.wait(lock);
+    }
+}
+
+//renders the die nearest to the stage position, mirrored as seen through the camera optics
+void SimulatedCamera::render(std::vector<unsigned char> &dest, int w, int h, float stageX, float stageY, unsigned seed) {
+    unsigned pitch = TDIBWIDTHBYTES(24 * w);
+    float exposure = (float) exposureTime * exposureGain / (settings.exposureTime * 100.0f);
+    std::vector<float> gray(w*h, settings.background * exposure);
+
+    dest.assign(pitch * h, 0);
+
+    if(!scene.empty()) {
+        //scene displacement in pattern pixels
+        float shiftX = settings.offsetX / MILLIMETERS_PER_PIXEL;
+        float shiftY = settings.offsetY / MILLIMETERS_PER_PIXEL;
+        float bestDist = -1;
+
+        for(unsigned i = 0; i < dies.size(); i++) {
+            float dx = dies[i].x - stageX;
+            float dy = dies[i].y - stageY;
+
+            if(bestDist < 0 || dx*dx + dy*dy < bestDist) {
+                bestDist = dx*dx + dy*dy;
+                shiftX = (dx + settings.offsetX) / MILLIMETERS_PER_PIXEL;
+                shiftY = (dy + settings.offsetY) / MILLIMETERS_PER_PIXEL;
+            }
+        }
+
+        float fieldPixels = settings.fieldWidth > 0 ? settings.fieldWidth / MILLIMETERS_PER_PIXEL : sceneWidth;
+        float scale = fieldPixels / w;
+        float theta = settings.rotation * M_PI / 180;
+        float cosT = cos(theta);
+        float sinT = sin(theta);
+
+        for(int cy = 0; cy < h; cy++) {
+            for(int cx = 0; cx < w; cx++) {
+                float dx = ((w - 1 - cx) - w/2.0f) * scale;
+                float dy = (cy - h/2.0f) * scale;
+                float px = cosT*dx - sinT*dy + sceneWidth/2.0f - shiftX;
+                float py = sinT*dx + cosT*dy + sceneHeight/2.0f - shiftY;
+
+                //bilinear sample; outside of the pattern is unexposed
+                int x0 = (int) floor(px);
+                int y0 = (int) floor(py);
+                float fx = px - x0;
+                float fy = py - y0;
+                float sample = 0;
+
+                for(int j = 0; j < 2; j++) {
+                    for(int i = 0; i < 2; i++) {
+                        int sx = x0 + i;
+                        int sy = y0 + j;
+
+                        if(sx < 0 || sy < 0 || sx >= (int) sceneWidth || sy >= (int) sceneHeight)
+                            continue;
+
+                        sample += (i ? fx : 1-fx) * (j ? fy : 1-fy) * scene[sceneWidth*sy + sx];
+                    }
+                }
+
+                gray[w*cy + cx] += exposure * settings.contrast * sample / 255;
+            }
+        }
+    }
+
+    //separable box blur with clamped edges
+    int r = settings.blurRadius;
+
+    if(r > 0) {
+        std::vector<float> tmp(w*h);
+
+        for(int y = 0; y < h; y++) {
+            for(int x = 0; x < w; x++) {
+                float sum = 0;
+
+                for(int k = -r; k <= r; k++) {
+                    int sx = x+k < 0 ? 0 : (x+k >= w ? w-1 : x+k);
+                    sum += gray[w*y + sx];
+                }
+
+                tmp[w*y + x] = sum / (2*r + 1);
+            }
+        }
+
+        for(int y = 0; y < h; y++) {
+            for(int x = 0; x < w; x++) {
+                float sum = 0;
+
+                for(int k = -r; k <= r; k++) {
+                    int sy = y+k < 0 ? 0 : (y+k >= h ? h-1 : y+k);
+                    sum += tmp[w*sy + x];
+                }
+
+                gray[w*y + x] = sum / (2*r + 1);
+            }
+        }
+    }
+
+    //gaussian noise from a seeded xorshift generator (Box-Muller transform)
+    unsigned state = seed != 0 ? seed : 1;
+
+    for(int y = 0; y < h; y++) {
+        for(int x = 0; x < w; x++) {
+            float v = gray[w*y + x];
+
+            if(settings.noise > 0) {
+                float u[2];
+
+                for(int i = 0; i < 2; i++) {
+                    state ^= state << 13;
+                    state ^= state >> 17;
+                    state ^= state << 5;
+                    u[i] = (state + 1.0f) / 4294967296.0f;
+                }
+
+                v += settings.noise * sqrt(-2 * log(u[0])) * cos(2 * M_PI * u[1]);
+            }
+
+            unsigned char c = v < 0 ? 0 : (v > 255 ? 255 : (unsigned char) (v + 0.5f));
+            dest[pitch*y + 3*x] = c;
+            dest[pitch*y + 3*x + 1] = c;
+            dest[pitch*y + 3*x + 2] = c;
+        }
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef SIMULATEDCAMERA_HPP
+#define SIMULATEDCAMERA_HPP
+
+#include "camerabackend.hpp"
+#include "Recipe.hpp"
+
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//Camera backend that renders the recipe pattern as it would be seen on a wafer
+//placed under the stage, so fine alignment can run without hardware. Output is
+//a pure function of the settings, scene, stage position and frame count.
+class SimulatedCamera : public CameraBackend {
+
+public:
+    //reports the current stage position in wafer coordinates (millimeters)
+    typedef bool (*PositionSource)(float &x, float &y);
+
+    struct Settings {
+        int liveWidth;
+        int liveHeight;
+        int stillWidth;
+        int stillHeight;
+
+        float fieldWidth;   //width of the imaged area in millimeters; 0 to image the whole pattern
+        float offsetX;      //wafer placement error in millimeters
+        float offsetY;
+        float rotation;     //wafer rotation in degrees
+        float noise;        //standard deviation of additive noise in gray levels
+        int blurRadius;     //box blur radius in camera pixels; 0 disables
+        float background;   //gray level of unexposed wafer at the reference exposure
+        float contrast;     //gray level added by fully exposed pattern at the reference exposure
+        unsigned exposureTime; //reference exposure in microseconds, at 100% gain
+
+        unsigned latency;    //milliseconds between snap and still image event
+        unsigned openLatency; //milliseconds taken by open()
+        unsigned livePeriod; //milliseconds between live frames; 0 disables live frames
+        unsigned seed;
+    };
+
+    SimulatedCamera();
+    ~SimulatedCamera();
+
+    static Settings defaultSettings();
+
+    void setSettings(const Settings &settings);
+    Settings getSettings();
+
+    //1 byte per pixel, row-major order. Does deep copy of data. The pattern is
+    //placed at each die position, as it was exposed on the previous layer.
+    void setScene(const unsigned char *grayscale, unsigned width, unsigned height,
+                  const std::vector<Recipe::Point> &dies);
+    void setPositionSource(PositionSource source);
+
+    //Simulates a USB disconnect: raises AMCAM_EVENT_DISCONNECTED, fails open()
+    //for downtime milliseconds, then reports the device through the hot-plug callback.
+    void unplug(unsigned downtime);
+
+    bool open() override;
+    void close() override;
+    bool isOpen() override;
+    bool getSize(bool still, int &width, int &height) override;
+    bool start(EventCallback callback, void *ctx) override;
+    bool snap() override;
+    bool pullImage(void *buffer, bool still) override;
+    bool getExposureRange(unsigned &minTime, unsigned &maxTime,
+                          unsigned short &minGain, unsigned short &maxGain) override;
+    bool getExposure(unsigned &time, unsigned short &gain) override;
+    bool setExposure(unsigned time, unsigned short gain) override;
+    bool requestHistogram(HistogramCallback callback, void *ctx) override;
+    void setHotPlugCallback(HotPlugCallback callback, void *ctx) override;
+
+private:
+    static const unsigned minExposureTime = 100;
+    static const unsigned maxExposureTime = 2000000;
+    static const unsigned short minExposureGain = 100;
+    static const unsigned short maxExposureGain = 1600;
+
+    Settings settings;
+    unsigned exposureTime;
+    unsigned short exposureGain;
+    PositionSource positionSource;
+
+    //scene
+    unsigned sceneWidth;
+    unsigned sceneHeight;
+    std::vector<unsigned char> scene;
+    std::vector<Recipe::Point> dies;
+
+    //rendered frames, 24-bit RGB with TDIBWIDTHBYTES row pitch
+    std::vector<unsigned char> liveFrame;
+    std::vector<unsigned char> stillFrame;
+    unsigned liveCount;
+    unsigned stillCount;
+
+    //worker thread state, guarded by mutex
+    bool opened;
+    bool running;
+    bool snapPending;
+    bool disconnectPending;
+    std::chrono::steady_clock::time_point pluggedTime;
+    HotPlugCallback hotPlugCallback;
+    void *hotPlugCtx;
+    std::thread plugThread;
+    std::chrono::steady_clock::time_point snapDue;
+    float snapX;
+    float snapY;
+    EventCallback callback;
+    void *callbackCtx;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+
+    void run();
+    void render(std::vector<unsigned char> &dest, int w, int h, float stageX, float stageY, unsigned seed);
+
+};
+
+#endif // SIMULATEDCAMERA_HPP
@@ -1,5 +1,6 @@
 #include "config.hpp"
 
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <i2c/smbus.h>
 #include <sys/ioctl.h>
@@ -7,9 +8,22 @@
 #include <errno.h>
 #include <cstdio>
 #include <fcntl.h>
-#include <ctime>
+#include <cmath>
+#include <cstring>
+#include <poll.h>
+#include <linux/gpio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "stagecontroller.h"
+#include "framecodec.hpp"
+#include "i2cdevtransport.hpp"
+#include "virtualstage.hpp"
 
 
 #ifdef DEBUG_MODE_GLOBAL
@@ -21,24 +35,60 @@ namespace stage_controller {
 //configuration constants
 static const int BUF_SIZE = 8;
 static const int I2C_ADDRESS = 0x0F;
-static const int MAGIC = 0x5A;
-static const int CHECK_VALUE = 0xFF;
 
 //state information
-static int i2cFd = -1;
+static I2cDevTransport i2cDevTransport("/dev/i2c-1", I2C_ADDRESS); //should dynamically determine the adapter
+static VirtualStage virtualStage;
+#ifdef EMULATION_MODE_I2C
+static StageTransport *transport = &virtualStage;
+#else
+static StageTransport *transport = &i2cDevTransport;
+#endif
 static int writeIndex = 0; //index of next available frame slot
 static int readIndex = 0; //index of next frame to send
 static int bufferLength = 0;
 static int lastCommand = -1;
+static bool combinedSupported = false; //adapter can do repeated-start I2C_RDWR transfers
+static __u8 protocolVersion = PROTOCOL_VERSION_CLASSIC;
+static __u32 capabilities = 0;
 
-static unsigned emulatedX = 0;
-static unsigned emulatedY = 0;
-static unsigned emulatedTargetX = 0;
-static unsigned emulatedTargetY = 0;
-static time_t emulatedCompleteTime = 0;
 
 struct frame buffer[BUF_SIZE], response;
 
+//Frames queued with submitFrame carry a completion and are sent by the I/O
+//thread; frames from addFrame belong to whoever added them. The recursive mutex
+//guards the queue and the bus, so synchronous calls and the thread interleave
+//whole exchanges.
+static Completion completions[BUF_SIZE];
+static void *completionCtx[BUF_SIZE];
+static bool submitted[BUF_SIZE];
+static bool extended[BUF_SIZE]; //slot stands in for extendedRequests[slot]
+static struct extendedFrame extendedRequests[BUF_SIZE];
+static ExtendedCompletion extendedCompletions[BUF_SIZE];
+static std::recursive_mutex queueMutex;
+static std::condition_variable_any ioWake;
+static std::thread ioThread;
+static bool ioStopping = false;
+
+//retry metrics; updated under queueMutex, read from any thread
+static std::atomic<unsigned long long> exchangeCount(0);
+static std::atomic<unsigned long long> retryCount(0);
+static std::atomic<unsigned long long> resyncCount(0);
+static std::atomic<unsigned long long> failureCount(0);
+
+//motion watch; the mutex only guards the cancel flag and its wakeup
+static std::thread watchThread;
+static std::mutex watchMutex;
+static std::condition_variable watchWake;
+static bool watchCancel = false;
+static int gpioEventFd = -1;
+
+//downloaded sequence, kept for predicting its moves and reporting arrivals
+static std::vector<SequenceStep> sequenceSteps;
+static int sequenceCapacity = 0;
+static ArrivalCallback arrivalCallback = NULL;
+static void *arrivalCtx = NULL;
+
 //I2C setup
 bool isOpen();
 bool openI2c();
@@ -53,78 +103,128 @@ bool addFrame(CommandID command, __u32 data);
 bool addFrame(const struct frame *dest);
 bool sendFrame(const struct frame *frame);
 bool sendNextFrame();
+int exchangeFrames(int count, __u32 *data, __u8 *stageStatus);
+bool deleteNextFrame();
 int readResponse(__u32 *data, __u8 *stageStatus);
 int processFrame(const struct frame *frame, __u32 *data, __u8 *stageStatus, int expectedCommand);
 
-static __u8 calcChecksum(const struct frame *frame);
-static void emulate(const struct frame *frame);
+static int decodeStatus(__u8 status, __u8 *stageStatus);
+static int transferFrames(const struct frame *requests, struct frame *replies, int count, int &received);
+static int sendFrames(const struct frame *requests, struct frame *replies, int count, int &received);
+static int sendExtendedFrame(const struct extendedFrame *request, struct extendedFrame *reply);
+static bool recoverReply(const struct frame *request, struct frame *reply);
+static bool recoverExtendedReply(const struct extendedFrame *request, struct extendedFrame *reply);
+static bool checkReply(const struct frame *request, const struct frame *reply);
+static bool checkExtendedReply(const struct extendedFrame *request, const struct extendedFrame *reply);
+static void runIo();
+static void runWatch(unsigned expectedMillis, MotionCallback callback, void *ctx);
+static bool openMotionLine();
+static void closeMotionLine();
+static bool waitForMotion(unsigned millis);
+static long long pollInterval(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point fastFrom);
+static int exchangeCommand(CommandID command, __u32 data, __u32 *reply);
+static bool watchSequence(int first, unsigned fromX, unsigned fromY);
+static void runSequence(int first, unsigned fromX, unsigned fromY);
+static void completeFrames(const struct frame *requests, const struct frame *replies, int count, int received,
+                           int ioStatus, const Completion *done, void *const *ctx);
 
 bool isOpen() {
-    return i2cFd != -1;
+    return transport->isOpen();
 }
 
-bool openI2c() {
-    int adapter_nr = 1; //should dynamically determine this
-    char fname[20];
+bool setTransport(StageTransport *newTransport) {
+    if(isOpen() || newTransport == NULL)
+        return false;
 
+    transport = newTransport;
+    return true;
+}
+
+bool openI2c() {
     if(isOpen())
         return true;
 
-    snprintf(fname, 19, "/dev/i2c-%d", adapter_nr);
-    i2cFd = open(fname, O_RDWR);
+    if(!transport->open())
+        return false;
+
+    combinedSupported = I2C_COMBINED_TRANSACTIONS && transport->supportsCombined();
 
-    if(i2cFd == -1) {
 #ifdef DEBUG_MODE_I2C
-        printf("device file '%-19s' not found\n", fname);
-        fflush(stdout);
+    if(!combinedSupported) {
+        printf("I2C_RDWR unavailable; using separate write and read\n");
+    }
 #endif
+
+#ifdef DEBUG_MODE_I2C
+    printf("I2C communication established.\n");
+    fflush(stdout);
+#endif
+
+    negotiateProtocol();
+    startIoThread();
+    return true;
+}
+
+bool negotiateProtocol() {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    __u32 data = 0;
+
+    protocolVersion = PROTOCOL_VERSION_CLASSIC;
+    capabilities = 0;
+
+    if(!addFrame(CMD_GETVERSION, 0))
         return false;
-    }
 
-    if(ioctl(i2cFd, I2C_SLAVE, I2C_ADDRESS) == -1) {
+    //older firmware answers with an error or not at all
+    if(GOOD != exchangeFrames(1, &data, NULL) || (data & 0xFF) < PROTOCOL_VERSION_EXTENDED) {
 #ifdef DEBUG_MODE_I2C
-        printf("error configuring device address\n");
+        printf("Stage firmware uses the classic protocol\n");
         fflush(stdout);
 #endif
-        closeI2c();
         return false;
     }
 
+    protocolVersion = data & 0xFF;
+    capabilities = data >> 8;
+    sequenceCapacity = 0;
+
+    //also stops a sequence left running by an earlier session
+    if(hasCapability(CAPABILITY_SEQUENCES) && GOOD == exchangeCommand(CMD_SEQCLEAR, 0, &data)) {
+        sequenceCapacity = std::min(data, (__u32) 256); //step indices are one byte
+    }
+
 #ifdef DEBUG_MODE_I2C
-    printf("I2C communication established.\n");
+    printf("Stage firmware protocol version %d, capabilities %06X\n", protocolVersion, capabilities);
     fflush(stdout);
 #endif
     return true;
 }
 
+__u8 getProtocolVersion() {
+    return protocolVersion;
+}
+
+bool hasCapability(__u32 capability) {
+    return (capabilities & capability) == capability;
+}
+
 void closeI2c() {
+    cancelMotionWatch();
+    closeMotionLine();
+    stopIoThread();
+
     if(isOpen()) {
-        if(close(i2cFd) == -1) {
-#ifdef DEBUG_MODE_I2C
-            printf("Could not terminate I2C communication.\n");
-            fflush(stdout);
-#endif
-        }
-        else {
-            i2cFd = -1;
+        transport->close();
 #ifdef DEBUG_MODE_I2C
-    printf("I2C communication terminated.\n");
-    fflush(stdout);
+        printf("I2C communication terminated.\n");
+        fflush(stdout);
 #endif
-        }
     }
 }
 
 //calculates what checksum field should be based frame data
 __u8 calcChecksum(const struct frame *frame) {
-    __u8 sum = 0;
-    __u8 *bytes = (__u8 *) frame;
-
-    for(int i = 0; i < 7; i++) {
-        sum += bytes[i];
-    }
-
-    return CHECK_VALUE - sum;
+    return frame_codec::checksum(*frame);
 }
 
 int getBufferLength() {
@@ -132,26 +232,38 @@ int getBufferLength() {
 }
 
 void clearBuffer() {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+
+    //submitters are told their frames will never be sent
+    for(int i = 0; i < bufferLength; i++) {
+        int slot = (readIndex + i) % BUF_SIZE;
+
+        if(submitted[slot] && extended[slot]) {
+            submitted[slot] = false;
+            extendedCompletions[slot](ERROR_WRITE, 0, 0, STAGE_NOT_READY, completionCtx[slot]);
+        }
+        else if(submitted[slot]) {
+            submitted[slot] = false;
+            completions[slot](ERROR_WRITE, 0, STAGE_NOT_READY, completionCtx[slot]);
+        }
+    }
+
     readIndex = (readIndex + bufferLength) % BUF_SIZE; //buffer is circular
     bufferLength = 0;
 }
 
 void createFrame(struct frame *dest, CommandID command, __u32 data) {
-    dest->magic = MAGIC;
-    dest->command = (__u8) command;
-    dest->data[0] = data & 0xFF; //store as little endian value
-    dest->data[1] = data >> 8 & 0xFF; //store as little endian value
-    dest->data[2] = data >> 16 & 0xFF; //store as little endian value
-    dest->data[3] = data >> 24 & 0xFF; //store as little endian value
-    dest->status = 0;
-    dest->checksum = calcChecksum(dest);
+    *dest = frame_codec::encode(command, data);
 }
 
 //creates frame and adds it to the circular queue
 bool addFrame(CommandID command, __u32 data) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
     if(getBufferLength() < BUF_SIZE) {
         struct frame *thisFrame = &buffer[writeIndex];
         createFrame(thisFrame, command, data);
+        submitted[writeIndex] = false;
+        extended[writeIndex] = false;
 #ifdef DEBUG_MODE_I2C
         printf("Added command of ID #%d at index %d\n", thisFrame->command, writeIndex);
 #endif
@@ -165,6 +277,7 @@ bool addFrame(CommandID command, __u32 data) {
 
 //Adds an existing frame to the circular queue. Frame assumed to be valid
 bool addFrame(const struct frame *dest) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
     if(getBufferLength() < BUF_SIZE) {
 #ifdef DEBUG_MODE_I2C
         printf("Buffer length is now %d\n", getBufferLength());
@@ -176,6 +289,8 @@ bool addFrame(const struct frame *dest) {
             thisFrameBytes[i] = ((__u8 *) dest)[i];
         }
 
+        submitted[writeIndex] = false;
+        extended[writeIndex] = false;
         writeIndex = (writeIndex + 1) % BUF_SIZE; //buffer is circular
         bufferLength++;
         return true;
@@ -186,12 +301,8 @@ bool addFrame(const struct frame *dest) {
 
 //sends arbitrary frame without advancing buffer
 bool sendFrame(const struct frame *frame) {
-#ifdef EMULATION_MODE_I2C
-    __s32 result = 8;
-    emulate(frame);
-#else
-    __s32 result = write(i2cFd, (__u8 *) frame, 8);
-#endif
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    __s32 result = transport->write((const __u8 *) frame, 8);
 
     int errsv = errno;
     if(result == -1) {
@@ -212,6 +323,7 @@ bool sendFrame(const struct frame *frame) {
 
 //sends next frame data from queue and advances buffer
 bool sendNextFrame() {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
     if(getBufferLength() > 0) {
         if(!sendFrame(&buffer[readIndex]))
             return false;
@@ -226,8 +338,121 @@ bool sendNextFrame() {
     return false;
 }
 
+//Sends the next count queued frames and reads the response to each. On a real
+//bus this is one I2C_RDWR ioctl: every request is written and its response read
+//back after a repeated start, with a single stop at the end. data and
+//stageStatus receive one entry per frame and may be NULL. The frames leave the
+//queue whether or not the exchange succeeds. Returns OR of status codes.
+int exchangeFrames(int count, __u32 *data, __u8 *stageStatus) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    struct frame requests[BUF_SIZE];
+    struct frame replies[BUF_SIZE];
+    int received = 0;
+
+    if(count < 1 || count > getBufferLength())
+        return ERROR_WRITE;
+
+    for(int i = 0; i < count; i++) {
+        requests[i] = buffer[readIndex];
+        deleteNextFrame();
+    }
+
+    int status = transferFrames(requests, replies, count, received);
+
+    if(received > 0) {
+        lastCommand = requests[received - 1].command;
+        status |= frame_codec::decodeBatch(requests, replies, received, data, stageStatus);
+    }
+
+#ifdef DEBUG_MODE_I2C
+    if(status != GOOD) {
+        printf("Error in exchange of %d frame(s): code %08X\n", count, status);
+    }
+#endif
+
+    return status;
+}
+
+//Exchange of frames already taken off the queue; received counts the replies
+//that arrived. A failed transfer is repeated whole, and a reply that fails its
+//checks is read again and then re-requested on its own, up to
+//STAGE_MAX_RETRIES times each. Only idempotent commands are sent twice. Replies
+//still bad after that are left for processFrame to report. Called with
+//queueMutex held.
+static int transferFrames(const struct frame *requests, struct frame *replies, int count, int &received) {
+    bool repeatable = true;
+
+    for(int i = 0; i < count; i++) {
+        repeatable = repeatable && frame_codec::isIdempotent(requests[i].command);
+    }
+
+    exchangeCount += count;
+    int status = sendFrames(requests, replies, count, received);
+
+    for(int attempt = 0; status != GOOD && repeatable && attempt < STAGE_MAX_RETRIES; attempt++) {
+#ifdef DEBUG_MODE_I2C
+        printf("Repeating transfer of %d frame(s) after error %08X\n", count, status);
+#endif
+        retryCount++;
+        status = sendFrames(requests, replies, count, received);
+    }
+
+    if(status != GOOD) {
+        failureCount++;
+        return status;
+    }
+
+    for(int i = 0; i < received; i++) {
+        if(!checkReply(&requests[i], &replies[i]) && !recoverReply(&requests[i], &replies[i])) {
+            failureCount++;
+        }
+    }
+
+    return GOOD;
+}
+
+//one raw attempt at transferFrames
+static int sendFrames(const struct frame *requests, struct frame *replies, int count, int &received) {
+    received = 0;
+
+    if(combinedSupported) {
+        struct i2c_msg messages[2 * BUF_SIZE];
+        frame_codec::linkTransfer((struct frame *) requests, replies, count, messages);
+
+        bool result = transport->transfer(messages, 2 * count);
+        if(!result) {
+#ifdef DEBUG_MODE_I2C
+            int errsv = errno;
+            printf("I2C combined transfer failed:\t\n");
+            printErrorInfo(errsv);
+#endif
+            return ERROR_WRITE | ERROR_READ;
+        }
+
+#ifdef DEBUG_MODE_I2C
+        printf("I2C combined transfer of %d frame(s) done\n", count);
+#endif
+        received = count;
+        return GOOD;
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(!sendFrame(&requests[i]))
+            return ERROR_WRITE;
+
+        if(readResponse(NULL, NULL) & ERROR_READ)
+            return ERROR_READ;
+
+        replies[i] = response;
+        received++;
+    }
+
+    return GOOD;
+}
+
 //deletes next frame data from queue without sending and advances buffer
 bool deleteNextFrame() {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
     if(getBufferLength() > 0) {
 #ifdef DEBUG_MODE_I2C
         printf("Removed command of ID #%d from index %d\n", buffer[readIndex].command, readIndex);
@@ -242,62 +467,231 @@ bool deleteNextFrame() {
 
 //Returns status code. Set expectedCommand to -1 if check is unnecessary.
 int processFrame(const struct frame *frame, __u32 *data, __u8 *stageStatus, int expectedCommand) {
-    int status = GOOD;
-    __u8 stageStatusTmp;
-
-    //error checking
-    if(frame->magic != MAGIC)
-        status |= ERROR_MAGIC;
+    int status = frame_codec::check(*frame, expectedCommand);
+    decodeStatus(frame->status, stageStatus);
 
-    if(expectedCommand != -1 && frame->command != expectedCommand)
-        status |= ERROR_UNEXPECTED_COMMAND;
-
-    if(frame->command >= 8)
-        status |= ERROR_UNKNOWN_COMMAND;
-
-    if(frame->checksum != calcChecksum(frame))
-        status |= ERROR_CHECKSUM;
+#ifdef DEBUG_MODE_I2C
+    if(status != GOOD) {
+        printf("Error in received packet: code %08X\n", status);
+    }
+#endif
 
-    //set status field
-    switch(frame->status) {
-    case 0:
-        stageStatusTmp = STAGE_NOT_READY;
-        break;
-    case 1:
-        stageStatusTmp = STAGE_MOVING;
-        break;
-    case 2:
-        stageStatusTmp = STAGE_IN_POSITION;
-        break;
-    default:
-        stageStatusTmp = -1;
-        status |= ERROR_UNKNOWN_STATUS;
+    if(data != NULL) {
+        *data = frame_codec::dataOf(*frame);
     }
+    return status;
+}
+
+//stage status byte through the codec's table; unknown values give 0xFF
+static int decodeStatus(__u8 status, __u8 *stageStatus) {
+    bool known = frame_codec::isKnownStatus(status);
 
     if(stageStatus != NULL) {
-        *stageStatus = stageStatusTmp;
+        *stageStatus = known ? frame_codec::STAGE_STATUSES[status] : 0xFF;
     }
 
+    return known ? GOOD : ERROR_UNKNOWN_STATUS;
+}
+
+__u8 calcCrc(const __u8 *bytes, int length) {
+    return frame_codec::crc(bytes, length);
+}
+
+void createExtendedFrame(struct extendedFrame *dest, CommandID command, __u32 x, __u32 y) {
+    *dest = frame_codec::encodeExtended(command, x, y);
+}
+
+//Returns status code. Set expectedCommand to -1 if check is unnecessary.
+int processExtendedFrame(const struct extendedFrame *frame, __u32 *x, __u32 *y, __u8 *stageStatus, int expectedCommand) {
+    int status = frame_codec::check(*frame, expectedCommand);
+    decodeStatus(frame->status, stageStatus);
+
 #ifdef DEBUG_MODE_I2C
     if(status != GOOD) {
-        printf("Error in received packet: code %08X\n", status);
+        printf("Error in received extended packet: code %08X\n", status);
     }
 #endif
 
-    if(data != NULL) {
-        *data = frame->data[3] << 24 | frame->data[2] << 16 | frame->data[1] << 8 | frame->data[0];
+    if(x != NULL) {
+        *x = frame_codec::xOf(*frame);
     }
+
+    if(y != NULL) {
+        *y = frame_codec::yOf(*frame);
+    }
+
     return status;
 }
 
+//Writes an extended frame and reads the extended response, combined into one
+//transfer when the adapter allows. Extended frames bypass the queue.
+int exchangeExtendedFrame(const struct extendedFrame *request, __u32 *x, __u32 *y, __u8 *stageStatus) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    struct extendedFrame reply;
+
+    exchangeCount++;
+    int status = sendExtendedFrame(request, &reply);
+
+    for(int attempt = 0; status != GOOD && attempt < STAGE_MAX_RETRIES; attempt++) {
+        retryCount++;
+        status = sendExtendedFrame(request, &reply);
+    }
+
+    if(status != GOOD) {
+        failureCount++;
+        return status;
+    }
+
+    if(!checkExtendedReply(request, &reply) && !recoverExtendedReply(request, &reply)) {
+        failureCount++;
+    }
+
+    lastCommand = request->command;
+    return processExtendedFrame(&reply, x, y, stageStatus, request->command);
+}
+
+//one raw attempt at exchangeExtendedFrame
+static int sendExtendedFrame(const struct extendedFrame *request, struct extendedFrame *reply) {
+    const int length = sizeof(struct extendedFrame);
+
+    if(combinedSupported) {
+        struct i2c_msg messages[2];
+        messages[0].flags = 0;
+        messages[0].len = length;
+        messages[0].buf = (__u8 *) request;
+        messages[1].flags = I2C_M_RD;
+        messages[1].len = length;
+        messages[1].buf = (__u8 *) reply;
+
+        bool result = transport->transfer(messages, 2);
+        if(!result) {
+#ifdef DEBUG_MODE_I2C
+            int errsv = errno;
+            printf("I2C combined transfer failed:\t\n");
+            printErrorInfo(errsv);
+#endif
+            return ERROR_WRITE | ERROR_READ;
+        }
+    }
+    else {
+        __s32 result = transport->write((const __u8 *) request, length);
+        if(result != length) {
+#ifdef DEBUG_MODE_I2C
+            int errsv = errno;
+            printf("I2C write failed:\t\n");
+            printErrorInfo(errsv);
+#endif
+            return ERROR_WRITE;
+        }
+
+        result = transport->read((__u8 *) reply, length);
+        if(result != length) {
+#ifdef DEBUG_MODE_I2C
+            int errsv = errno;
+            printf("I2C read failed:\t\n");
+            printErrorInfo(errsv);
+#endif
+            return ERROR_READ;
+        }
+    }
+
+    return GOOD;
+}
+
+//A reply damaged on the wire is read again, since the stage still holds it,
+//with room for a slipped frame boundary; the request is sent again if that
+//does not turn up an intact copy.
+static bool recoverReply(const struct frame *request, struct frame *reply) {
+    const int length = sizeof(struct frame);
+
+    for(int attempt = 0; attempt < STAGE_MAX_RETRIES; attempt++) {
+        if(!frame_codec::isIntact(*reply)) {
+            __u8 window[2 * length];
+
+            if(transport->read(window, sizeof(window)) == (int) sizeof(window)) {
+                for(int offset = 0; offset <= length; offset++) {
+                    if(window[offset] == frame_codec::MAGIC && checkReply(request, (const struct frame *) &window[offset])) {
+                        memcpy(reply, &window[offset], length);
+                        resyncCount++;
+                        return true;
+                    }
+                }
+            }
+        }
+
+        if(!frame_codec::isIdempotent(request->command))
+            return false;
+
+#ifdef DEBUG_MODE_I2C
+        printf("Requesting command ID #%d again\n", request->command);
+#endif
+        retryCount++;
+        int received = 0;
+
+        if(sendFrames(request, reply, 1, received) == GOOD && checkReply(request, reply))
+            return true;
+    }
+
+    return false;
+}
+
+static bool recoverExtendedReply(const struct extendedFrame *request, struct extendedFrame *reply) {
+    const int length = sizeof(struct extendedFrame);
+
+    for(int attempt = 0; attempt < STAGE_MAX_RETRIES; attempt++) {
+        if(!frame_codec::isIntact(*reply)) {
+            __u8 window[2 * length];
+
+            if(transport->read(window, sizeof(window)) == (int) sizeof(window)) {
+                for(int offset = 0; offset <= length; offset++) {
+                    if(window[offset] == frame_codec::EXTENDED_MAGIC &&
+                       checkExtendedReply(request, (const struct extendedFrame *) &window[offset])) {
+                        memcpy(reply, &window[offset], length);
+                        resyncCount++;
+                        return true;
+                    }
+                }
+            }
+        }
+
+        retryCount++;
+
+        if(sendExtendedFrame(request, reply) == GOOD && checkExtendedReply(request, reply))
+            return true;
+    }
+
+    return false;
+}
+
+//intact answer to this request; a well-formed answer to another command is a stale or rejected one
+static bool checkReply(const struct frame *request, const struct frame *reply) {
+    return frame_codec::check(*reply, request->command) == GOOD;
+}
+
+static bool checkExtendedReply(const struct extendedFrame *request, const struct extendedFrame *reply) {
+    return frame_codec::check(*reply, request->command) == GOOD;
+}
+
+RetryStatistics getRetryStatistics() {
+    RetryStatistics s;
+    s.exchanges = exchangeCount;
+    s.retries = retryCount;
+    s.resyncs = resyncCount;
+    s.failures = failureCount;
+    return s;
+}
+
+void resetRetryStatistics() {
+    exchangeCount = 0;
+    retryCount = 0;
+    resyncCount = 0;
+    failureCount = 0;
+}
+
 //returns status code
 int readResponse(__u32 *data, __u8 *stageStatus) {
-#ifdef EMULATION_MODE_I2C
-    __s32 result = 0;
-    emulate(nullptr);
-#else
-    __s32 result = read(i2cFd, (__u8 *) &response, 8);
-#endif
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    __s32 result = transport->read((__u8 *) &response, 8);
     int errsv = errno;
     if(result == -1) {
 #ifdef DEBUG_MODE_I2C
@@ -318,21 +712,15 @@ int readResponse(__u32 *data, __u8 *stageStatus) {
 }
 
 bool halt() {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
     //set up halt command
     bool status = addFrame(CMD_HALT, 0);
     if(!status)  {
         return false;
     }
 
-    //send halt command
-    status = sendNextFrame();
-    if(!status) {
-        deleteNextFrame(); //delete halt
-        return false;
-    }
-
-    //read response to halt
-    if(GOOD != readResponse(NULL, NULL)) {
+    //send halt command and read its response
+    if(GOOD != exchangeFrames(1, NULL, NULL)) {
         return false;
     }
 
@@ -340,6 +728,24 @@ bool halt() {
 }
 
 bool getPosition(unsigned &x, unsigned &y, unsigned char &status) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    __u32 position[2];
+    __u8 stageStatus[2];
+
+    if(hasCapability(CAPABILITY_XY_FRAMES)) {
+        struct extendedFrame request;
+        createExtendedFrame(&request, CMD_GETXY, 0, 0);
+
+        if(GOOD != exchangeExtendedFrame(&request, &position[0], &position[1], &stageStatus[0])) {
+            return false;
+        }
+
+        x = position[0];
+        y = position[1];
+        status = stageStatus[0];
+        return true;
+    }
+
     //set up x and y positioning commands
     bool result = addFrame(CMD_GETX, 0);
     if(!result)  {
@@ -352,37 +758,32 @@ bool getPosition(unsigned &x, unsigned &y, unsigned char &status) {
         return false;
     }
 
-    //send setX command
-    result = sendNextFrame();
-    if(!result) {
-        deleteNextFrame(); //delete getX
-        deleteNextFrame(); //delete getY
-        return false;
-    }
-
-    //read response to getX
-    if(GOOD != readResponse(&x, &status)) {
-        deleteNextFrame(); //delete getY
-        return false;
-    }
-
-    //send setY command
-    result = sendNextFrame();
-    if(!result) {
-        deleteNextFrame(); //delete getY
-        return false;
-    }
-
-    //read response to setY
-    if(GOOD != readResponse(&y, &status)) {
+    //send both and read both responses in one transaction
+    if(GOOD != exchangeFrames(2, position, stageStatus)) {
         return false;
     }
 
+    x = position[0];
+    y = position[1];
+    status = stageStatus[1];
     return true;
 }
 
 //moves stage to specified location
 bool setPosition(unsigned x, unsigned y) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    if(hasCapability(CAPABILITY_XY_FRAMES)) {
+        struct extendedFrame request;
+        createExtendedFrame(&request, CMD_SETXY, x, y);
+
+        if(GOOD != exchangeExtendedFrame(&request, NULL, NULL, NULL)) {
+            halt();
+            return false;
+        }
+
+        return true;
+    }
+
     //set up x and y positioning commands
     bool status = addFrame(CMD_SETX, x);
     if(!status)  {
@@ -395,120 +796,636 @@ bool setPosition(unsigned x, unsigned y) {
         return false;
     }
 
-    //send setX command
-    status = sendNextFrame();
-    if(!status) {
-        deleteNextFrame(); //delete setX
-        deleteNextFrame(); //delete setY
+    //send both and read both responses in one transaction
+    if(GOOD != exchangeFrames(2, NULL, NULL)) {
+        halt();
         return false;
     }
 
-    //read response to setX
-    if(GOOD != readResponse(NULL, NULL)) {
-        deleteNextFrame(); //delete setY
-        halt();
+    return true;
+}
+
+bool startIoThread() {
+    if(ioThread.joinable())
+        return true;
+
+    ioStopping = false;
+    ioThread = std::thread(runIo);
+    return true;
+}
+
+void stopIoThread() {
+    if(ioThread.joinable()) {
+        {
+            std::lock_guard<std::recursive_mutex> lock(queueMutex);
+            ioStopping = true;
+        }
+
+        ioWake.notify_one();
+        ioThread.join();
+    }
+
+    clearBuffer();
+}
+
+bool submitFrame(CommandID command, __u32 data, Completion completion, void *ctx) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+
+    if(completion == NULL || !addFrame(command, data))
         return false;
+
+    int slot = (writeIndex + BUF_SIZE - 1) % BUF_SIZE;
+    submitted[slot] = true;
+    completions[slot] = completion;
+    completionCtx[slot] = ctx;
+    ioWake.notify_one();
+    return true;
+}
+
+bool submitExtendedFrame(CommandID command, __u32 x, __u32 y, ExtendedCompletion completion, void *ctx) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+
+    //the classic frame only holds the slot and its place in the queue
+    if(completion == NULL || !addFrame(command, 0))
+        return false;
+
+    int slot = (writeIndex + BUF_SIZE - 1) % BUF_SIZE;
+    submitted[slot] = true;
+    extended[slot] = true;
+    createExtendedFrame(&extendedRequests[slot], command, x, y);
+    extendedCompletions[slot] = completion;
+    completionCtx[slot] = ctx;
+    ioWake.notify_one();
+    return true;
+}
+
+//Takes every submitted classic frame at the head of the queue and sends them
+//as one batch, or the extended frame at the head on its own; completions run
+//without the lock, so they may submit more frames.
+static void runIo() {
+    std::unique_lock<std::recursive_mutex> lock(queueMutex);
+
+    while(!ioStopping) {
+        int count = 0;
+
+        if(bufferLength > 0 && submitted[readIndex] && extended[readIndex]) {
+            struct extendedFrame request = extendedRequests[readIndex];
+            ExtendedCompletion done = extendedCompletions[readIndex];
+            void *ctx = completionCtx[readIndex];
+            __u32 x = 0;
+            __u32 y = 0;
+            __u8 stageStatus = STAGE_NOT_READY;
+
+            submitted[readIndex] = false;
+            extended[readIndex] = false;
+            deleteNextFrame();
+
+            int status = exchangeExtendedFrame(&request, &x, &y, &stageStatus);
+
+            lock.unlock();
+            done(status, x, y, stageStatus, ctx);
+            lock.lock();
+            continue;
+        }
+
+        while(count < bufferLength && submitted[(readIndex + count) % BUF_SIZE] &&
+              !extended[(readIndex + count) % BUF_SIZE]) {
+            count++;
+        }
+
+        if(count == 0) {
+            ioWake.wait(lock);
+            continue;
+        }
+
+        struct frame requests[BUF_SIZE];
+        struct frame replies[BUF_SIZE];
+        Completion done[BUF_SIZE];
+        void *ctx[BUF_SIZE];
+        int received = 0;
+
+        for(int i = 0; i < count; i++) {
+            requests[i] = buffer[readIndex];
+            done[i] = completions[readIndex];
+            ctx[i] = completionCtx[readIndex];
+            submitted[readIndex] = false;
+            deleteNextFrame();
+        }
+
+        int ioStatus = transferFrames(requests, replies, count, received);
+
+        lock.unlock();
+        completeFrames(requests, replies, count, received, ioStatus, done, ctx);
+        lock.lock();
     }
+}
 
-    //send setY command
-    status = sendNextFrame();
-    if(!status) {
-        deleteNextFrame(); //delete setY
-        halt();
+//Each reply goes to the oldest outstanding request with the same command id;
+//requests left without a reply fail.
+static void completeFrames(const struct frame *requests, const struct frame *replies, int count, int received,
+                           int ioStatus, const Completion *done, void *const *ctx) {
+    bool completed[BUF_SIZE] = {false};
+
+    for(int j = 0; j < received; j++) {
+        int i = 0;
+
+        while(i < count && (completed[i] || requests[i].command != replies[j].command)) {
+            i++;
+        }
+
+        if(i == count) {
+#ifdef DEBUG_MODE_I2C
+            printf("Reply with command ID #%d matches no request\n", replies[j].command);
+#endif
+            continue;
+        }
+
+        __u32 data = 0;
+        __u8 stageStatus = STAGE_NOT_READY;
+        int status = processFrame(&replies[j], &data, &stageStatus, requests[i].command);
+
+        completed[i] = true;
+        done[i](status, data, stageStatus, ctx[i]);
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(!completed[i]) {
+            done[i](ioStatus != GOOD ? ioStatus : (int) ERROR_UNEXPECTED_COMMAND, 0, STAGE_NOT_READY, ctx[i]);
+        }
+    }
+}
+
+static double axisMoveTime(unsigned from, unsigned to) {
+    double distance = std::fabs(microstepsToMillimeters(to) - microstepsToMillimeters(from));
+    double rampDistance = STAGE_MAX_VELOCITY * STAGE_MAX_VELOCITY / STAGE_ACCELERATION;
+
+    //triangular profile when the top speed is never reached
+    if(distance < rampDistance)
+        return 2 * std::sqrt(distance / STAGE_ACCELERATION);
+
+    return STAGE_MAX_VELOCITY / STAGE_ACCELERATION + distance / STAGE_MAX_VELOCITY;
+}
+
+unsigned predictMoveTime(unsigned fromX, unsigned fromY, unsigned toX, unsigned toY) {
+    //the axes move at the same time
+    return (unsigned) (1000 * std::max(axisMoveTime(fromX, toX), axisMoveTime(fromY, toY)) + 0.5);
+}
+
+bool watchMotion(unsigned expectedMillis, MotionCallback callback, void *ctx) {
+    if(callback == NULL)
         return false;
+
+    cancelMotionWatch();
+
+    if(STAGE_GPIO_LINE >= 0 && gpioEventFd == -1) {
+        openMotionLine();
     }
 
-    //read response to setY
-    if(GOOD != readResponse(NULL, NULL)) {
-        halt();
+    watchCancel = false;
+    watchThread = std::thread(runWatch, expectedMillis, callback, ctx);
+    return true;
+}
+
+void cancelMotionWatch() {
+    if(watchThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(watchMutex);
+            watchCancel = true;
+        }
+
+        watchWake.notify_one();
+        watchThread.join();
+    }
+}
+
+static void runWatch(unsigned expectedMillis, MotionCallback callback, void *ctx) {
+    typedef std::chrono::steady_clock clock;
+    clock::time_point arrival = clock::now() + std::chrono::milliseconds(expectedMillis);
+    clock::time_point fastFrom = arrival - std::chrono::milliseconds(STAGE_POLL_FAST_WINDOW);
+    clock::time_point deadline = arrival + std::chrono::milliseconds(STAGE_MOTION_TIMEOUT);
+
+    while(true) {
+        PositionReply reply;
+
+        //the queue keeps the poll behind the move; without the I/O thread, poll directly
+        if(ioThread.joinable()) {
+            reply = getPositionAsync().get();
+        }
+        else {
+            reply.status = getPosition(reply.x, reply.y, reply.stageStatus) ? GOOD : ERROR_READ;
+        }
+
+        if(reply.status != (int) GOOD || reply.stageStatus == STAGE_IN_POSITION) {
+            callback(reply.status, reply.x, reply.y, ctx);
+            return;
+        }
+
+        clock::time_point now = clock::now();
+
+        if(now >= deadline) {
+#ifdef DEBUG_MODE_I2C
+            printf("Stage did not reach its target %ums after the expected arrival\n", STAGE_MOTION_TIMEOUT);
+#endif
+            callback(ERROR_TIMEOUT, reply.x, reply.y, ctx);
+            return;
+        }
+
+        if(!waitForMotion(pollInterval(now, fastFrom)))
+            return;
+    }
+}
+
+//slow polls stop short of the fast window
+static long long pollInterval(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point fastFrom) {
+    long long wait = STAGE_POLL_FAST_INTERVAL;
+
+    if(now < fastFrom) {
+        wait = std::chrono::duration_cast<std::chrono::milliseconds>(fastFrom - now).count();
+        wait = std::min(wait, (long long) STAGE_POLL_SLOW_INTERVAL);
+        wait = std::max(wait, (long long) STAGE_POLL_FAST_INTERVAL);
+    }
+
+    return wait;
+}
+
+//Sleeps up to millis, returning early on a motion-complete edge. False if the
+//watch was cancelled.
+static bool waitForMotion(unsigned millis) {
+    if(gpioEventFd != -1) {
+        struct pollfd fds = {gpioEventFd, POLLIN, 0};
+
+        if(poll(&fds, 1, millis) > 0 && (fds.revents & POLLIN)) {
+            struct gpioevent_data event;
+
+            if(read(gpioEventFd, &event, sizeof(event)) != sizeof(event)) {
+#ifdef DEBUG_MODE_I2C
+                printf("Could not read motion line event\n");
+#endif
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(watchMutex);
+        return !watchCancel;
+    }
+
+    std::unique_lock<std::mutex> lock(watchMutex);
+    watchWake.wait_for(lock, std::chrono::milliseconds(millis), [] { return watchCancel; });
+    return !watchCancel;
+}
+
+//Requests rising edges on the stage's motion-complete line through the GPIO
+//character device. Without it the watcher just polls.
+static bool openMotionLine() {
+    int chipFd = open(STAGE_GPIO_CHIP, O_RDONLY);
+
+    if(chipFd == -1) {
+#ifdef DEBUG_MODE_I2C
+        printf("GPIO chip '%s' not found; polling for motion complete\n", STAGE_GPIO_CHIP);
+        fflush(stdout);
+#endif
+        return false;
+    }
+
+    struct gpioevent_request request;
+    memset(&request, 0, sizeof(request));
+    request.lineoffset = STAGE_GPIO_LINE;
+    request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    request.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+    strncpy(request.consumer_label, "stepper-ui", sizeof(request.consumer_label) - 1);
+
+    int result = ioctl(chipFd, GPIO_GET_LINEEVENT_IOCTL, &request);
+    close(chipFd);
+
+    if(result == -1) {
+#ifdef DEBUG_MODE_I2C
+        printf("Could not request GPIO line %d; polling for motion complete\n", STAGE_GPIO_LINE);
+        fflush(stdout);
+#endif
         return false;
     }
 
+    gpioEventFd = request.fd;
     return true;
 }
 
-float microstepsToMillimeters(unsigned microsteps) {
-    return MOTOR_MILLIMETERS_PER_MICROSTEP * microsteps;
+static void closeMotionLine() {
+    if(gpioEventFd != -1) {
+        close(gpioEventFd);
+        gpioEventFd = -1;
+    }
 }
 
-unsigned millimetersToMicrosteps(float mm) {
-    return (unsigned) (mm / MOTOR_MILLIMETERS_PER_MICROSTEP + 0.5);
+//Exchanges one classic frame outside the queue, so frames submitted to the I/O
+//thread cannot be sent in its place.
+static int exchangeCommand(CommandID command, __u32 data, __u32 *reply) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    struct frame request;
+    struct frame response;
+    int received = 0;
+
+    createFrame(&request, command, data);
+    int status = transferFrames(&request, &response, 1, received);
+
+    if(received > 0) {
+        lastCommand = command;
+        status |= processFrame(&response, reply, NULL, command);
+    }
+
+    return status;
 }
 
-static void emulate(const struct frame *frame) {
-    //process new command, if applicable
-    if(frame != nullptr) {
-        if(frame->magic != 0x5A)
-            return;
+int getSequenceCapacity() {
+    return hasCapability(CAPABILITY_SEQUENCES) ? sequenceCapacity : 0;
+}
+
+//Every step is two exchanges, a classic frame with its index, flags and dwell
+//and an extended one with its target. Uploads happen before a run, away from
+//the moves whose round trips sequences remove.
+bool uploadSequence(const SequenceStep *steps, int count) {
+    //the watcher polls under the queue lock, so it is stopped before taking it
+    cancelMotionWatch();
+
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    sequenceSteps.clear();
+
+    if(steps == NULL || count < 1 || count > getSequenceCapacity())
+        return false;
+
+    if(GOOD != exchangeCommand(CMD_SEQCLEAR, 0, NULL))
+        return false;
+
+    for(int i = 0; i < count; i++) {
+        struct extendedFrame request;
+        __u32 dwell = std::min(steps[i].dwell, 0xFFFFu);
+
+        if(GOOD != exchangeCommand(CMD_SEQSTEP, i | steps[i].flags << 8 | dwell << 16, NULL))
+            return false;
+
+        createExtendedFrame(&request, CMD_SEQTARGET, steps[i].x, steps[i].y);
+
+        if(GOOD != exchangeExtendedFrame(&request, NULL, NULL, NULL))
+            return false;
+    }
+
+    sequenceSteps.assign(steps, steps + count);
+    return true;
+}
+
+bool startSequence(ArrivalCallback callback, void *ctx) {
+    unsigned x, y;
+    unsigned char status;
+
+    if(callback == NULL || sequenceSteps.empty())
+        return false;
+
+    cancelMotionWatch();
+
+    //the first move is predicted from where the stage is now
+    if(!getPosition(x, y, status) || GOOD != exchangeCommand(CMD_SEQSTART, sequenceSteps.size(), NULL))
+        return false;
+
+    arrivalCallback = callback;
+    arrivalCtx = ctx;
+    return watchSequence(0, x, y);
+}
+
+bool releaseStep(int step) {
+    if(step < 0 || step >= (int) sequenceSteps.size() || arrivalCallback == NULL)
+        return false;
+
+    cancelMotionWatch();
+
+    if(GOOD != exchangeCommand(CMD_SEQRELEASE, step, NULL))
+        return false;
+
+    if(step + 1 == (int) sequenceSteps.size())
+        return true;
+
+    return watchSequence(step + 1, sequenceSteps[step].x, sequenceSteps[step].y);
+}
+
+void cancelSequence() {
+    cancelMotionWatch();
+
+    if(isOpen() && hasCapability(CAPABILITY_SEQUENCES)) {
+        exchangeCommand(CMD_SEQCLEAR, 0, NULL);
+    }
+
+    sequenceSteps.clear();
+    arrivalCallback = NULL;
+}
+
+static bool watchSequence(int first, unsigned fromX, unsigned fromY) {
+    if(STAGE_GPIO_LINE >= 0 && gpioEventFd == -1) {
+        openMotionLine();
+    }
+
+    watchCancel = false;
+    watchThread = std::thread(runSequence, first, fromX, fromY);
+    return true;
+}
+
+//Reports arrivals from step first on, polling the way runWatch does. Each move
+//is expected to start once the previous step's dwell is over. Ends after the
+//last step or one with STEP_HOLD.
+static void runSequence(int first, unsigned fromX, unsigned fromY) {
+    typedef std::chrono::steady_clock clock;
+    clock::time_point leave = clock::now();
+    int next = first;
+
+    while(next < (int) sequenceSteps.size()) {
+        const SequenceStep &step = sequenceSteps[next];
+        clock::time_point arrival = leave + std::chrono::milliseconds(predictMoveTime(fromX, fromY, step.x, step.y));
+        clock::time_point fastFrom = arrival - std::chrono::milliseconds(STAGE_POLL_FAST_WINDOW);
+        clock::time_point deadline = arrival + std::chrono::milliseconds(STAGE_MOTION_TIMEOUT);
+        __u32 arrived = 0;
+        int status;
+
+        while(true) {
+            struct extendedFrame request;
+            createExtendedFrame(&request, CMD_SEQSTATUS, 0, 0);
+            status = exchangeExtendedFrame(&request, &arrived, NULL, NULL);
+
+            if(status != (int) GOOD || (int) arrived > next)
+                break;
+
+            clock::time_point now = clock::now();
+
+            if(now >= deadline) {
+#ifdef DEBUG_MODE_I2C
+                printf("Stage did not reach sequence step %d %ums after the expected arrival\n", next, STAGE_MOTION_TIMEOUT);
+#endif
+                status = ERROR_TIMEOUT;
+                break;
+            }
 
-        if(frame->checksum != calcChecksum(frame))
+            if(!waitForMotion(pollInterval(now, fastFrom)))
+                return;
+        }
+
+        if(status != (int) GOOD) {
+            arrivalCallback(status, next, step.x, step.y, arrivalCtx);
             return;
+        }
+
+        //steps passed between two polls are reported late, but in order
+        while(next < (int) arrived && next < (int) sequenceSteps.size()) {
+            const SequenceStep &reached = sequenceSteps[next];
+            arrivalCallback(GOOD, next, reached.x, reached.y, arrivalCtx);
 
-        switch(frame->command) {
-        case CMD_SETX:
-            time(&emulatedCompleteTime);
-            emulatedCompleteTime += 3; //assuming unit is in seconds
-            emulatedTargetX = frame->data[3] << 24 | frame->data[2] << 16 | frame->data[1] << 8 | frame->data[0];
-            break;
-        case CMD_SETY:
-            time(&emulatedCompleteTime);
-            emulatedCompleteTime += 3; //assuming unit is in seconds
-            emulatedTargetY = frame->data[3] << 24 | frame->data[2] << 16 | frame->data[1] << 8 | frame->data[0];
-            break;
-        case CMD_HALT:
-        case CMD_GETWIDTH:
-        case CMD_GETHEIGHT:
-        case CMD_GETX:
-        case CMD_GETY:
-        case CMD_CALIB:
-        default:
-            break;
+            if(reached.flags & STEP_HOLD)
+                return;
+
+            leave = clock::now() + std::chrono::milliseconds(reached.dwell);
+            fromX = reached.x;
+            fromY = reached.y;
+            next++;
         }
     }
+}
 
-    //update response packet
-    switch(lastCommand) {
-    case CMD_HALT:
-        createFrame(&response, CMD_HALT, 0);
-        time(&emulatedCompleteTime);
-        break;
-    case CMD_GETWIDTH:
-        createFrame(&response, CMD_GETWIDTH, MOTOR_SPAN_IN_MILLIMETERS/MOTOR_MILLIMETERS_PER_MICROSTEP);
-        break;
-    case CMD_GETHEIGHT:
-        createFrame(&response, CMD_GETHEIGHT, MOTOR_SPAN_IN_MILLIMETERS/MOTOR_MILLIMETERS_PER_MICROSTEP);
-        break;
-    case CMD_GETX:
-        createFrame(&response, CMD_GETX, emulatedX);
-        break;
-    case CMD_GETY:
-        createFrame(&response, CMD_GETY, emulatedY);
-        break;
-    case CMD_SETX:
-        createFrame(&response, CMD_SETX, 0);
-        break;
-    case CMD_SETY:
-        createFrame(&response, CMD_SETY, 0);
-        break;
-    case CMD_CALIB:
-        createFrame(&response, CMD_CALIB, 0);
-        break;
-    default:
-        createFrame(&response, (enum CommandID) 0xFF, 0xFFFFFFFF);
-        response.status = 0xFF;
+//Futures for the two-axis requests. Each axis completes separately, possibly
+//from different threads when the queue is cleared, so the tallies are atomic.
+struct PositionRequest {
+    std::promise<PositionReply> promise;
+    std::atomic<int> status;
+    std::atomic<int> pending;
+    unsigned x;
+    unsigned y;
+    std::atomic<unsigned char> stageStatus;
+};
+
+struct MoveRequest {
+    std::promise<int> promise;
+    std::atomic<int> status;
+    std::atomic<int> pending;
+};
+
+static void finishPosition(PositionRequest *request) {
+    if(request->pending.fetch_sub(1) == 1) {
+        PositionReply reply = {request->status.load(), request->x, request->y, request->stageStatus.load()};
+        request->promise.set_value(reply);
+        delete request;
     }
+}
+
+static void positionXDone(int status, __u32 data, __u8 stageStatus, void *ctx) {
+    PositionRequest *request = (PositionRequest *) ctx;
+    (void) stageStatus;
+    request->status.fetch_or(status);
+    request->x = data;
+    finishPosition(request);
+}
+
+static void positionYDone(int status, __u32 data, __u8 stageStatus, void *ctx) {
+    PositionRequest *request = (PositionRequest *) ctx;
+    request->status.fetch_or(status);
+    request->y = data;
+    request->stageStatus = stageStatus; //the later reply reflects both axes
+    finishPosition(request);
+}
+
+static void positionXYDone(int status, __u32 x, __u32 y, __u8 stageStatus, void *ctx) {
+    PositionRequest *request = (PositionRequest *) ctx;
+    request->status.fetch_or(status);
+    request->x = x;
+    request->y = y;
+    request->stageStatus = stageStatus;
+    finishPosition(request);
+}
+
+static void moveDone(int status, __u32 data, __u8 stageStatus, void *ctx) {
+    MoveRequest *request = (MoveRequest *) ctx;
+    (void) data;
+    (void) stageStatus;
+    request->status.fetch_or(status);
 
-    //check if "motors are done moving" and set status accordingly
-    if(time(NULL) >= emulatedCompleteTime) {
-        emulatedX = emulatedTargetX;
-        emulatedY = emulatedTargetY;
-        response.status = STAGE_IN_POSITION;
+    if(request->pending.fetch_sub(1) == 1) {
+        request->promise.set_value(request->status.load());
+        delete request;
     }
-    else {
-        response.status = STAGE_MOVING;
+}
+
+static void moveXYDone(int status, __u32 x, __u32 y, __u8 stageStatus, void *ctx) {
+    (void) x;
+    (void) y;
+    moveDone(status, 0, stageStatus, ctx);
+}
+
+std::future<PositionReply> getPositionAsync() {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    PositionRequest *request = new PositionRequest();
+    std::future<PositionReply> result = request->promise.get_future();
+
+    int frames = hasCapability(CAPABILITY_XY_FRAMES) ? 1 : 2;
+
+    request->status = GOOD;
+    request->pending = frames;
+    request->x = 0;
+    request->y = 0;
+    request->stageStatus = STAGE_NOT_READY;
+
+    if(!ioThread.joinable() || BUF_SIZE - getBufferLength() < frames) {
+        PositionReply reply = {(int) ERROR_WRITE, 0, 0, STAGE_NOT_READY};
+        request->promise.set_value(reply);
+        delete request;
+        return result;
+    }
+
+    if(frames == 1) {
+        submitExtendedFrame(CMD_GETXY, 0, 0, positionXYDone, request);
+        return result;
+    }
+
+    submitFrame(CMD_GETX, 0, positionXDone, request);
+    submitFrame(CMD_GETY, 0, positionYDone, request);
+    return result;
+}
+
+std::future<int> setPositionAsync(unsigned x, unsigned y) {
+    std::lock_guard<std::recursive_mutex> lock(queueMutex);
+    MoveRequest *request = new MoveRequest();
+    std::future<int> result = request->promise.get_future();
+
+    int frames = hasCapability(CAPABILITY_XY_FRAMES) ? 1 : 2;
+
+    request->status = GOOD;
+    request->pending = frames;
+
+    if(!ioThread.joinable() || BUF_SIZE - getBufferLength() < frames) {
+        request->promise.set_value(ERROR_WRITE);
+        delete request;
+        return result;
+    }
+
+    if(frames == 1) {
+        submitExtendedFrame(CMD_SETXY, x, y, moveXYDone, request);
+        return result;
     }
 
-    response.checksum = calcChecksum(&response);
+    submitFrame(CMD_SETX, x, moveDone, request);
+    submitFrame(CMD_SETY, y, moveDone, request);
+    return result;
+}
+
+float microstepsToMillimeters(unsigned microsteps) {
+    return MOTOR_MILLIMETERS_PER_MICROSTEP * microsteps;
+}
+
+unsigned millimetersToMicrosteps(float mm) {
+    return (unsigned) (mm / MOTOR_MILLIMETERS_PER_MICROSTEP + 0.5);
+}
+
+void getEmulatedPosition(unsigned &x, unsigned &y) {
+    virtualStage.getEmulator().getPosition(x, y);
+}
+
+StageEmulator &getEmulator() {
+    return virtualStage.getEmulator();
+}
+
+VirtualStage &getVirtualStage() {
+    return virtualStage;
 }
 
 static void printErrorInfo(int errsv) {
@@ -8,11 +8,16 @@
 #include <errno.h>
 #include <cstdio>
 #include <fcntl.h>
+#include <future>
 
 #ifdef DEBUG_MODE_GLOBAL
     #define DEBUG_MODE_I2C
 #endif
 
+class StageEmulator;
+class StageTransport;
+class VirtualStage;
+
 namespace stage_controller {
 
 //status codes
@@ -23,6 +28,8 @@ const __u32 ERROR_UNKNOWN_COMMAND = 1 << 29;
 const __u32 ERROR_UNEXPECTED_COMMAND = 1 << 28;
 const __u32 ERROR_CHECKSUM = 1 << 27;
 const __u32 ERROR_UNKNOWN_STATUS = 1 << 26;
+const __u32 ERROR_WRITE = 1 << 25;
+const __u32 ERROR_TIMEOUT = 1 << 24;
 
 enum StageStatus {
     STAGE_NOT_READY,
@@ -38,9 +45,29 @@ enum CommandID {
     CMD_GETY = 4,
     CMD_SETX = 5,
     CMD_SETY = 6,
-    CMD_CALIB = 7
+    CMD_CALIB = 7,
+    CMD_GETVERSION = 8, //data: protocol version in bits 0-7, capability flags above
+    CMD_GETXY = 9,      //extended frames only
+    CMD_SETXY = 10,     //extended frames only
+    CMD_SEQCLEAR = 11,  //stops and empties the sequence; data: number of steps the stage can hold
+    CMD_SEQSTEP = 12,   //data: step index in bits 0-7, flags in bits 8-15, dwell in bits 16-31
+    CMD_SEQTARGET = 13, //extended frames only; position of the step selected by CMD_SEQSTEP
+    CMD_SEQSTART = 14,  //data: number of steps to run from step 0
+    CMD_SEQRELEASE = 15, //data: index of the held step to leave
+    CMD_SEQSTATUS = 16, //extended frames only; x: steps arrived at, y: steps finished
+    CMD_COUNT
 };
 
+//protocol versions and capability flags reported by CMD_GETVERSION
+const __u8 PROTOCOL_VERSION_CLASSIC = 1;   //firmware that predates CMD_GETVERSION
+const __u8 PROTOCOL_VERSION_EXTENDED = 2;
+const __u32 CAPABILITY_XY_FRAMES = 1 << 0; //accepts CMD_GETXY and CMD_SETXY
+const __u32 CAPABILITY_SEQUENCES = 1 << 1; //runs downloaded sequences, CMD_SEQCLEAR to CMD_SEQSTATUS
+
+//sequence step flags
+const __u8 STEP_TRIGGER = 1 << 0; //pulse the trigger output once the stage settles at the step
+const __u8 STEP_HOLD = 1 << 1;    //stay at the step after its dwell until releaseStep
+
 struct frame {
     __u8 magic;
     __u8 command;
@@ -49,11 +76,68 @@ struct frame {
     __u8 checksum;
 };
 
+//12-byte frame carrying both axes, so a two-axis move or poll is one exchange.
+//Told apart from a classic frame by its magic byte; protected by CRC-8.
+struct extendedFrame {
+    __u8 magic;
+    __u8 command;
+    __u8 data[8]; //x then y, each little endian
+    __u8 status;
+    __u8 crc;
+};
+
+static_assert(sizeof(struct extendedFrame) == 12, "extended frame is sent as raw bytes");
+
+//called on the I/O thread, or by clearBuffer for frames that were never sent
+typedef void (*Completion)(int status, __u32 data, __u8 stageStatus, void *ctx);
+typedef void (*ExtendedCompletion)(int status, __u32 x, __u32 y, __u8 stageStatus, void *ctx);
+
+//called once on the watcher thread when the stage reports STAGE_IN_POSITION,
+//or with a failing status if polling fails or the move overruns
+typedef void (*MotionCallback)(int status, unsigned x, unsigned y, void *ctx);
+
+//counts since start or the last resetRetryStatistics
+struct RetryStatistics {
+    unsigned long long exchanges; //request frames sent, counting each once
+    unsigned long long retries;   //transfers and requests sent again
+    unsigned long long resyncs;   //damaged replies recovered by reading them again
+    unsigned long long failures;  //exchanges still failing after every retry
+};
+
+//one target of a sequence, in microsteps
+struct SequenceStep {
+    unsigned x;
+    unsigned y;
+    unsigned dwell; //milliseconds at the step once settled, at most 65535
+    __u8 flags;
+};
+
+//called on the watcher thread for each step the stage arrives at, in order, with
+//the step's target; or with a failing status if polling fails or a move overruns
+typedef void (*ArrivalCallback)(int status, int step, unsigned x, unsigned y, void *ctx);
+
+struct PositionReply {
+    int status;
+    unsigned x;
+    unsigned y;
+    unsigned char stageStatus;
+};
+
 //I2C setup
 extern bool isOpen();
 extern bool openI2c();
 extern void closeI2c();
 
+//Selects the link used by openI2c; the I2C bus must be closed. Defaults to
+//the I2C bus at /dev/i2c-1, or to the virtual stage with EMULATION_MODE_I2C.
+extern bool setTransport(StageTransport *transport);
+
+//Asks the firmware for its protocol version; called by openI2c. Anything but a
+//valid answer leaves the classic one-axis frames in use.
+extern bool negotiateProtocol();
+extern __u8 getProtocolVersion();
+extern bool hasCapability(__u32 capability);
+
 //data frame management
 extern int getBufferLength();
 extern void clearBuffer();
@@ -62,14 +146,78 @@ extern bool addFrame(CommandID command, __u32 data);
 extern bool addFrame(const struct frame *dest);
 extern bool sendFrame(const struct frame *frame);
 extern bool sendNextFrame();
+extern int exchangeFrames(int count, __u32 *data, __u8 *stageStatus);
 extern int readResponse(__u32 *data, __u8 *stageStatus);
 extern int processFrame(const struct frame *frame, __u32 *data, __u8 *stageStatus, int expectedCommand);
+extern void createExtendedFrame(struct extendedFrame *dest, CommandID command, __u32 x, __u32 y);
+extern int processExtendedFrame(const struct extendedFrame *frame, __u32 *x, __u32 *y, __u8 *stageStatus, int expectedCommand);
+extern int exchangeExtendedFrame(const struct extendedFrame *request, __u32 *x, __u32 *y, __u8 *stageStatus);
+
+//Exchanges retry transient bus errors and damaged replies up to
+//STAGE_MAX_RETRIES times before failing; these count how often that happened.
+extern RetryStatistics getRetryStatistics();
+extern void resetRetryStatistics();
+
+//checksum byte of a classic frame, and CRC-8 of the first length bytes of an extended one
+extern __u8 calcChecksum(const struct frame *frame);
+extern __u8 calcCrc(const __u8 *bytes, int length);
+
+//Background I/O, started by openI2c. The thread drains frames queued with
+//submitFrame from the ring, sends each run of them in one transfer and matches
+//the replies to requests by command id. Synchronous calls still work and are
+//serialized with it.
+extern bool startIoThread();
+extern void stopIoThread();
+extern bool submitFrame(CommandID command, __u32 data, Completion completion, void *ctx);
+
+//Queues an extended frame in order with the classic ones; it takes one ring
+//slot and is exchanged on its own when it reaches the head of the queue.
+extern bool submitExtendedFrame(CommandID command, __u32 x, __u32 y, ExtendedCompletion completion, void *ctx);
+
+//Non-blocking two-axis requests, sent as one GETXY or SETXY frame when the
+//firmware has CAPABILITY_XY_FRAMES and as a pair of classic frames otherwise.
+//A failed submit gives a ready future with ERROR_WRITE.
+extern std::future<PositionReply> getPositionAsync();
+extern std::future<int> setPositionAsync(unsigned x, unsigned y);
+
+//Duration of a move between two positions in microsteps, in milliseconds, for a
+//trapezoidal profile with STAGE_ACCELERATION and STAGE_MAX_VELOCITY per axis.
+extern unsigned predictMoveTime(unsigned fromX, unsigned fromY, unsigned toX, unsigned toY);
+
+//Watches a move queued with setPositionAsync and reports its end through
+//callback. Polls slowly until STAGE_POLL_FAST_WINDOW before the expected
+//arrival and quickly after it; with STAGE_GPIO_LINE set, an edge on that line
+//also wakes the watcher at once. Polls go through the queue, so they are sent
+//after the move. A new watch replaces the previous one.
+extern bool watchMotion(unsigned expectedMillis, MotionCallback callback, void *ctx);
+extern void cancelMotionWatch();
+
+//Sequences run on the stage controller: the stage moves through the uploaded
+//steps on its own and the host is only told of arrivals. The watcher polls the
+//stage like watchMotion does, so starting a sequence or a watch replaces the
+//other one's watcher. A step with STEP_HOLD ends the watch at its arrival, and
+//releaseStep starts it again for the following steps. Uploading stops a
+//running sequence, and so does a halt.
+extern int getSequenceCapacity(); //steps the stage holds; 0 without CAPABILITY_SEQUENCES
+extern bool uploadSequence(const SequenceStep *steps, int count);
+extern bool startSequence(ArrivalCallback callback, void *ctx);
+extern bool releaseStep(int step);
+extern void cancelSequence();
 
 //motor control convenience functions
 extern bool halt();
 extern bool getPosition(unsigned &x, unsigned &y, unsigned char &status);
 extern bool setPosition(unsigned x, unsigned y);
 
+//position of the emulated stage, in microsteps
+extern void getEmulatedPosition(unsigned &x, unsigned &y);
+
+//model behind the emulated stage, for tuning its axes before a run
+extern StageEmulator &getEmulator();
+
+//stand-in stage microcontroller; pass to setTransport to talk to it over the real frame path
+extern VirtualStage &getVirtualStage();
+
 //unit conversion convenience functions
 extern float microstepsToMillimeters(unsigned microsteps);
 extern unsigned millimetersToMicrosteps(float mm);
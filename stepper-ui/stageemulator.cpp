@@ -0,0 +1,330 @@
+#include "config.hpp"
+
+#include "stageemulator.hpp"
+
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+
+static unsigned long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double seconds(unsigned long long nanoseconds) {
+    return nanoseconds / 1e9;
+}
+
+static unsigned long long nanoseconds(double seconds) {
+    return (unsigned long long) (seconds * 1e9 + 0.5);
+}
+
+static unsigned toMicrosteps(double mm) {
+    double steps = mm / MOTOR_MILLIMETERS_PER_MICROSTEP + 0.5;
+    return steps > 0 ? (unsigned) steps : 0;
+}
+
+StageEmulator::StageEmulator() {
+    settings = defaultSettings();
+    noiseState = settings.seed != 0 ? settings.seed : 1;
+
+    for(int i = 0; i < 2; i++) {
+        axes[i].motion = Motion();
+        axes[i].queued = false;
+        axes[i].queuedTarget = 0;
+    }
+}
+
+StageEmulator::Settings StageEmulator::defaultSettings() {
+    Axis axis;
+    axis.maxVelocity = STAGE_MAX_VELOCITY;
+    axis.acceleration = STAGE_ACCELERATION;
+    axis.backlash = STAGE_EMULATED_BACKLASH;
+    axis.settleTime = STAGE_EMULATED_SETTLE_TIME;
+    axis.settleNoise = STAGE_EMULATED_SETTLE_NOISE;
+
+    Settings s;
+    s.x = axis;
+    s.y = axis;
+    s.seed = 1;
+    return s;
+}
+
+void StageEmulator::setSettings(const Settings &settings) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->settings = settings;
+    noiseState = settings.seed != 0 ? settings.seed : 1;
+}
+
+StageEmulator::Settings StageEmulator::getSettings() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return settings;
+}
+
+void StageEmulator::moveX(unsigned target) {
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long long time = now();
+    advance(0, time);
+    retarget(0, time, false, target * MOTOR_MILLIMETERS_PER_MICROSTEP);
+}
+
+void StageEmulator::moveY(unsigned target) {
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long long time = now();
+    advance(1, time);
+    retarget(1, time, false, target * MOTOR_MILLIMETERS_PER_MICROSTEP);
+}
+
+void StageEmulator::moveTo(unsigned x, unsigned y) {
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long long time = now();
+    advance(0, time);
+    advance(1, time);
+    retarget(0, time, false, x * MOTOR_MILLIMETERS_PER_MICROSTEP);
+    retarget(1, time, false, y * MOTOR_MILLIMETERS_PER_MICROSTEP);
+}
+
+void StageEmulator::halt() {
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long long time = now();
+
+    for(int i = 0; i < 2; i++) {
+        advance(i, time);
+        retarget(i, time, true, 0);
+    }
+}
+
+bool StageEmulator::getPosition(unsigned &x, unsigned &y) {
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long long time = now();
+    x = toMicrosteps(position(0, time));
+    y = toMicrosteps(position(1, time));
+    return isSettled(0, time) && isSettled(1, time);
+}
+
+bool StageEmulator::isInPosition() {
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long long time = now();
+    return isSettled(0, time) && isSettled(1, time);
+}
+
+double StageEmulator::moveTime(const Axis &axis, double distance, bool reverses) {
+    if(distance <= 0)
+        return 0;
+
+    Motion motion = Motion();
+    plan(motion, axis, 0, distance + (reverses ? axis.backlash : 0));
+    return 1000 * duration(motion) + axis.settleTime;
+}
+
+double StageEmulator::predictDiesPerHour(const std::vector<Recipe::Point> &dies, double dwellMillis) {
+    Settings s = getSettings();
+    const Axis *config[2] = {&s.x, &s.y};
+    int lastDirection[2] = {0, 0};
+    double total = 0;
+
+    for(size_t i = 0; i < dies.size(); i++) {
+        double time = 0;
+
+        if(i > 0) {
+            double delta[2] = {dies[i].x - dies[i-1].x, dies[i].y - dies[i-1].y};
+
+            //the axes move at the same time
+            for(int a = 0; a < 2; a++) {
+                int direction = delta[a] > 0 ? 1 : delta[a] < 0 ? -1 : 0;
+
+                if(direction == 0)
+                    continue;
+
+                time = std::max(time, moveTime(*config[a], std::fabs(delta[a]), lastDirection[a] == -direction));
+                lastDirection[a] = direction;
+            }
+        }
+
+        total += time + dwellMillis;
+    }
+
+    return total > 0 ? 3600000.0 * dies.size() / total : 0;
+}
+
+const StageEmulator::Axis &StageEmulator::axisSettings(int axis) {
+    return axis == 0 ? settings.x : settings.y;
+}
+
+//Replaces the target of an axis, or brakes it to a stop with halt set. A moving
+//axis that cannot stop short of a new target, or is heading away from it,
+//brakes first and starts a fresh profile from rest once it has stopped.
+void StageEmulator::retarget(int axis, unsigned long long time, bool halt, double target) {
+    AxisState &state = axes[axis];
+    const Motion &m = state.motion;
+    const Axis &config = axisSettings(axis);
+
+    double speed;
+    double s = travelAt(m, seconds(time - m.start), speed);
+    double carriage = m.origin + m.direction * std::max(0.0, s - m.slack);
+    double offset = m.offset + m.direction * std::min(s, m.slack);
+    double stopping = speed * speed / (2 * config.acceleration);
+
+    state.queued = false;
+
+    if(halt) {
+        if(speed > 0) {
+            begin(axis, time, carriage, offset, m.direction, speed, stopping, true);
+        }
+
+        return;
+    }
+
+    int direction = target > carriage ? 1 : target < carriage ? -1 : 0;
+
+    if(speed > 0) {
+        double slack = std::max(0.0, config.backlash / 2 - m.direction * offset);
+        double travel = std::fabs(target - carriage) + slack;
+
+        if(direction == m.direction && travel >= stopping) {
+            begin(axis, time, carriage, offset, m.direction, speed, travel, true);
+            return;
+        }
+
+        begin(axis, time, carriage, offset, m.direction, speed, stopping, false);
+        state.queued = true;
+        state.queuedTarget = target;
+        return;
+    }
+
+    if(direction == 0)
+        return;
+
+    double slack = std::max(0.0, config.backlash / 2 - direction * offset);
+    begin(axis, time, carriage, offset, direction, 0, std::fabs(target - carriage) + slack, true);
+}
+
+void StageEmulator::begin(int axis, unsigned long long time, double origin, double offset, int direction,
+                          double speed, double travel, bool settle) {
+    const Axis &config = axisSettings(axis);
+    Motion &m = axes[axis].motion;
+
+    m.start = time;
+    m.origin = origin;
+    m.offset = offset;
+    m.direction = direction;
+    m.slack = std::max(0.0, config.backlash / 2 - direction * offset);
+    plan(m, config, speed, travel);
+
+    //an axis passing through a stop on the way to a queued target does not ring
+    if(!settle) {
+        m.settleTime = 0;
+        m.settleNoise = 0;
+    }
+}
+
+//starts the queued profile at the moment the braking one ended
+void StageEmulator::advance(int axis, unsigned long long time) {
+    AxisState &state = axes[axis];
+    unsigned long long end = state.motion.start + nanoseconds(duration(state.motion));
+
+    if(state.queued && time >= end) {
+        retarget(axis, end, false, state.queuedTarget);
+    }
+}
+
+double StageEmulator::position(int axis, unsigned long long time) {
+    advance(axis, time);
+
+    const Motion &m = axes[axis].motion;
+    double speed;
+    double s = travelAt(m, seconds(time - m.start), speed);
+    double carriage = m.origin + m.direction * std::max(0.0, s - m.slack);
+    unsigned long long end = m.start + nanoseconds(duration(m));
+    unsigned long long settled = end + m.settleTime * 1000000ULL;
+
+    //ringing decays linearly over the settle time
+    if(time >= end && time < settled && m.settleNoise > 0) {
+        noiseState ^= noiseState << 13;
+        noiseState ^= noiseState >> 17;
+        noiseState ^= noiseState << 5;
+
+        double u = 2 * (noiseState / 4294967296.0) - 1;
+        double fade = 1 - (double) (time - end) / (settled - end);
+        carriage += m.settleNoise * fade * u;
+    }
+
+    return carriage;
+}
+
+bool StageEmulator::isSettled(int axis, unsigned long long time) {
+    advance(axis, time);
+
+    const Motion &m = axes[axis].motion;
+    return !axes[axis].queued && time >= m.start + nanoseconds(duration(m)) + m.settleTime * 1000000ULL;
+}
+
+//Profile covering travel millimeters of motor motion from an initial speed:
+//ramp up to the top speed, cruise, then brake to a stop. A profile that cannot
+//stop in time at the configured rate brakes harder, which only happens when
+//halting from a speed limited by the previous settings.
+void StageEmulator::plan(Motion &motion, const Axis &axis, double speed, double travel) {
+    double a = axis.acceleration;
+    double vmax = axis.maxVelocity;
+
+    speed = std::min(speed, vmax);
+    motion.speed = speed;
+    motion.travel = travel;
+    motion.accel = a;
+    motion.brake = a;
+    motion.settleTime = axis.settleTime;
+    motion.settleNoise = axis.settleNoise;
+
+    if(travel <= speed * speed / (2 * a)) {
+        motion.peak = speed;
+        motion.brake = travel > 0 ? speed * speed / (2 * travel) : a;
+        motion.rampUp = 0;
+        motion.cruise = 0;
+        motion.rampDown = speed / motion.brake;
+        return;
+    }
+
+    //triangular profile when the top speed is never reached
+    double peak = std::min(vmax, std::sqrt(a * travel + speed * speed / 2));
+    double up = (peak * peak - speed * speed) / (2 * a);
+    double down = peak * peak / (2 * a);
+
+    motion.peak = peak;
+    motion.rampUp = (peak - speed) / a;
+    motion.rampDown = peak / a;
+    motion.cruise = std::max(0.0, (travel - up - down) / peak);
+}
+
+//motor travel t seconds into a profile
+double StageEmulator::travelAt(const Motion &motion, double t, double &speed) {
+    const Motion &m = motion;
+
+    if(t < m.rampUp) {
+        speed = m.speed + m.accel * t;
+        return m.speed * t + m.accel * t * t / 2;
+    }
+
+    double s = m.speed * m.rampUp + m.accel * m.rampUp * m.rampUp / 2;
+    t -= m.rampUp;
+
+    if(t < m.cruise) {
+        speed = m.peak;
+        return s + m.peak * t;
+    }
+
+    s += m.peak * m.cruise;
+    t -= m.cruise;
+
+    if(t < m.rampDown) {
+        speed = m.peak - m.brake * t;
+        return std::min(s + m.peak * t - m.brake * t * t / 2, m.travel);
+    }
+
+    speed = 0;
+    return m.travel;
+}
+
+double StageEmulator::duration(const Motion &motion) {
+    return motion.rampUp + motion.cruise + motion.rampDown;
+}
@@ -0,0 +1,105 @@
+#ifndef STAGEEMULATOR_HPP
+#define STAGEEMULATOR_HPP
+
+#include "Recipe.hpp"
+
+#include <mutex>
+#include <vector>
+
+//Model of the two-axis stage answering the I2C emulator. Each axis follows a
+//trapezoidal velocity profile on CLOCK_MONOTONIC, loses motion to backlash when
+//it reverses and rings around its target before it reports being in position,
+//so polls during a move see intermediate positions and move times are close
+//enough to the hardware to estimate throughput offline.
+class StageEmulator {
+
+public:
+    struct Axis {
+        float maxVelocity;   //millimeters per second
+        float acceleration;  //millimeters per second squared, also used for braking
+        float backlash;      //millimeters of motor travel lost when the direction reverses
+        unsigned settleTime; //milliseconds the carriage rings after the profile ends
+        float settleNoise;   //peak position error while ringing in millimeters, decaying to 0
+    };
+
+    struct Settings {
+        Axis x;
+        Axis y;
+        unsigned seed;
+    };
+
+    StageEmulator();
+
+    static Settings defaultSettings();
+
+    //takes effect at the next move
+    void setSettings(const Settings &settings);
+    Settings getSettings();
+
+    //Targets are in microsteps and replace the current one. A moving axis keeps
+    //its speed if it can still stop in time, and otherwise brakes and comes back.
+    void moveX(unsigned target);
+    void moveY(unsigned target);
+    void moveTo(unsigned x, unsigned y);
+
+    //brakes both axes and drops their targets
+    void halt();
+
+    //position at this moment in microsteps; true once both axes have stopped and settled
+    bool getPosition(unsigned &x, unsigned &y);
+    bool isInPosition();
+
+    //Milliseconds an axis takes from rest to settled at a point distance
+    //millimeters away; a reversal adds the backlash to the travel.
+    static double moveTime(const Axis &axis, double distance, bool reverses);
+
+    //Dies per hour when the dies are visited in order with dwellMillis spent at
+    //each one, such as the exposure time. Does not touch the emulated position.
+    double predictDiesPerHour(const std::vector<Recipe::Point> &dies, double dwellMillis);
+
+private:
+    //one velocity profile of an axis; positions in millimeters, durations in seconds
+    struct Motion {
+        unsigned long long start; //CLOCK_MONOTONIC nanoseconds
+        double origin;      //carriage position at start
+        double offset;      //motor minus carriage position at start, within half the backlash
+        int direction;      //+1 or -1; 0 at rest
+        double slack;       //motor travel before the carriage follows
+        double travel;      //total motor travel
+        double speed;       //initial speed
+        double peak;
+        double accel;
+        double brake;
+        double rampUp;
+        double cruise;
+        double rampDown;
+        unsigned settleTime;
+        float settleNoise;
+    };
+
+    struct AxisState {
+        Motion motion;
+        bool queued;        //target to head for once the current profile ends
+        double queuedTarget;
+    };
+
+    Settings settings;
+    AxisState axes[2];
+    unsigned noiseState;
+    std::mutex mutex;
+
+    const Axis &axisSettings(int axis);
+    void retarget(int axis, unsigned long long time, bool halt, double target);
+    void begin(int axis, unsigned long long time, double origin, double offset, int direction,
+               double speed, double travel, bool settle);
+    void advance(int axis, unsigned long long time);
+    double position(int axis, unsigned long long time);
+    bool isSettled(int axis, unsigned long long time);
+
+    static void plan(Motion &motion, const Axis &axis, double speed, double travel);
+    static double travelAt(const Motion &motion, double t, double &speed);
+    static double duration(const Motion &motion);
+
+};
+
+#endif // STAGEEMULATOR_HPP
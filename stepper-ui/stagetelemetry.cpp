@@ -0,0 +1,303 @@
+#include "config.hpp"
+
+#include "stagetelemetry.hpp"
+#include "stagecontroller.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <ctime>
+#include <mutex>
+#include <thread>
+
+namespace stage_telemetry {
+
+static const float ARRIVAL_TOLERANCE = 0.005f; //millimeters; a closer axis has arrived, ringing included
+
+//Written by the sampling thread only. A record is rewritten in place when the
+//ring wraps; readers check that its sample number is unchanged before and after
+//copying it.
+struct Record {
+    std::atomic<unsigned long long> number; //sample number + 1; 0 while being written
+    std::atomic<unsigned long long> requested;
+    std::atomic<unsigned long long> time;
+    std::atomic<unsigned> x;
+    std::atomic<unsigned> y;
+    std::atomic<unsigned char> stageStatus;
+};
+
+static Record ring[RING_SIZE];
+static std::atomic<unsigned long long> written(0);
+
+static std::atomic<unsigned> targetX(0);
+static std::atomic<unsigned> targetY(0);
+static std::atomic<bool> hasTarget(false);
+
+static SettleCallback settleCallback = nullptr;
+static void *settleCtx = nullptr;
+
+static std::thread sampler;
+static bool stopping = false;
+static std::mutex mutex;
+static std::condition_variable wake;
+
+static void run(unsigned intervalMillis);
+static void append(const Sample &sample);
+static bool get(unsigned long long number, Sample &sample);
+static float axisArrival(float distance, float velocity);
+
+bool start(unsigned intervalMillis) {
+    if(sampler.joinable())
+        return true;
+
+    if(intervalMillis == 0)
+        return false;
+
+    for(int i = 0; i < RING_SIZE; i++) {
+        ring[i].number.store(0);
+    }
+
+    written = 0;
+    stopping = false;
+    sampler = std::thread(run, intervalMillis);
+    return true;
+}
+
+void stop() {
+    if(sampler.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        wake.notify_one();
+        sampler.join();
+    }
+}
+
+bool isRunning() {
+    return sampler.joinable();
+}
+
+unsigned long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool latest(Sample &sample) {
+    unsigned long long total = written.load();
+    return total > 0 && get(total - 1, sample);
+}
+
+int read(unsigned long long since, Sample *samples, int count) {
+    unsigned long long total = written.load();
+    unsigned long long first = total;
+    int copied = 0;
+
+    //back from the newest sample to since, count samples or the oldest one kept
+    while(first > 0 && total - first < (unsigned long long) count && total - first < (unsigned long long) RING_SIZE) {
+        Sample sample;
+
+        if(!get(first - 1, sample) || sample.time <= since)
+            break;
+
+        first--;
+    }
+
+    for(unsigned long long number = first; number < total; number++) {
+        if(get(number, samples[copied])) {
+            copied++;
+        }
+    }
+
+    return copied;
+}
+
+void setTarget(unsigned x, unsigned y) {
+    targetX = x;
+    targetY = y;
+    hasTarget = true;
+}
+
+//Velocities are least-squares slopes over the window, which averages out the
+//stage's position noise better than the last two samples would.
+bool estimate(Estimate &estimate) {
+    unsigned long long total = written.load();
+    Sample last;
+
+    if(total == 0 || !get(total - 1, last))
+        return false;
+
+    unsigned long long window = STAGE_TELEMETRY_WINDOW * 1000000ULL;
+    unsigned long long windowStart = last.time > window ? last.time - window : 0;
+    bool settledRun = last.stageStatus == stage_controller::STAGE_IN_POSITION;
+    double n = 0, st = 0, stt = 0, sx = 0, sy = 0, stx = 0, sty = 0;
+
+    estimate.time = last.time;
+    estimate.x = stage_controller::microstepsToMillimeters(last.x);
+    estimate.y = stage_controller::microstepsToMillimeters(last.y);
+    estimate.settledSince = settledRun ? last.time : 0;
+
+    for(unsigned long long number = total; number > 0 && total - number < (unsigned long long) RING_SIZE; number--) {
+        Sample sample;
+
+        if(!get(number - 1, sample))
+            break;
+
+        bool inWindow = sample.time >= windowStart;
+
+        if(!inWindow && !settledRun)
+            break;
+
+        if(inWindow) {
+            double t = ((long long) (sample.time - last.time)) / 1e9;
+            double x = stage_controller::microstepsToMillimeters(sample.x);
+            double y = stage_controller::microstepsToMillimeters(sample.y);
+            n++;
+            st += t;
+            stt += t * t;
+            sx += x;
+            sy += y;
+            stx += t * x;
+            sty += t * y;
+        }
+
+        if(settledRun) {
+            if(sample.stageStatus == stage_controller::STAGE_IN_POSITION) {
+                estimate.settledSince = sample.time;
+            }
+            else {
+                settledRun = false;
+            }
+        }
+    }
+
+    double denominator = n * stt - st * st;
+
+    if(n >= 2 && denominator > 0) {
+        estimate.velocityX = (n * stx - st * sx) / denominator;
+        estimate.velocityY = (n * sty - st * sy) / denominator;
+    }
+    else {
+        estimate.velocityX = 0;
+        estimate.velocityY = 0;
+    }
+
+    estimate.timeToArrival = -1;
+
+    if(hasTarget) {
+        float tx = axisArrival(stage_controller::microstepsToMillimeters(targetX) - estimate.x, estimate.velocityX);
+        float ty = axisArrival(stage_controller::microstepsToMillimeters(targetY) - estimate.y, estimate.velocityY);
+
+        if(tx >= 0 && ty >= 0) {
+            estimate.timeToArrival = std::max(tx, ty);
+        }
+    }
+
+    return true;
+}
+
+void setSettleCallback(SettleCallback callback, void *ctx) {
+    settleCallback = callback;
+    settleCtx = ctx;
+}
+
+//Seconds for an axis distance millimeters short of its target, moving at
+//velocity, to stop there when it brakes at STAGE_ACCELERATION; -1 if it is not
+//heading there.
+static float axisArrival(float distance, float velocity) {
+    float remaining = std::fabs(distance);
+    float approach = distance > 0 ? velocity : -velocity;
+
+    if(remaining < ARRIVAL_TOLERANCE)
+        return 0;
+
+    if(approach <= 0)
+        return -1;
+
+    float braking = approach * approach / (2 * STAGE_ACCELERATION);
+
+    //already braking: constant deceleration covers the rest at half the speed
+    if(braking >= remaining)
+        return 2 * remaining / approach;
+
+    return (remaining - braking) / approach + approach / STAGE_ACCELERATION;
+}
+
+static void run(unsigned intervalMillis) {
+    typedef std::chrono::steady_clock clock;
+    clock::time_point next = clock::now();
+    bool wasSettled = true; //a stage at rest when sampling starts has not just settled
+
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            if(wake.wait_until(lock, next, [] { return stopping; }))
+                return;
+        }
+
+        //a late sample pushes the schedule back instead of bunching up polls
+        next += std::chrono::milliseconds(intervalMillis);
+
+        if(next < clock::now()) {
+            next = clock::now() + std::chrono::milliseconds(intervalMillis);
+        }
+
+        Sample sample;
+        sample.requested = now();
+
+        //fails at once while the stage is closed or the queue is full
+        stage_controller::PositionReply reply = stage_controller::getPositionAsync().get();
+
+        if(reply.status != (int) stage_controller::GOOD)
+            continue;
+
+        sample.time = sample.requested + (now() - sample.requested) / 2;
+        sample.x = reply.x;
+        sample.y = reply.y;
+        sample.stageStatus = reply.stageStatus;
+        append(sample);
+
+        bool settled = reply.stageStatus == stage_controller::STAGE_IN_POSITION;
+
+        if(settled && !wasSettled && settleCallback != nullptr) {
+            settleCallback(sample, settleCtx);
+        }
+
+        wasSettled = settled;
+    }
+}
+
+static void append(const Sample &sample) {
+    unsigned long long number = written.load();
+    Record &r = ring[number % RING_SIZE];
+
+    r.number.store(0);
+    r.requested.store(sample.requested);
+    r.time.store(sample.time);
+    r.x.store(sample.x);
+    r.y.store(sample.y);
+    r.stageStatus.store(sample.stageStatus);
+    r.number.store(number + 1);
+    written.store(number + 1);
+}
+
+static bool get(unsigned long long number, Sample &sample) {
+    Record &r = ring[number % RING_SIZE];
+
+    if(r.number.load() != number + 1)
+        return false;
+
+    sample.requested = r.requested.load();
+    sample.time = r.time.load();
+    sample.x = r.x.load();
+    sample.y = r.y.load();
+    sample.stageStatus = r.stageStatus.load();
+    return r.number.load() == number + 1;
+}
+
+}
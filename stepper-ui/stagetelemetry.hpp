@@ -0,0 +1,57 @@
+#ifndef STAGETELEMETRY_HPP
+#define STAGETELEMETRY_HPP
+
+//Stage position sampled at a fixed rate on its own thread. Samples are stamped
+//with CLOCK_MONOTONIC and kept in a lock-free ring that any thread can read, so
+//the UI can plot motion and the controller can see the stage settle without
+//polling it themselves. Polls go through the stage_controller queue, behind
+//any move queued before them.
+namespace stage_telemetry {
+
+const int RING_SIZE = 1024;
+
+struct Sample {
+    unsigned long long requested; //CLOCK_MONOTONIC nanoseconds when the poll was queued
+    unsigned long long time;      //nanoseconds midway between queueing the poll and its reply
+    unsigned x;                   //microsteps
+    unsigned y;
+    unsigned char stageStatus;
+};
+
+//Motion from the samples of the last STAGE_TELEMETRY_WINDOW milliseconds.
+//Positions are in millimeters and velocities in millimeters per second.
+struct Estimate {
+    unsigned long long time;         //of the latest sample
+    float x;
+    float y;
+    float velocityX;
+    float velocityY;
+    float timeToArrival;             //seconds until both axes reach the target; -1 if unknown
+    unsigned long long settledSince; //first sample of the current STAGE_IN_POSITION run; 0 while moving
+};
+
+//called on the sampling thread with the first STAGE_IN_POSITION sample after motion
+typedef void (*SettleCallback)(const Sample &sample, void *ctx);
+
+extern bool start(unsigned intervalMillis);
+extern void stop();
+extern bool isRunning();
+
+extern unsigned long long now(); //CLOCK_MONOTONIC nanoseconds
+
+//false until the first sample
+extern bool latest(Sample &sample);
+
+//Copies the samples taken after since, oldest first, keeping the newest count
+//of them. Returns how many were copied.
+extern int read(unsigned long long since, Sample *samples, int count);
+
+//target of the move in flight, in microsteps, for the time to arrival
+extern void setTarget(unsigned x, unsigned y);
+extern bool estimate(Estimate &estimate);
+
+extern void setSettleCallback(SettleCallback callback, void *ctx);
+
+}
+
+#endif // STAGETELEMETRY_HPP
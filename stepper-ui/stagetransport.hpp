@@ -0,0 +1,33 @@
+#ifndef STAGETRANSPORT_HPP
+#define STAGETRANSPORT_HPP
+
+#include <linux/i2c.h>
+#include <linux/types.h>
+
+//Link to the stage microcontroller behind stage_controller, modeled on the
+//i2c-dev interface so the real bus is a thin wrapper around /dev/i2c-N.
+class StageTransport {
+
+public:
+    virtual ~StageTransport() {}
+
+    //opens the link and addresses the stage
+    virtual bool open() = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() = 0;
+
+    //I2C_FUNCS reports I2C_FUNC_I2C, so transfer() can use repeated starts
+    virtual bool supportsCombined() = 0;
+
+    //write() and read() on the device file: bytes moved, or -1 with errno set;
+    //EREMOTEIO when the stage does not acknowledge
+    virtual int write(const __u8 *bytes, int length) = 0;
+    virtual int read(__u8 *bytes, int length) = 0;
+
+    //I2C_RDWR: the messages in order with a repeated start between them and one
+    //stop at the end. The address field is filled in by the transport. False with
+    //errno set if any message fails; the rest are then not sent.
+    virtual bool transfer(struct i2c_msg *messages, int count) = 0;
+};
+
+#endif // STAGETRANSPORT_HPP
@@ -7,12 +7,26 @@ QT += widgets
 
 SOURCES += \
         ProcessControl.cpp \
+        amcambackend.cpp \
+        autoexposure.cpp \
         cameramodule.cpp \
+        doselog.cpp \
+        emulatedframebuffer.cpp \
+        fbdevdevice.cpp \
+        framebuffer.cpp \
+        framecodec.cpp \
+        framepool.cpp \
+        frametiming.cpp \
+        i2cdevtransport.cpp \
         imageprocessor.cpp \
         main.cpp \
         projectormodule.cpp \
+        simulatedcamera.cpp \
         stagecontroller.cpp \
-        tinyxml2.cpp
+        stageemulator.cpp \
+        stagetelemetry.cpp \
+        tinyxml2.cpp \
+        virtualstage.cpp
 
 RESOURCES += qml.qrc
 
@@ -34,14 +48,31 @@ HEADERS += \
     ProcessControl.hpp \
     Recipe.hpp \
     amcam.h \
+    amcambackend.hpp \
+    autoexposure.hpp \
+    camerabackend.hpp \
     cameramodule.hpp \
     config.hpp \
+    doselog.hpp \
+    emulatedframebuffer.hpp \
+    fbdevdevice.hpp \
+    framebuffer.hpp \
+    framebufferdevice.hpp \
+    framecodec.hpp \
+    framepool.hpp \
+    frametiming.hpp \
+    i2cdevtransport.hpp \
     imageinput.hpp \
     imageprocessor.hpp \
     stagecontroller.h \
+    stageemulator.hpp \
+    stagetelemetry.hpp \
+    stagetransport.hpp \
     projectormodule.hpp \
+    simulatedcamera.hpp \
     testbutton.hpp \
-    tinyxml2.h
+    tinyxml2.h \
+    virtualstage.hpp
 
 DISTFILES +=
 
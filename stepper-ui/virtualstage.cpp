@@ -0,0 +1,489 @@
+#include "config.hpp"
+
+#include "virtualstage.hpp"
+#include "framecodec.hpp"
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+using namespace stage_controller;
+
+//message ops on the socket; the firmware answers each message with OP_ACK or OP_NAK
+static const __u8 OP_WRITE = 'W';
+static const __u8 OP_READ = 'R';
+static const __u8 OP_ACK = 1;
+static const __u8 OP_NAK = 0;
+
+VirtualStage::VirtualStage() : messages(0), naks(0), bitErrors(0), badFrames(0), triggers(0) {
+    settings = defaultSettings();
+    active = settings;
+    fd = -1;
+    peerFd = -1;
+    replyLength = 0;
+    randomState = 1;
+    selectedStep = -1;
+    sequenceLength = 0;
+}
+
+VirtualStage::~VirtualStage() {
+    close();
+}
+
+VirtualStage::Settings VirtualStage::defaultSettings() {
+    Settings s;
+    s.latency = 200;
+    s.bitErrorRate = 0;
+    s.nakRate = 0;
+    s.combined = true;
+    s.extended = true;
+    s.sequences = true;
+    s.seed = 1;
+    return s;
+}
+
+void VirtualStage::setSettings(const Settings &settings) {
+    this->settings = settings;
+}
+
+VirtualStage::Settings VirtualStage::getSettings() {
+    return settings;
+}
+
+VirtualStage::Statistics VirtualStage::getStatistics() {
+    Statistics s;
+    s.messages = messages;
+    s.naks = naks;
+    s.bitErrors = bitErrors;
+    s.badFrames = badFrames;
+    s.triggers = triggers;
+    return s;
+}
+
+StageEmulator &VirtualStage::getEmulator() {
+    return emulator;
+}
+
+bool VirtualStage::open() {
+    if(isOpen())
+        return true;
+
+    //SOCK_SEQPACKET keeps message boundaries, like the start and stop of a bus message
+    int fds[2];
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1)
+        return false;
+
+    fd = fds[0];
+    peerFd = fds[1];
+    active = settings;
+    //spread small seeds, whose first xorshift outputs are tiny
+    randomState = (active.seed != 0 ? active.seed : 1) * 2654435761u;
+    replyLength = 0;
+    messages = 0;
+    naks = 0;
+    bitErrors = 0;
+    badFrames = 0;
+    triggers = 0;
+    selectedStep = -1;
+    sequenceLength = 0;
+
+    firmware = std::thread(&VirtualStage::run, this);
+    return true;
+}
+
+void VirtualStage::close() {
+    if(!isOpen())
+        return;
+
+    //the firmware thread sees the end of the stream and returns
+    shutdown(fd, SHUT_RDWR);
+    firmware.join();
+
+    ::close(fd);
+    ::close(peerFd);
+    fd = -1;
+    peerFd = -1;
+}
+
+bool VirtualStage::isOpen() {
+    return fd != -1;
+}
+
+bool VirtualStage::supportsCombined() {
+    return isOpen() && active.combined;
+}
+
+int VirtualStage::write(const __u8 *bytes, int length) {
+    if(length < 0 || length > MAX_MESSAGE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    Message message;
+    message.op = OP_WRITE;
+    message.length = length;
+    memcpy(message.data, bytes, length);
+
+    if(exchange(message) == -1)
+        return -1;
+
+    return length;
+}
+
+int VirtualStage::read(__u8 *bytes, int length) {
+    if(length < 0 || length > MAX_MESSAGE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    Message message;
+    message.op = OP_READ;
+    message.length = length;
+
+    if(exchange(message) == -1)
+        return -1;
+
+    memcpy(bytes, message.data, length);
+    return length;
+}
+
+bool VirtualStage::transfer(struct i2c_msg *messages, int count) {
+    for(int i = 0; i < count; i++) {
+        int length = messages[i].len;
+        int result = messages[i].flags & I2C_M_RD ? read(messages[i].buf, length) : write(messages[i].buf, length);
+
+        if(result != length)
+            return false;
+    }
+
+    return true;
+}
+
+//sends one message and waits for the firmware to acknowledge it
+int VirtualStage::exchange(Message &message) {
+    if(!isOpen()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    int length = 2 + (message.op == OP_WRITE ? message.length : 0);
+
+    if(send(fd, &message, length, 0) != length)
+        return -1;
+
+    ssize_t received = recv(fd, &message, sizeof(message), 0);
+
+    if(received <= 0) {
+        if(received == 0)
+            errno = EIO;
+
+        return -1;
+    }
+
+    if(message.op != OP_ACK) {
+        errno = EREMOTEIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+//firmware side: acknowledges each message, latches requests and shifts out replies
+void VirtualStage::run() {
+    Message message;
+
+    while(true) {
+        //a running sequence moves on between messages, as in the firmware's main loop
+        if(sequenceLength > 0) {
+            struct pollfd fds = {peerFd, POLLIN, 0};
+
+            if(poll(&fds, 1, 1) <= 0) {
+                stepSequence();
+                continue;
+            }
+        }
+
+        ssize_t received = recv(peerFd, &message, sizeof(message), 0);
+
+        if(received == -1 && errno == EINTR)
+            continue;
+
+        if(received <= 0)
+            break;
+
+        messages++;
+
+        if(active.latency > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(active.latency));
+        }
+
+        if(active.nakRate > 0 && random() < active.nakRate) {
+            naks++;
+            message.op = OP_NAK;
+            message.length = 0;
+            send(peerFd, &message, 2, 0);
+            continue;
+        }
+
+        if(message.op == OP_WRITE) {
+            corrupt(message.data, message.length);
+            receive(message.data, message.length);
+            message.op = OP_ACK;
+            message.length = 0;
+            send(peerFd, &message, 2, 0);
+        }
+        else {
+            int length = message.length < MAX_MESSAGE ? message.length : MAX_MESSAGE;
+
+            //the bus reads back as all ones past the end of the reply
+            memset(message.data, 0xFF, length);
+            memcpy(message.data, reply, std::min(length, replyLength));
+            corrupt(message.data, length);
+            message.op = OP_ACK;
+            send(peerFd, &message, 2 + length, 0);
+        }
+    }
+}
+
+void VirtualStage::receive(const __u8 *bytes, int length) {
+    if(length == sizeof(struct frame)) {
+        receiveFrame((const struct frame *) bytes);
+    }
+    else if(length == sizeof(struct extendedFrame) && active.extended) {
+        receiveExtendedFrame((const struct extendedFrame *) bytes);
+    }
+    else {
+        badFrames++;
+        replyLength = 0;
+    }
+}
+
+void VirtualStage::receiveFrame(const struct frame *request) {
+    bool valid = frame_codec::isIntact(*request);
+    __u32 data = frame_codec::dataOf(*request);
+    struct frame response = frame_codec::encode(frame_codec::ERROR_COMMAND, 0xFFFFFFFF, 0xFF);
+    unsigned x, y;
+
+    if(!valid) {
+        badFrames++;
+    }
+
+    switch(valid ? request->command : 0xFF) {
+    case CMD_HALT:
+        stopSequence();
+        emulator.halt();
+        response = frame_codec::encode(CMD_HALT, 0);
+        break;
+    case CMD_GETWIDTH:
+        response = frame_codec::encode(CMD_GETWIDTH, MOTOR_SPAN_IN_MILLIMETERS/MOTOR_MILLIMETERS_PER_MICROSTEP);
+        break;
+    case CMD_GETHEIGHT:
+        response = frame_codec::encode(CMD_GETHEIGHT, MOTOR_SPAN_IN_MILLIMETERS/MOTOR_MILLIMETERS_PER_MICROSTEP);
+        break;
+    case CMD_GETX:
+        emulator.getPosition(x, y);
+        response = frame_codec::encode(CMD_GETX, x);
+        break;
+    case CMD_GETY:
+        emulator.getPosition(x, y);
+        response = frame_codec::encode(CMD_GETY, y);
+        break;
+    case CMD_SETX:
+        emulator.moveX(data);
+        response = frame_codec::encode(CMD_SETX, 0);
+        break;
+    case CMD_SETY:
+        emulator.moveY(data);
+        response = frame_codec::encode(CMD_SETY, 0);
+        break;
+    case CMD_CALIB:
+        response = frame_codec::encode(CMD_CALIB, 0);
+        break;
+    case CMD_GETVERSION:
+        //classic firmware does not know the command
+        if(!active.extended)
+            break;
+
+        response = frame_codec::encode(CMD_GETVERSION, PROTOCOL_VERSION_EXTENDED |
+                                       (CAPABILITY_XY_FRAMES | (active.sequences ? CAPABILITY_SEQUENCES : 0)) << 8);
+        break;
+    case CMD_SEQCLEAR:
+        if(!active.sequences)
+            break;
+
+        stopSequence();
+        emulator.halt();
+        selectedStep = -1;
+        response = frame_codec::encode(CMD_SEQCLEAR, SEQUENCE_CAPACITY);
+        break;
+    case CMD_SEQSTEP:
+        if(!active.sequences || (data & 0xFF) >= SEQUENCE_CAPACITY)
+            break;
+
+        selectedStep = data & 0xFF;
+        steps[selectedStep].flags = data >> 8 & 0xFF;
+        steps[selectedStep].dwell = data >> 16;
+        response = frame_codec::encode(CMD_SEQSTEP, 0);
+        break;
+    case CMD_SEQSTART:
+        if(!active.sequences || !startSequence(data))
+            break;
+
+        response = frame_codec::encode(CMD_SEQSTART, 0);
+        break;
+    case CMD_SEQRELEASE:
+        if(!active.sequences)
+            break;
+
+        //releasing a step that was already left is harmless, so a lost reply can be retried
+        if(sequenceLength > 0 && currentStep == (int) data && dwelling) {
+            released = true;
+            stepSequence();
+        }
+
+        response = frame_codec::encode(CMD_SEQRELEASE, 0);
+        break;
+    }
+
+    //status after the command took effect
+    if(response.command != frame_codec::ERROR_COMMAND) {
+        response = frame_codec::encode(response.command, frame_codec::dataOf(response),
+                                       emulator.isInPosition() ? STAGE_IN_POSITION : STAGE_MOVING);
+    }
+
+    memcpy(reply, &response, sizeof(response));
+    replyLength = sizeof(response);
+}
+
+void VirtualStage::receiveExtendedFrame(const struct extendedFrame *request) {
+    struct extendedFrame response;
+    bool valid = frame_codec::isIntact(*request);
+    unsigned x, y;
+
+    if(!valid) {
+        badFrames++;
+    }
+
+    switch(valid ? request->command : 0xFF) {
+    case CMD_SETXY:
+        emulator.moveTo(frame_codec::xOf(*request), frame_codec::yOf(*request));
+        response = frame_codec::encodeExtended(CMD_SETXY, 0, 0, emulator.isInPosition() ? STAGE_IN_POSITION : STAGE_MOVING);
+        break;
+    case CMD_GETXY:
+        //position and status from the same instant
+        valid = emulator.getPosition(x, y);
+        response = frame_codec::encodeExtended(CMD_GETXY, x, y, valid ? STAGE_IN_POSITION : STAGE_MOVING);
+        break;
+    case CMD_SEQTARGET:
+        if(!active.sequences || selectedStep < 0) {
+            response = frame_codec::encodeExtended(frame_codec::ERROR_COMMAND, 0xFFFFFFFF, 0xFFFFFFFF, 0xFF);
+            break;
+        }
+
+        steps[selectedStep].x = frame_codec::xOf(*request);
+        steps[selectedStep].y = frame_codec::yOf(*request);
+        response = frame_codec::encodeExtended(CMD_SEQTARGET, 0, 0, emulator.isInPosition() ? STAGE_IN_POSITION : STAGE_MOVING);
+        break;
+    case CMD_SEQSTATUS:
+        if(!active.sequences) {
+            response = frame_codec::encodeExtended(frame_codec::ERROR_COMMAND, 0xFFFFFFFF, 0xFFFFFFFF, 0xFF);
+            break;
+        }
+
+        stepSequence();
+        response = frame_codec::encodeExtended(CMD_SEQSTATUS, arrivedSteps, finishedSteps,
+                                               emulator.isInPosition() ? STAGE_IN_POSITION : STAGE_MOVING);
+        break;
+    default:
+        response = frame_codec::encodeExtended(frame_codec::ERROR_COMMAND, 0xFFFFFFFF, 0xFFFFFFFF, 0xFF);
+    }
+
+    memcpy(reply, &response, sizeof(response));
+    replyLength = sizeof(response);
+}
+
+bool VirtualStage::startSequence(unsigned length) {
+    if(length < 1 || length > SEQUENCE_CAPACITY)
+        return false;
+
+    sequenceLength = length;
+    currentStep = 0;
+    dwelling = false;
+    released = false;
+    arrivedSteps = 0;
+    finishedSteps = 0;
+    emulator.moveTo(steps[0].x, steps[0].y);
+    return true;
+}
+
+//the counts stay readable through CMD_SEQSTATUS
+void VirtualStage::stopSequence() {
+    sequenceLength = 0;
+}
+
+//Settles at the current step, pulses the trigger, waits out the dwell and any
+//hold, then heads for the next step.
+void VirtualStage::stepSequence() {
+    typedef std::chrono::steady_clock clock;
+
+    while(sequenceLength > 0) {
+        const SequenceStep &step = steps[currentStep];
+
+        if(!dwelling) {
+            if(!emulator.isInPosition())
+                return;
+
+            dwelling = true;
+            dwellEnd = clock::now() + std::chrono::milliseconds(step.dwell);
+            arrivedSteps++;
+
+            if(step.flags & STEP_TRIGGER) {
+                triggers++;
+            }
+        }
+
+        if(clock::now() < dwellEnd || ((step.flags & STEP_HOLD) && !released))
+            return;
+
+        finishedSteps++;
+        currentStep++;
+        dwelling = false;
+        released = false;
+
+        if(currentStep == sequenceLength) {
+            sequenceLength = 0;
+            return;
+        }
+
+        emulator.moveTo(steps[currentStep].x, steps[currentStep].y);
+    }
+}
+
+//flips each bit with the configured error rate
+void VirtualStage::corrupt(__u8 *bytes, int length) {
+    if(active.bitErrorRate <= 0)
+        return;
+
+    for(int i = 0; i < length; i++) {
+        for(int bit = 0; bit < 8; bit++) {
+            if(random() < active.bitErrorRate) {
+                bytes[i] ^= 1 << bit;
+                bitErrors++;
+            }
+        }
+    }
+}
+
+//uniform in [0, 1) from a seeded xorshift generator
+double VirtualStage::random() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState / 4294967296.0;
+}
@@ -0,0 +1,113 @@
+#ifndef VIRTUALSTAGE_HPP
+#define VIRTUALSTAGE_HPP
+
+#include "stagetransport.hpp"
+#include "stagecontroller.h"
+#include "stageemulator.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+//Stand-in for the stage microcontroller at the far end of a socketpair. Every
+//write, read and I2C_RDWR message is passed across and acknowledged by the
+//firmware thread, so stage_controller runs its real framing, checksum and error
+//paths without hardware. Messages can be delayed, corrupted or refused to
+//load-test throughput and recovery. Motion comes from a StageEmulator, which
+//the firmware also steps through downloaded sequences with.
+class VirtualStage : public StageTransport {
+
+public:
+    struct Settings {
+        unsigned latency;     //microseconds the firmware takes to acknowledge each message
+        double bitErrorRate;  //chance of each bit being flipped on the wire, both directions
+        double nakRate;       //chance of a message not being acknowledged (EREMOTEIO)
+        bool combined;        //adapter reports I2C_FUNC_I2C
+        bool extended;        //firmware answers CMD_GETVERSION and takes extended frames
+        bool sequences;       //firmware runs downloaded sequences; needs extended
+        unsigned seed;
+    };
+
+    //counted by the firmware thread since open()
+    struct Statistics {
+        unsigned long long messages;
+        unsigned long long naks;
+        unsigned long long bitErrors;
+        unsigned long long badFrames; //requests that failed their checksum or CRC
+        unsigned long long triggers;  //trigger pulses at sequence steps with STEP_TRIGGER
+    };
+
+    VirtualStage();
+    ~VirtualStage();
+
+    static Settings defaultSettings();
+
+    //takes effect at the next open
+    void setSettings(const Settings &settings);
+    Settings getSettings();
+
+    Statistics getStatistics();
+    StageEmulator &getEmulator();
+
+    bool open() override;
+    void close() override;
+    bool isOpen() override;
+    bool supportsCombined() override;
+    int write(const __u8 *bytes, int length) override;
+    int read(__u8 *bytes, int length) override;
+    bool transfer(struct i2c_msg *messages, int count) override;
+
+private:
+    static const int MAX_MESSAGE = 32;
+    static const int SEQUENCE_CAPACITY = 64;
+
+    //one bus message; the reply to a read carries its data after the acknowledge
+    struct Message {
+        __u8 op;
+        __u8 length;
+        __u8 data[MAX_MESSAGE];
+    };
+
+    Settings settings;
+    Settings active; //copy used by the firmware thread while open
+    StageEmulator emulator;
+    int fd;
+    int peerFd;
+    std::thread firmware;
+
+    //reply the firmware shifts out on the next read
+    __u8 reply[MAX_MESSAGE];
+    int replyLength;
+    unsigned randomState;
+
+    //downloaded sequence and how far the firmware has run it
+    stage_controller::SequenceStep steps[SEQUENCE_CAPACITY];
+    int selectedStep;   //step whose target the next CMD_SEQTARGET sets
+    int sequenceLength; //0 while no sequence runs
+    int currentStep;    //step being approached or dwelt at
+    bool dwelling;      //settled at currentStep
+    bool released;      //hold at currentStep lifted
+    std::chrono::steady_clock::time_point dwellEnd;
+    unsigned arrivedSteps;
+    unsigned finishedSteps;
+
+    std::atomic<unsigned long long> messages;
+    std::atomic<unsigned long long> naks;
+    std::atomic<unsigned long long> bitErrors;
+    std::atomic<unsigned long long> badFrames;
+    std::atomic<unsigned long long> triggers;
+
+    int exchange(Message &message);
+    void run();
+    void receive(const __u8 *bytes, int length);
+    void receiveFrame(const struct stage_controller::frame *request);
+    void receiveExtendedFrame(const struct stage_controller::extendedFrame *request);
+    bool startSequence(unsigned length);
+    void stopSequence();
+    void stepSequence();
+    void corrupt(__u8 *bytes, int length);
+    double random();
+
+};
+
+#endif // VIRTUALSTAGE_HPP